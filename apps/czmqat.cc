@@ -1,6 +1,8 @@
 // Yet another ZeroMQ netcat'ish program.
 
 #include "CLI11.hpp"
+#include "ptmp/archive.h"
+#include "ptmp/recorder.h"
 #include <czmq.h>
 
 #include <vector>
@@ -11,12 +13,30 @@
 struct file_opt_t {
     FILE* fp;
     std::string filename;
+    std::string format;
+    int block_kb, rotate_mb, rotate_s, queue;
+    ptmp::internals::ArchiveReader* reader;
+    ptmp::internals::Recorder* recorder;
 };
 
 void make_file_opts(CLI::App* app, file_opt_t& fopt)
 {
     app->add_option("-f,--filename", fopt.filename, "Name of file.");
 }
+void make_ofile_opts(CLI::App* app, file_opt_t& fopt)
+{
+    make_file_opts(app, fopt);
+    app->add_option("-F,--format", fopt.format,
+                    "The file format [legacy|archive], input format is detected");
+    app->add_option("-b,--block-kb", fopt.block_kb,
+                    "Size in kB of archive blocks");
+    app->add_option("-R,--rotate-mb", fopt.rotate_mb,
+                    "Start a new file after this many MB");
+    app->add_option("-T,--rotate-s", fopt.rotate_s,
+                    "Start a new file after this many seconds");
+    app->add_option("-q,--queue", fopt.queue,
+                    "Most messages waiting to be written before dropping");
+}
 
 struct sock_opt_t {
     zsock_t* sock;
@@ -98,19 +118,6 @@ zmsg_t* read_msg(FILE* fp)
     return msg;
 }
 
-int write_msg(FILE* fp, zmsg_t* msg)
-{
-    zframe_t* frame = zmsg_encode(msg);
-    zchunk_t* chunk = zchunk_unpack(frame);
-    zframe_destroy(&frame);
-    size_t size = zchunk_size(chunk);
-    fwrite(&size, sizeof(size_t), 1, fp);
-    int rc = zchunk_write(chunk, fp);
-    zchunk_destroy(&chunk);
-    return rc;
-}
-
-
 int main(int argc, char* argv[])
 {
     zsys_init();
@@ -145,9 +152,9 @@ int main(int argc, char* argv[])
     // files
     CLI::App* ifile = app.add_subcommand("ifile", "Input file specification");
     CLI::App* ofile = app.add_subcommand("ofile", "Output file specification");
-    file_opt_t ifopt{NULL,""}, ofopt{NULL,""};
+    file_opt_t ifopt{NULL,"","legacy",1024,0,0,65536,NULL,NULL}, ofopt{NULL,"","legacy",1024,0,0,65536,NULL,NULL};
     make_file_opts(ifile, ifopt);
-    make_file_opts(ofile, ofopt);
+    make_ofile_opts(ofile, ofopt);
 
     CLI11_PARSE(app, argc, argv);
     
@@ -159,13 +166,31 @@ int main(int argc, char* argv[])
     }
 
     if (!ifopt.filename.empty()) {
-        ifopt.fp = fopen(ifopt.filename.c_str(), "r");
+        ifopt.reader = ptmp::internals::ArchiveReader::open(ifopt.filename);
+        if (!ifopt.reader and !ptmp::internals::is_archive(ifopt.filename)) {
+            ifopt.fp = fopen(ifopt.filename.c_str(), "r");
+        }
     }
     if (!ofopt.filename.empty()) {
-        ofopt.fp = fopen(ofopt.filename.c_str(), "w");
+        // Files are written by a thread of their own.
+        nlohmann::json rcfg{
+            {"ofile", ofopt.filename}, {"format", ofopt.format},
+            {"block_kb", ofopt.block_kb}, {"queue", ofopt.queue}};
+        if (ofopt.rotate_mb > 0) {
+            rcfg["rotate_mb"] = ofopt.rotate_mb;
+        }
+        if (ofopt.rotate_s > 0) {
+            rcfg["rotate_s"] = ofopt.rotate_s;
+        }
+        try {
+            ofopt.recorder = new ptmp::internals::Recorder(rcfg);
+        }
+        catch (const std::runtime_error&) {
+            return -1;          // reason already logged
+        }
     }
 
-    if (!(ifopt.fp or isopt.sock)) {
+    if (!(ifopt.fp or ifopt.reader or isopt.sock)) {
         zsys_error("Neither file nor socket input be");
         return -1;
     }
@@ -181,7 +206,16 @@ int main(int argc, char* argv[])
         ++count;
 
         zmsg_t* msg=NULL;
-        if (ifopt.fp) {
+        if (ifopt.reader) {
+            msg = ifopt.reader->read();
+            if (!msg) {
+                if (debug>=1) {
+                    zsys_info("End of file reached");
+                }
+                break;
+            }
+        }
+        else if (ifopt.fp) {
             msg = read_msg(ifopt.fp);
             if (!msg) {
                 if (debug>=1) {
@@ -205,8 +239,15 @@ int main(int argc, char* argv[])
             zclock_sleep(loop_delay);
         }
 
-        if (ofopt.fp) {
-            write_msg(ofopt.fp, msg);
+        if (ofopt.recorder) {
+            zmsg_t* rec = osopt.sock ? ptmp::internals::dup_msg(msg) : msg;
+            ofopt.recorder->push(&rec);
+            if (rec) {
+                zmsg_destroy(&rec); // dropped
+            }
+            if (!osopt.sock) {
+                msg = NULL;
+            }
         }
         if (osopt.sock) {
             if (debug>=2) { zsys_debug("send message"); }
@@ -226,9 +267,8 @@ int main(int argc, char* argv[])
     }
     zclock_sleep(endwait);
 
-    if (ofopt.fp) {
-        fclose(ofopt.fp);
-    }
+    delete ofopt.recorder;      // drains its queue
+    delete ifopt.reader;
     if (isopt.sock) {
         zsock_destroy(&isopt.sock);
     }
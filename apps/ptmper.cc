@@ -14,6 +14,12 @@
 
    - reprieve :: delay in seconds after ttl has passed and before proxies are destroyed.
 
+   - io_threads :: number of ZeroMQ I/O threads (default 1).
+
+   - io_cpus :: CPUs for the ZeroMQ I/O threads, an array or a list like "0-3,8".
+
+   - cpus, numa, numa_strict :: placement of all proxies, see below.
+
    - proxies :: a JSON array with elements described next
 
    Each element of the proxies array is a JSON object with these top level attributes.
@@ -24,10 +30,18 @@
 
    - data :: a type-specific JSON object to give as configuration to the proxy
 
+   - cpus :: optional CPUs to pin the proxy's threads to, an array or a list like "0-3,8".
+
+   - numa :: optional NUMA node to allocate the proxy's memory from
+     and, if no cpus are given, to pin to the CPUs of.
+
+   - numa_strict :: if true, only allocate from the numa node, else prefer it.
+
  */
 
 #include "ptmp/api.h"
 #include "ptmp/factory.h"
+#include "ptmp/internals.h"
 #include "ptmp/version.h"
 
 #include <iostream>
@@ -76,6 +90,30 @@ int main(int argc, char* argv[])
         verbose = config["verbose"];
     }
 
+    // ZeroMQ I/O threads must be set before any socket exists, so
+    // here and not in the composer.
+    int io_threads = 0;
+    if (config["io_threads"].is_number()) {
+        io_threads = config["io_threads"];
+    }
+    std::vector<int> io_cpus;
+    if (config["io_cpus"].is_string()) {
+        io_cpus = ptmp::internals::parse_cpulist(config["io_cpus"]);
+    }
+    else if (config["io_cpus"].is_array()) {
+        for (const auto& jcpu : config["io_cpus"]) {
+            if (!jcpu.is_number_integer()) {
+                zsys_error("ptmper: \"io_cpus\" holds a non-integer: %s", jcpu.dump().c_str());
+                io_cpus.clear();
+                break;
+            }
+            io_cpus.push_back(jcpu);
+        }
+    }
+    if (io_threads > 0 or !io_cpus.empty()) {
+        ptmp::internals::set_io_threads(io_threads, io_cpus);
+    }
+
     if (pause > 0) {
         zclock_sleep(pause*1000);
     }
@@ -0,0 +1,217 @@
+// Extract the TPSet messages within a tstart range, detids and
+// channel range from a captured file into a new file.
+
+#include "CLI11.hpp"
+#include "ptmp/archive.h"
+#include "ptmp/internals.h"
+
+#include <czmq.h>
+
+#include <deque>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ptmp::internals;
+
+// Write selected messages in the output format.
+struct output_t {
+    FILE* fp{nullptr};
+    ArchiveWriter* archive{nullptr};
+    uint64_t nmsgs{0};
+    bool failed{false};
+
+    void operator()(zmsg_t* msg) {
+        if (archive) {
+            failed = !archive->write(msg) or failed;
+        }
+        else {
+            write(fp, msg);
+        }
+        ++nmsgs;
+    }
+    void operator()(const archive_record_t& rec) {
+        if (archive) {
+            failed = !archive->write(rec) or failed; // as is, no decoding
+        }
+        else {
+            zmsg_t* msg = rec.msg();
+            write(fp, msg);
+            zmsg_destroy(&msg);
+        }
+        ++nmsgs;
+    }
+};
+
+// Blocks are chosen by the index, then scanned in parallel.  Results
+// are written in file order.
+static uint64_t slice_archive(ArchiveReader& ar, const archive_select_t& sel,
+                              size_t nthreads, output_t& out)
+{
+    typedef std::vector<archive_record_t> records_t;
+    std::deque<std::future<records_t> > pending;
+    uint64_t nskipped = 0;
+    for (size_t iblock=0; iblock<ar.blocks().size(); ++iblock) {
+        if (!sel(ar.blocks()[iblock])) {
+            nskipped += ar.blocks()[iblock].nrecords;
+            continue;
+        }
+        pending.push_back(std::async(std::launch::async, [&ar, &sel, iblock]() {
+                    records_t recs;
+                    ar.each(iblock, [&](const archive_record_t& rec) {
+                            if (sel(rec)) {
+                                recs.push_back(rec);
+                            }
+                        });
+                    return recs;
+                }));
+        while (pending.size() > nthreads) {
+            for (const auto& rec : pending.front().get()) {
+                out(rec);
+            }
+            pending.pop_front();
+        }
+    }
+    while (!pending.empty()) {
+        for (const auto& rec : pending.front().get()) {
+            out(rec);
+        }
+        pending.pop_front();
+    }
+    return nskipped;
+}
+
+// The legacy format must be read in order.  Batches of messages are
+// selected in parallel while the next are read.
+static void slice_legacy(FILE* fp, const archive_select_t& sel, size_t nthreads,
+                         size_t batch, output_t& out)
+{
+    typedef std::vector<zmsg_t*> batch_t;
+    std::deque<std::future<batch_t> > pending;
+    bool more = true;
+    while (more or !pending.empty()) {
+        if (more) {
+            batch_t msgs;
+            while (msgs.size() < batch) {
+                zmsg_t* msg = read(fp);
+                if (!msg) {
+                    more = false;
+                    break;
+                }
+                msgs.push_back(msg);
+            }
+            pending.push_back(std::async(std::launch::async, [&sel](batch_t msgs) {
+                        batch_t keep;
+                        for (auto msg : msgs) {
+                            if (sel(msg)) {
+                                keep.push_back(msg);
+                            }
+                            else {
+                                zmsg_destroy(&msg);
+                            }
+                        }
+                        return keep;
+                    }, std::move(msgs)));
+        }
+        while (pending.size() > nthreads or (!more and !pending.empty())) {
+            for (auto msg : pending.front().get()) {
+                out(msg);
+                zmsg_destroy(&msg);
+            }
+            pending.pop_front();
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    CLI::App app{"Extract TPSets by time, detid and channel from a captured file"};
+
+    std::string ifile, ofile, format;
+    app.add_option("-i,--input", ifile, "Input file, archive or legacy")->required();
+    app.add_option("-o,--output", ofile, "Output file")->required();
+    app.add_option("-F,--format", format,
+                   "Output format [legacy|archive], default is that of the input");
+
+    archive_select_t sel;
+    app.add_option("-b,--tbeg", sel.tbeg, "Least tstart to keep");
+    app.add_option("-e,--tend", sel.tend, "Keep tstart less than this");
+    app.add_option("-d,--detids", sel.detids, "Detids to keep, default all")->expected(-1);
+    std::vector<uint32_t> channels;
+    app.add_option("-c,--channels", channels,
+                   "Least and greatest channel, keeping TPSets which overlap")->expected(2);
+
+    size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+    app.add_option("-j,--threads", nthreads, "Number of threads");
+    size_t batch = 4096;
+    app.add_option("-B,--batch", batch, "Messages per batch for legacy input");
+
+    CLI11_PARSE(app, argc, argv);
+    zsys_init();
+
+    if (channels.size() == 2) {
+        sel.chanlo = channels[0];
+        sel.chanhi = channels[1];
+    }
+    nthreads = std::max((size_t)1, nthreads);
+    batch = std::max((size_t)1, batch);
+
+    ArchiveReader* ar = ArchiveReader::open(ifile);
+    FILE* ifp = nullptr;
+    if (!ar and !is_archive(ifile)) {
+        ifp = fopen(ifile.c_str(), "r");
+        if (!ifp) {
+            zsys_error("failed to open %s", ifile.c_str());
+            return -1;
+        }
+    }
+    if (!ar and !ifp) {
+        zsys_error("failed to read archive %s", ifile.c_str());
+        return -1;
+    }
+    if (format.empty()) {
+        format = ar ? "archive" : "legacy";
+    }
+
+    output_t out;
+    if (format == "archive") {
+        out.archive = new ArchiveWriter(ofile);
+    }
+    else if (format == "legacy") {
+        out.fp = fopen(ofile.c_str(), "w");
+        if (!out.fp) {
+            zsys_error("failed to open %s", ofile.c_str());
+            return -1;
+        }
+    }
+    else {
+        zsys_error("Unknown file format: \"%s\"", format.c_str());
+        return -1;
+    }
+
+    const int64_t t0 = zclock_usecs();
+    if (ar) {
+        uint64_t nskipped = slice_archive(*ar, sel, nthreads, out);
+        zsys_info("skipped %ld of %ld messages by index", nskipped, ar->nrecords());
+        delete ar;
+    }
+    else {
+        slice_legacy(ifp, sel, nthreads, batch, out);
+        fclose(ifp);
+    }
+    if (out.archive) {
+        out.failed = !out.archive->close() or out.failed;
+        delete out.archive;
+    }
+    if (out.fp) {
+        fclose(out.fp);
+    }
+    if (out.failed) {
+        zsys_error("failed to write %s", ofile.c_str());
+        return -1;
+    }
+    zsys_info("wrote %ld messages to %s in %.3f s", out.nmsgs, ofile.c_str(),
+              1e-6*(zclock_usecs() - t0));
+    return 0;
+}
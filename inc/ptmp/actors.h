@@ -12,6 +12,7 @@ namespace ptmp {
         void monitor(zsock_t* pipe, void* vargs);
         void tap(zsock_t* pipe, void* vargs);
         void replay(zsock_t* pipe, void* vargs);
+        void fileplay(zsock_t* pipe, void* vargs);
         void sorted(zsock_t* pipe, void* vargs);
         void zipper(zsock_t* pipe, void* vargs);
         void window(zsock_t* pipe, void* vargs);
@@ -74,6 +74,14 @@ namespace ptmp {
         */
         bool operator()(data::TPSet& tps, int timeout_msec=-1);
 
+        /**
+           Receive next TPSet into a new object allocated on the
+           given arena which owns it.  Return nullptr on timeout or
+           break and otherwise behave as above.  Resetting the arena
+           frees all TPSets received this way in one step.
+        */
+        data::TPSet* operator()(google::protobuf::Arena& arena, int timeout_msec=-1);
+
         TPReceiver() =default;
         TPReceiver(const TPReceiver&) =delete;
         TPReceiver& operator=(const TPReceiver&) =delete;            
@@ -120,6 +128,23 @@ namespace ptmp {
         zactor_t* m_actor;
     };
 
+    /**
+       A "free agent" that zips many inputs like TPZipper but with a
+       tree of zipper stages, each in its own thread.  The config is
+       as for TPZipper with each input endpoint feeding a leaf stage.
+
+       - fanout :: most inputs of any one stage (default 16).
+
+       See docs/tpzipper.org.
+    */
+    class TPZipperTree : public TPAgent {
+    public:
+        TPZipperTree(const std::string& config);
+        virtual ~TPZipperTree();
+    private:
+        std::vector<zactor_t*> m_actors;
+    };
+
     /**
        A "free agent" that accepts TPSets on an input socket and
        "replays" them to an output socket.  The replay is done in a
@@ -143,7 +168,11 @@ namespace ptmp {
            TPSender/TPReceiver held by a key "sender" and "receiver".
            An optional "speed" atribute provides the number of
            hardware data clock ticks per microsecond (eg, default of
-           50 for PDSP).
+           50 for PDSP).  An optional "schema" attribute selects the
+           output message schema version (0, default, or 2).  An
+           optional "watermark" attribute gives a period in ms after
+           which a watermark (marked empty TPSet) is sent while waiting for
+           the next message to be due (default 0, never).
         */
 
             
@@ -160,6 +189,49 @@ namespace ptmp {
         
     };
 
+    /**
+       A "free agent" that plays TPSets from many captured files, as
+       a TPCat per file, a TPReplay per stream and a TPZipper would,
+       in one thread.  The files are merged in order of "tstart" and
+       paced as by TPReplay.  Each TPSet is sent to the output for
+       its detid, if any, else to the default output.
+    */
+    class TPFilePlay : public TPAgent {
+    public:
+        /**
+           Create with a config object with attributes:
+
+           - files :: array of file names, each a legacy or archive
+             capture holding TPSets in order of "tstart".
+
+           - output :: optional default socket description.
+
+           - outputs :: optional array of objects each with a "detid"
+             and a "socket" description.
+
+           - speed, watermark, schema, rewrite_count, rewrite_tstart ::
+             as for TPReplay.  A speed of 0 plays as fast as possible.
+
+           - rewrite_created :: if true (default), set "created" to
+             the send time.  If false, and no other rewrite is
+             given, messages are sent as read without decoding.
+
+           - readahead :: most messages read ahead per file (default
+             1024).
+
+           - clone :: optional object with "count", "detid_offset",
+             "detid_step" and "toffset" to send each message as count
+             synthetic links with new detids and tstart offsets.
+
+           See docs/fileplay.org.
+        */
+        TPFilePlay(const std::string& config);
+
+        virtual ~TPFilePlay();
+    private:
+        zactor_t* m_actor;
+    };
+
     /// A "free agent" that applies hw clock windowing to a stream of
     /// TPSets at the TP level.
     class TPWindow : public TPAgent {
@@ -172,7 +244,8 @@ namespace ptmp {
            TrigPrims are rewritten.  A TrigPrim is added to a windowed
            TPSet based solely on its tstart.  This means that any
            activity spanning a window boundary will present a ragged
-           edge.  A future "TPSlice" may be invented.
+           edge.  Sliding windows (see tstride) may be used so that
+           such activity is held whole by some window.
         
            The configuration parameters are:
         
@@ -185,10 +258,34 @@ namespace ptmp {
            - toffset :: start window this many HW clock ticks from 0.
         
            - tspan :: the span of the window in the HW clock.
+
+           - tstride :: the time between the starts of windows in the
+           HW clock.  It must divide tspan.  Default is tspan giving
+           non-overlapping windows.
         
            - tbuffer :: the minimum time span of a buffer defined on
            TrigPrim::tstart values which is maintained before taking
            wasy "tspan" worth of time to build output TPSet.
+
+           - recv_batch :: most input messages to drain per wakeup (default 64).
+
+           - schema :: output message schema version, 0 (default) or
+           2 to add a header frame.  See docs/message-schema.org.
+
+           - shards :: number of worker threads which window TPs
+           split by channel range (default 1, no workers).
+
+           - shard_chans :: width of the channel ranges dealt to
+           shards (default 128).
+
+           - watermark :: period in ms after which, if nothing was
+           output, a watermark (marked empty TPSet) is sent (default 0,
+           never).  Input watermarks are always used to send windows
+           early.  See docs/message-schema.org.
+
+           - budget_tps :: most TPs to hold (default 0, no limit).
+           Past it, TPs are shed by "shed_policy", one of "oldest"
+           (default), "lowest_adc" or "detid".  See docs/tpwindow.org.
         */
         TPWindow(const std::string& config);
 
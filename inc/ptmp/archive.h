@@ -0,0 +1,180 @@
+#ifndef PTMP_ARCHIVE_H
+#define PTMP_ARCHIVE_H
+
+#include "ptmp/data.h"
+#include <czmq.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace ptmp {
+    namespace internals {
+
+        // An archive file holds messages in blocks with an index of
+        // the detids and tstart range of each block so that a reader
+        // may go straight to the blocks it wants.  It is read
+        // through mmap() and message frames are seen in place.  The
+        // legacy format of read()/write() has neither and must be
+        // decoded from its start.  See docs/archive.org.
+
+        // One message in a mapped archive, valid while its reader is.
+        struct archive_record_t {
+            const uint8_t* data{nullptr}; // first frame's bytes
+            const uint32_t* sizes{nullptr}; // size of each frame
+            uint32_t nframes{0};
+            uint32_t detid{0}, ntps{0}, chanbeg{0}, chanend{0};
+            ptmp::data::data_time_t tstart{0};
+
+            // Return the bytes of frame ind and set its size.
+            const uint8_t* frame(uint32_t ind, size_t& size) const;
+
+            // Return a new message holding a copy of the frames.
+            zmsg_t* msg() const;
+        };
+
+        // The index of one block.
+        struct archive_block_t {
+            uint64_t offset{0}; // in the file, of the block header
+            uint32_t nrecords{0};
+            ptmp::data::data_time_t tmin{0}, tmax{0};
+            // Per detid record count and tstart range.
+            struct detid_t {
+                uint32_t detid, nrecords;
+                ptmp::data::data_time_t tmin, tmax;
+            };
+            std::vector<detid_t> detids;
+
+            // True if the block may hold a message of a detid in
+            // the set (all if empty) with tstart in [tbeg, tend).
+            bool overlaps(ptmp::data::data_time_t tbeg, ptmp::data::data_time_t tend,
+                          const std::vector<uint32_t>& dets) const;
+        };
+
+        class ArchiveReader {
+        public:
+            // Map the file.  Return nullptr if it can not be opened
+            // or mapped or is not an archive, eg if it is in the
+            // legacy format.  Use is_archive() to tell these apart.
+            static ArchiveReader* open(const std::string& filename);
+            ~ArchiveReader();
+
+            // The index, read from the file or, if the writer did not
+            // finish, rebuilt by scanning the blocks.
+            const std::vector<archive_block_t>& blocks() const { return m_blocks; }
+
+            // Position before the first record of block iblock.
+            void seek(size_t iblock);
+
+            // Set rec to the next record and return true, or return
+            // false at the end of the file.
+            bool next(archive_record_t& rec);
+
+            // Return a copy of the next message or nullptr at end.
+            zmsg_t* read();
+
+            // Visit each record of one block.
+            template<typename Func>
+            void each(size_t iblock, Func func) const {
+                archive_record_t rec;
+                const uint8_t* pos = block_begin(iblock);
+                const uint8_t* end = block_end(iblock);
+                while (pos < end) {
+                    pos = parse(pos, end, rec);
+                    if (!pos) {
+                        break;  // bad record ends the block
+                    }
+                    func(rec);
+                }
+            }
+
+            const std::string& filename() const { return m_filename; }
+            uint64_t nrecords() const { return m_nrecords; }
+
+        private:
+            ArchiveReader(const std::string& filename, int fd, const uint8_t* base, size_t size);
+            void load_index();
+            void scan_index();
+            bool valid_block(uint64_t offset) const;
+            const uint8_t* block_begin(size_t iblock) const;
+            const uint8_t* block_end(size_t iblock) const;
+            const uint8_t* parse(const uint8_t* pos, const uint8_t* end,
+                                 archive_record_t& rec) const;
+
+            std::string m_filename;
+            int m_fd;
+            const uint8_t* m_base;
+            size_t m_size;
+            std::vector<archive_block_t> m_blocks;
+            uint64_t m_nrecords{0};
+            size_t m_block{0};
+            const uint8_t *m_pos{nullptr}, *m_end{nullptr};
+        };
+
+        class ArchiveWriter {
+        public:
+            // Create the file.  Messages are buffered into blocks of
+            // about block_kb kB.  Throws on error.
+            ArchiveWriter(const std::string& filename, size_t block_kb = 1024);
+
+            // Closes.
+            ~ArchiveWriter();
+
+            // Add a message, not destroying it.  Any topic frame is
+            // not kept.  Return false if not written.  Once a write
+            // to the file fails, this and all later calls fail.
+            bool write(zmsg_t* msg);
+
+            // Add a record from another archive as is.  Return as
+            // above.
+            bool write(const archive_record_t& rec);
+
+            // Write any partial block and the index.  The file is
+            // readable, without an index, before this is called.
+            // Return false if any write to the file failed.
+            bool close();
+
+            uint64_t nrecords() const { return m_nrecords; }
+            uint64_t nbytes() const { return m_offset; }
+
+        private:
+            bool add(const archive_record_t& rec, const std::vector<std::pair<const void*, size_t> >& frames);
+            bool flush_block();
+            // Write to the file.  Return false if this or any earlier
+            // write failed.
+            bool put(const void* data, size_t size);
+
+            std::string m_filename;
+            FILE* m_fp{nullptr};
+            size_t m_block_bytes;
+            std::string m_buf;  // current block's records
+            archive_block_t m_cur;
+            std::vector<archive_block_t> m_index;
+            uint64_t m_offset{0}, m_nrecords{0};
+            bool m_ok{true};
+        };
+
+        // Select TPSet messages with tstart in [tbeg, tend), a detid
+        // in the set (any if empty) and channels [chanbeg, chanend]
+        // overlapping [chanlo, chanhi].  A watermark is selected by
+        // time and detid alone.  Only headers are read, TPs are
+        // never decoded.
+        struct archive_select_t {
+            ptmp::data::data_time_t tbeg{0}, tend{~0ULL};
+            std::vector<uint32_t> detids;
+            uint32_t chanlo{0}, chanhi{0xffffffff};
+
+            bool operator()(uint32_t detid, ptmp::data::data_time_t tstart, uint32_t ntps,
+                            uint32_t chanbeg, uint32_t chanend) const;
+            bool operator()(const archive_record_t& rec) const;
+            bool operator()(const archive_block_t& blk) const;
+            // A message in the legacy format, not destroyed.
+            bool operator()(zmsg_t* msg) const;
+        };
+
+        // Return true if the file is an archive.
+        bool is_archive(const std::string& filename);
+    }
+}
+
+#endif
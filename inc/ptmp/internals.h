@@ -15,11 +15,136 @@ namespace ptmp {
         zsock_t* endpoint(const std::string& config);
         std::vector<zsock_t*> perendpoint(const std::string& config);
 
+        // Message schema versions held in the first frame.  Version 0
+        // is [id, TPSet].  Version 2 is [id, msg_header_t, TPSet]
+        // where the header frame allows routing (zipper, sorted,
+        // replay) without parsing the payload.  Version 1 is reserved
+        // for the draft schema in ptmpv1.proto.
+        const int msg_schema_v0 = 0;
+        const int msg_schema_v2 = 2;
+
+        // A "local" message is [id, msg_header_t, TPSet object] and
+        // only passes over inproc sockets between agents in one
+        // process.  The last frame's data is the TPSet itself, owned
+        // by the frame and deleted when its last copy is destroyed.
+        // It must not be modified.  The reserved member of its header
+        // holds local_token().  See docs/message-schema.org.
+        const int msg_schema_local = 3;
+
+        // A random value chosen once per process.  A local message
+        // without it did not come from this process and is malformed.
+        uint32_t local_token();
+
+        // The fixed layout v2 header frame.  Members are ordered so
+        // there is no padding.  Values are in host (little endian)
+        // byte order, same as the message ID frame.
+        struct msg_header_t {
+            ptmp::data::data_time_t tstart;
+            ptmp::data::real_time_t created;
+            uint32_t count;
+            uint32_t detid;
+            uint32_t tspan;
+            uint32_t ntps;
+            uint32_t flags;     // msg_flag_* bits
+            uint32_t reserved;  // zero, local_token() if local
+        };
+        static_assert(sizeof(msg_header_t) == 40, "msg_header_t must be packed");
+
+        // Bits of msg_header_t::flags.
+        const uint32_t msg_flag_watermark = 0x1;
+
+        // Fill a header from a TPSet.
+        void make_header(const ptmp::data::TPSet& tps, msg_header_t& hdr);
+
+        // A TPSet marked as a "watermark" holds no TPs and promises
+        // that no TPs with a tstart earlier than its tstart will
+        // follow from its detid.  The count of a watermark is not
+        // part of the detid's message sequence and is not used to
+        // detect loss.  An unmarked TPSet with no TPs is ordinary
+        // data.  See docs/message-schema.org.
+        inline bool is_watermark(const msg_header_t& hdr) { return hdr.flags & msg_flag_watermark; }
+        inline bool is_watermark(const ptmp::data::TPSet& tps) { return tps.watermark(); }
+
+        // Fill tps to be a watermark.
+        void make_watermark(ptmp::data::TPSet& tps, uint32_t detid,
+                            ptmp::data::data_time_t tstart);
+
+        // Fill hdr by scanning the protobuf wire format of a
+        // serialized TPSet.  Only the scalar fields are decoded, the
+        // repeated TrigPrims are counted by skipping over them
+        // without being parsed.  Returns false if the data is
+        // malformed or lacks a required field.
+        bool peek_tpset(const void* data, size_t size, msg_header_t& hdr);
+
+        // As above and also fill the channel range and total ADC.
+        struct tpset_extra_t;
+        bool peek_tpset(const void* data, size_t size, msg_header_t& hdr,
+                        tpset_extra_t& extra);
+
+        // A message may start with an optional "topic" frame ahead
+        // of the schema ID frame so that a SUB can subscribe by
+        // detector and channel.  It holds the TPSet detid and then
+        // chanbeg, each as a big endian uint32 so that a prefix
+        // covers a range.  A watermark has chanbeg of all ones.
+        // See docs/message-schema.org.
+        const size_t msg_topic_size = 8;
+        const uint32_t topic_watermark = 0xffffffff;
+
+        // Return the topic for the given detid and chanbeg.
+        std::string msg_topic(uint32_t detid, uint32_t chanbeg);
+
+        // Prepend a topic frame made from the content if the message
+        // lacks one.  Return false if the message is malformed.
+        bool add_topic(zmsg_t* msg);
+
+        // Remove any topic frame.
+        void strip_topic(zmsg_t* msg);
+
+        // Return SUB prefixes matching TPSets from detid with chanbeg
+        // in [chanlo, chanhi], and the detid's watermarks.
+        std::vector<std::string> topic_subscriptions(uint32_t detid, uint32_t chanlo,
+                                                     uint32_t chanhi);
+
+        // Return the schema version of the message or -1 if it is
+        // malformed.  Does not otherwise inspect the message, except
+        // for the header token and payload size of a local message.
+        int msg_schema(zmsg_t* msg);
+
+        // Return true if the output socket configuration sets
+        // "local".  It is refused, with an error, unless every
+        // address is inproc:// as TPSet objects can not leave the
+        // process.
+        bool local_output(const std::string& config);
+
+        // Fill hdr from the message.  For v2 this reads only the
+        // header frame.  For v0 the payload is peeked.  Returns false
+        // if the message is malformed.  Does not destroy the message.
+        bool msg_header(zmsg_t* msg, msg_header_t& hdr);
+
         // Receive contents of a message by setting the TPSet.  Destroys the message.
         void recv(zmsg_t** msg, ptmp::data::TPSet& tps);
         // as above but does not destroy.
         void recv_keep(zmsg_t* msg, ptmp::data::TPSet& tps);
-        void send(zsock_t* sock, const ptmp::data::TPSet& tps);
+        // Receive into a new TPSet allocated on the arena.  The
+        // arena owns the returned TPSet.  Destroys the message.
+        ptmp::data::TPSet* recv(zmsg_t** msg, google::protobuf::Arena* arena);
+        // Send TPSet using the given message schema version (0 or
+        // 2), with a topic frame if topic is true.
+        void send(zsock_t* sock, const ptmp::data::TPSet& tps, int schema=msg_schema_v0,
+                  bool topic=false);
+
+        // Return the TPSet held by a local message or nullptr if the
+        // message is not local.  The message keeps ownership.
+        const ptmp::data::TPSet* local_tpset(zmsg_t* msg);
+
+        // Replace a local message with its serialized form in the
+        // given schema.  Other messages are left as is.
+        void materialize(zmsg_t** msg, int schema=msg_schema_v0);
+
+        // Return a copy of the message which may outlive it.  A local
+        // message is serialized as zmsg_dup() would copy the bytes of
+        // its TPSet object without owning them.
+        zmsg_t* dup_msg(zmsg_t* msg);
 
         void microsleep(ptmp::data::real_time_t microseconds);
 
@@ -33,21 +158,229 @@ namespace ptmp {
         class Socket {
             zsock_t* m_sock;
             zpoller_t* m_poller;
+            bool m_topic{false};
         public:
             Socket(const std::string& config);
             ~Socket();
             zsock_t* get() { return m_sock; }
 
+            // True if the socket config asks to send topic frames.
+            bool topic() const { return m_topic; }
+
             // Return a message.  Negative timeout waits inefinitely.
             zmsg_t* msg(int timeout_msec=-1);
 
         };
 
 
+        /** Send messages to an output socket while remaining
+            responsive to commands on an actor pipe.
+
+            When the output is writable a send costs nothing extra.
+            When it would block (eg, at HWM) a single poll waits for
+            either output to become writable or for a command to
+            arrive on the pipe.  Time spent blocked is accumulated in
+            the stats.  If batch is larger than one, messages are
+            queued and sent once that many are held or on flush().
+            When set to not block, messages which can not go out are
+            held instead of waiting.  The sockets are not owned.
+        */
+        class CarefulSender {
+        public:
+            struct stats_t {
+                uint64_t nsent{0};     // number of messages sent
+                uint64_t ndropped{0};  // number lost to a failed send
+                uint64_t nblocked{0};  // number of times a send had to wait
+                ptmp::data::real_time_t tblocked{0}; // total us spent waiting
+            };
+
+            CarefulSender(zsock_t* output, zsock_t* pipe, size_t batch=1);
+            ~CarefulSender();
+
+            // Send or queue the message, taking ownership.  Return 0
+            // if okay or -1 if a command arrived on the pipe while
+            // waiting or the context was terminated in which case any
+            // held messages are destroyed.  A message which fails to
+            // send for another reason is destroyed and counted.
+            int operator()(zmsg_t** msg);
+
+            // Serialize and send the TPSet as per send().
+            int operator()(const ptmp::data::TPSet& tps, int schema=msg_schema_v0);
+
+            // Send the TPSet as a local message, taking ownership.
+            // Queued messages are sent first.  Return as above.
+            int operator()(ptmp::data::TPSet* tps);
+
+            // If true, all peers are in this process and local
+            // messages are passed on as is.  Otherwise they are
+            // serialized on the way out.  Default is false.
+            void set_local(bool local) { m_local = local; }
+            bool local() const { return m_local; }
+
+            // If true, messages are sent with a topic frame, else
+            // any topic frame is removed.  Default is false.
+            void set_topic(bool topic) { m_topic = topic; }
+
+            // If false, never wait for the output.  Messages which
+            // can not be sent are held, in order, for a later send or
+            // flush().  Default is true.
+            void set_blocking(bool blocking) { m_blocking = blocking; }
+
+            // If nonzero, wait for the output by sleeping this many
+            // ms between checks rather than polling.  This is slower
+            // and is only meant as a baseline for benchmarks.
+            // Default is 0.
+            void set_spin(int ms) { m_spin_ms = ms; }
+
+            // Send any queued messages.  Return as above.
+            int flush();
+
+            // Number of messages queued or held for sending.
+            size_t pending() const { return m_queue.size(); }
+
+            zsock_t* output() { return m_output; }
+
+            // Access stats.  Caller may reset them.
+            stats_t& stats() { return m_stats; }
+
+        private:
+            // A queued message, either serialized or a local TPSet.
+            struct pending_t {
+                zmsg_t* msg{nullptr};
+                ptmp::data::TPSet* tps{nullptr};
+            };
+
+            // Wait until output is writable.  Return -1 on pipe
+            // command or 1 if not writable and not blocking.
+            int wait_writable();
+            // Send one message to a writable output.  Return -1 if
+            // the context was terminated.
+            int send_one(pending_t& one);
+            // Send the frames of a local message, as send_one().
+            int send_local(ptmp::data::TPSet* tps);
+            void clear();
+
+            zsock_t *m_output, *m_pipe;
+            size_t m_batch;
+            bool m_local{false}, m_topic{false}, m_blocking{true};
+            int m_spin_ms{0};
+            std::vector<pending_t> m_queue;
+            stats_t m_stats;
+        };
+
+        /** A protobuf arena with an owned initial block of memory.
+            TPSets (and their TrigPrims) made on it are freed all at
+            once by reset() and the initial block is kept for reuse
+            so a steady state of parsing or building TPSets which fit
+            in the block makes no heap allocations.
+        */
+        class ReusableArena {
+        public:
+            ReusableArena(size_t initial_bytes = 1<<20);
+            ~ReusableArena();
+
+            google::protobuf::Arena* get() { return m_arena; }
+
+            // Return a new, empty TPSet owned by the arena.
+            ptmp::data::TPSet* make_tpset();
+
+            // Free everything made on the arena.  Return number of
+            // bytes that had been used.
+            uint64_t reset();
+
+            ReusableArena(const ReusableArena&) =delete;
+            ReusableArena& operator=(const ReusableArena&) =delete;
+        private:
+            std::vector<char> m_block;
+            google::protobuf::Arena* m_arena;
+        };
+
+        // Build a schema message for the TPSet.  Caller takes ownership.
+        zmsg_t* make_msg(const ptmp::data::TPSet& tps, int schema=msg_schema_v0);
+
+        // TPSet fields which are not held in the message header.
+        struct tpset_extra_t {
+            uint32_t chanbeg{0}, chanend{0}, totaladc{0};
+        };
+
+        // Append to out the serialized form of one TrigPrim as an
+        // entry of the "tps" field of a TPSet.  The flags field is
+        // only written if nonzero.
+        void encode_tp(std::string& out, uint32_t channel,
+                       ptmp::data::data_time_t tstart, uint32_t tspan,
+                       uint32_t adcsum, uint32_t adcpeak, uint32_t flags);
+
+        // Build a schema message for a TPSet given its scalar fields
+        // and the concatenation of TPs encoded by encode_tp().  The
+        // result is the same as serializing the equivalent TPSet
+        // object but no TrigPrim objects are made.  The hdr.ntps
+        // must count the TPs.  Caller takes ownership.
+        zmsg_t* make_msg(const msg_header_t& hdr, const tpset_extra_t& extra,
+                         const std::vector<const std::string*>& tps,
+                         int schema=msg_schema_v0);
+
+        // Estimate one quantile of a stream of values in constant
+        // memory and time per value using the P-square algorithm of
+        // Jain and Chlamtac.  Until five values are seen the exact
+        // quantile of those values is given.
+        class StreamingQuantile {
+        public:
+            // The quantile as a fraction, eg 0.99.
+            StreamingQuantile(double p = 0.5);
+
+            void add(double x);
+
+            // Current estimate.  Zero if no values have been added.
+            double value() const;
+
+            uint64_t count() const { return m_count; }
+            double quantile() const { return m_p; }
+        private:
+            double m_p;
+            uint64_t m_count{0};
+            double m_q[5];      // marker heights
+            double m_n[5];      // marker positions
+            double m_np[5];     // desired marker positions
+            double m_dn[5];     // desired position increments
+        };
+
         // May be called to set current thread name.  May have no
         // effect.
         void set_thread_name(const std::string& name);
 
+        // Parse a Linux CPU list like "0-3,8,10-11" or "0-7:2" for
+        // every second CPU of 0 to 7.  Return empty and log an error
+        // if the list is malformed.
+        std::vector<int> parse_cpulist(const std::string& list);
+
+        // Pin the calling thread to the given CPUs.  Threads it
+        // starts after inherit this.  Return false if not done.
+        bool set_thread_cpus(const std::vector<int>& cpus);
+
+        // Return the CPUs the calling thread may run on.
+        std::vector<int> thread_cpus();
+
+        // Bind, if strict, or else prefer memory allocation by the
+        // calling thread, and threads it starts after, to a NUMA
+        // node.  A negative node restores the default policy.
+        // Return false if not done.
+        bool set_thread_numa(int node, bool strict=false);
+
+        // Return the CPUs of a NUMA node, empty if unknown.
+        std::vector<int> numa_cpus(int node);
+
+        // Where the calling thread runs now, -1 if unknown, and on
+        // how many CPUs it may run.
+        struct placement_t {
+            int cpu{-1}, node{-1}, ncpus{0};
+        };
+        placement_t thread_placement();
+
+        // Set the number of ZeroMQ I/O threads and the CPUs they
+        // may run on (empty for any).  This must be called before
+        // any socket is made in the process.
+        void set_io_threads(int nthreads, const std::vector<int>& cpus);
+
         
     }
 }
@@ -0,0 +1,115 @@
+#ifndef PTMP_RECORDER_H
+#define PTMP_RECORDER_H
+
+#include "ptmp/internals.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ptmp {
+    namespace internals {
+
+        class ArchiveWriter;
+
+        // Write messages to file from a thread of its own so that a
+        // slow disk does not stall the caller.  Messages pass to the
+        // thread through a lock-free queue with one producer.  The
+        // thread coalesces them into large writes and may rotate
+        // the output to a new file by size or age.
+        //
+        // The configuration attributes are:
+        //
+        // - ofile :: the file name.  When rotating, a sequence number
+        //     is added before any extension, eg "run-0003.dump".
+        // - format :: "legacy" (default) or "archive".
+        // - block_kb :: archive block size in kB (default 1024).
+        // - buffer_kb :: legacy write size in kB (default 4096).
+        // - queue :: most messages waiting to be written (default
+        //     65536).  A message pushed when full is dropped.
+        // - flush_ms :: most time data may sit in the buffer while
+        //     the queue is idle (default 1000).
+        // - rotate_mb :: start a new file after this many MB.
+        // - rotate_s :: start a new file after this many seconds.
+        //
+        // See docs/archive.org.
+        class Recorder {
+        public:
+            // Throws if the first file can not be made.
+            Recorder(const nlohmann::json& config);
+
+            // Write all queued messages and close the file.
+            ~Recorder();
+
+            // Queue a message to write, taking ownership.  If the
+            // queue is full the message is left, the drop is
+            // counted and false is returned.  Call from one thread.
+            bool push(zmsg_t** msg);
+
+            // Return metrics since the last call and reset them.
+            nlohmann::json metrics();
+
+            uint64_t dropped() const { return m_dropped; }
+
+        private:
+            void run();
+            void open_file();
+            void close_file();
+            void rotate();
+            void write_msg(zmsg_t* msg);
+            void append(const void* data, size_t size);
+            void write_out(size_t size);
+            void add_write(double dt_us);
+            std::string file_name() const;
+
+            std::string m_filename, m_format;
+            size_t m_block_kb{1024}, m_buffer_bytes{4096*1024};
+            int m_flush_ms{1000};
+            uint64_t m_rotate_bytes{0};
+            int64_t m_rotate_ms{0};
+
+            // The queue, indexed by free running counters.  The
+            // padding keeps the consumer's head and the producer's
+            // tail on different cache lines.
+            std::vector<zmsg_t*> m_slots;
+            uint64_t m_mask;
+            std::atomic<uint64_t> m_head{0};
+            char m_pad[64];
+            std::atomic<uint64_t> m_tail{0};
+            std::atomic<uint64_t> m_dropped{0}, m_depth_max{0};
+            std::atomic<bool> m_stop{false};
+
+            // Output, used only by the thread.
+            int m_fd{-1};
+            ArchiveWriter* m_archive{nullptr};
+            uint8_t* m_buf{nullptr};
+            size_t m_fill{0};
+            int m_ifile{0};
+            uint64_t m_file_bytes{0};
+            // Bytes of the file written out and the file size at the
+            // end of each message not yet written out.
+            uint64_t m_written{0};
+            std::deque<uint64_t> m_ends;
+            int64_t m_opened{0}, m_last_write{0};
+
+            // Shared with metrics().
+            struct stats_t {
+                uint64_t nmsgs{0}, nbytes{0}, nwrites{0}, nfailed{0}, nfiles{0};
+                double write_us_max{0};
+                StreamingQuantile write_us_50{0.5}, write_us_99{0.99};
+            };
+            std::mutex m_mutex;
+            stats_t m_stats;
+            std::string m_current;
+
+            std::thread m_thread;
+        };
+    }
+}
+
+#endif
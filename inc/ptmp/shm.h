@@ -0,0 +1,89 @@
+#ifndef PTMP_SHM_H
+#define PTMP_SHM_H
+
+#include <czmq.h>
+#include <string>
+#include <cstdint>
+
+namespace ptmp {
+    namespace internals {
+
+        // A ring of messages in POSIX shared memory with one
+        // producer and any number of consumers, each possibly in a
+        // different process.  Neither side takes a lock or makes a
+        // system call to pass a message.
+        //
+        // In "queue" mode each message goes to one consumer (like
+        // PUSH/PULL) and the producer must wait for space.  In
+        // "broadcast" mode each consumer reads every message (like
+        // PUB/SUB) and the producer never waits.  A consumer which
+        // falls a whole ring behind loses messages.
+        //
+        // See docs/shm.org.
+        class ShmRing {
+        public:
+            enum ring_mode_t { queue = 1, broadcast = 2 };
+
+            // Create the named segment with room for capacity bytes
+            // of messages (rounded up to a power of 2).  Any
+            // existing segment of the same name is replaced.  The
+            // segment is removed when this object is destroyed.
+            // Throws on error.
+            static ShmRing* create(const std::string& name, ring_mode_t mode, size_t capacity);
+
+            // Open an existing segment.  Return nullptr if it does
+            // not (yet) exist.  Throws if it exists with another mode.
+            static ShmRing* open(const std::string& name, ring_mode_t mode);
+
+            ~ShmRing();
+
+            // Become the one producer.  Return false if another live
+            // process is producing.
+            bool attach_producer();
+
+            // Copy the message into the ring.  Return 1 if written,
+            // 0 if there is not yet room (queue mode) and -1 if the
+            // message can never fit.  The message is not destroyed.
+            int write(zmsg_t* msg);
+
+            // Return a copy of the next message or nullptr if none.
+            zmsg_t* read();
+
+            // Return true if the name now refers to a different
+            // segment than the one mapped, eg if its creator restarted.
+            bool stale() const;
+
+            // Number of times a broadcast consumer fell a whole
+            // ring behind and skipped to the newest message.
+            uint64_t lost() const { return m_lost; }
+
+            size_t capacity() const { return m_capacity; }
+            const std::string& name() const { return m_name; }
+
+        private:
+            ShmRing(const std::string& name, int fd, void* base, size_t size, bool owner);
+
+            struct header_t;
+            header_t* hdr() const;
+            uint8_t* at(uint64_t pos) const;
+
+            std::string m_name;
+            int m_fd;
+            void* m_base;
+            size_t m_size, m_capacity;
+            bool m_owner, m_producer{false};
+            uint64_t m_cursor{0}, m_lost{0};
+        };
+
+        // Return the inproc address of this process's bridge to the
+        // "shm://name" address for a socket of the given ZeroMQ type,
+        // starting the bridge if needed.  The socket should connect
+        // to the returned address.  The jsock is the JSON "socket"
+        // object, for "hwm" and "shm_kb".  Throws on error.
+        std::string shm_bridge(const std::string& addr, int socktype, bool bind,
+                               const std::string& jsock);
+
+    }
+}
+
+#endif
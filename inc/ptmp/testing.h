@@ -2,9 +2,11 @@
 #define PTMP_TESTING_H
 
 #include "ptmp/data.h"
+#include "json.hpp"
 
 #include <czmq.h>
 #include <random>
+#include <string>
 
 namespace ptmp {
     namespace testing {
@@ -19,6 +21,11 @@ namespace ptmp {
         // previously initialized to something.
         void set_count_clock(ptmp::data::TPSet& tps);
 
+        // Return the configuration of a socket of the type which will
+        // "bind" or "connect", as given by bc, to one address.
+        nlohmann::json socket(const std::string& type, const std::string& bc,
+                              const std::string& addr);
+
 
         struct make_tps_t {
 
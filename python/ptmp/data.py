@@ -1,3 +1,4 @@
+import struct
 from .ptmp_pb2 import *
 
 class MsgV0(object):
@@ -17,11 +18,26 @@ class MsgV0(object):
     def ntps(self):
         return len(self.tpset.tps)
 
+class MsgV2(MsgV0):
+    # fixed layout header: tstart, created, count, detid, tspan, ntps, flags, reserved
+    header_format = '<QqIIIIII'
+
+    def __init__(self, frames):
+        self.tpset = TPSet()
+        self.tpset.ParseFromString(frames[2])
+        self.header = struct.unpack(self.header_format, frames[1])
+    @property
+    def ntps(self):
+        return self.header[5]
+    @property
+    def watermark(self):
+        return bool(self.header[6] & 0x1)
+
 def intern_message(frames):
     if len(frames[0]) != 4:
         raise ValueError("bad size for frame 0: %d" % len(frames[0]))
-    msgid = int.from_bytes(frames[0], 'big')
-    msg_classes = [MsgV0]
-    msg_class = msg_classes[msgid] # may throw index error
+    msgid = int.from_bytes(frames[0], 'little')
+    msg_classes = {0:MsgV0, 2:MsgV2}
+    msg_class = msg_classes[msgid] # may throw key error
     return msg_class(frames)
 
@@ -0,0 +1,283 @@
+#include "Executor.h"
+#include "ptmp/internals.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+
+using namespace ptmp::noexport;
+using json = nlohmann::json;
+
+ptmp::noexport::Executor::Executor(const json& config)
+{
+    // - threads :: number of worker threads, default is one per
+    //     hardware thread.
+    int nthreads = std::thread::hardware_concurrency();
+    if (config.count("threads") and config["threads"].is_number()) {
+        nthreads = config["threads"];
+    }
+    nthreads = std::max(1, nthreads);
+    // - steps :: most times to run a busy task before it goes to
+    //     the back of the queue.
+    if (config.count("steps") and config["steps"].is_number()) {
+        m_steps = std::max(1, config["steps"].get<int>());
+    }
+    for (int ind=0; ind<nthreads; ++ind) {
+        m_workers.push_back(new worker_t);
+    }
+
+    m_epoll = epoll_create1(0);
+    m_wake = eventfd(0, EFD_NONBLOCK);
+    if (m_epoll < 0 or m_wake < 0) {
+        zsys_error("executor: failed to make epoll: %s", strerror(errno));
+        throw std::runtime_error("executor failed to make epoll");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;      // the wake fd
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev);
+}
+
+bool ptmp::noexport::Executor::add(const std::string& type, const std::string& name,
+                                   json& config)
+{
+    task_t* task = new task_t;
+    task->name = name;
+    char addr[256];
+    snprintf(addr, sizeof(addr), "inproc://ptmp-executor-%p", (void*)task);
+    task->ctl = zsock_new_pair((std::string("@") + addr).c_str());
+    task->pipe = zsock_new_pair((std::string(">") + addr).c_str());
+    task->app = make_app(type, task->pipe, config);
+    if (!task->app) {
+        zsock_destroy(&task->pipe);
+        zsock_destroy(&task->ctl);
+        delete task;
+        return false;
+    }
+    task->home = m_tasks.size() % m_workers.size();
+    m_tasks.push_back(task);
+    return true;
+}
+
+void ptmp::noexport::Executor::start()
+{
+    for (auto task : m_tasks) {
+        // ZMQ_FD is edge triggered: it signals when the socket may
+        // have become readable and the task must then drain it.
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = task;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, zsock_fd(task->app->input()), &ev);
+        // Same for the output, for a task waiting to send held output.
+        if (task->app->output()) {
+            epoll_ctl(m_epoll, EPOLL_CTL_ADD, zsock_fd(task->app->output()), &ev);
+        }
+    }
+    for (size_t ind=0; ind<m_workers.size(); ++ind) {
+        m_workers[ind]->thread = std::thread(&Executor::worker, this, ind);
+    }
+    m_dispatcher = std::thread(&Executor::dispatcher, this);
+    // anything which arrived before registering
+    for (auto task : m_tasks) {
+        schedule(task);
+    }
+    zsys_debug("executor: %ld tasks on %ld threads", m_tasks.size(), m_workers.size());
+}
+
+ptmp::noexport::Executor::~Executor()
+{
+    m_stop = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cond.notify_all();
+    }
+    const uint64_t one = 1;
+    if (write(m_wake, &one, sizeof(one)) < 0) {
+        zsys_warning("executor: failed to wake dispatcher");
+    }
+    // Tell every task to stop.
+    for (auto task : m_tasks) {
+        zsock_signal(task->ctl, 0);
+    }
+    if (m_dispatcher.joinable()) {
+        m_dispatcher.join();
+    }
+    for (auto w : m_workers) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
+        delete w;
+    }
+    for (auto task : m_tasks) {
+        delete task->app;
+        zsock_destroy(&task->pipe);
+        zsock_destroy(&task->ctl);
+        delete task;
+    }
+    close(m_wake);
+    close(m_epoll);
+}
+
+void ptmp::noexport::Executor::schedule(task_t* task)
+{
+    int state = task->state;
+    while (true) {
+        if (state == task_t::idle) {
+            if (task->state.compare_exchange_weak(state, task_t::queued)) {
+                push(task);
+                return;
+            }
+        }
+        else if (state == task_t::running) {
+            if (task->state.compare_exchange_weak(state, task_t::again)) {
+                return;
+            }
+        }
+        else {
+            return;             // queued, again or done
+        }
+    }
+}
+
+void ptmp::noexport::Executor::push(task_t* task)
+{
+    worker_t* w = m_workers[task->home];
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        w->queue.push_back(task);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_pending;
+    m_cond.notify_one();
+}
+
+// Take from the front of our queue, else steal from the back of
+// another.  Caller has claimed one from m_pending.
+ptmp::noexport::Executor::task_t* ptmp::noexport::Executor::pop(size_t iworker)
+{
+    const size_t nworkers = m_workers.size();
+    for (size_t off=0; off<nworkers; ++off) {
+        worker_t* w = m_workers[(iworker + off) % nworkers];
+        std::lock_guard<std::mutex> lock(w->mutex);
+        if (w->queue.empty()) {
+            continue;
+        }
+        task_t* task = nullptr;
+        if (off == 0) {
+            task = w->queue.front();
+            w->queue.pop_front();
+        }
+        else {
+            task = w->queue.back();
+            w->queue.pop_back();
+        }
+        return task;
+    }
+    return nullptr;
+}
+
+void ptmp::noexport::Executor::run(task_t* task, size_t iworker)
+{
+    task->home = iworker;
+    task->state = task_t::running;
+    bool more = false;
+    for (int istep=0; istep<m_steps; ++istep) {
+        int rc = task->app->step();
+        if (rc < 0) {
+            zsys_debug("executor: task \"%s\" stopped", task->name.c_str());
+            task->state = task_t::done;
+            return;
+        }
+        if (rc > 0) {
+            // Output is held.  Free this thread and run again when
+            // the output fd signals.
+            more = false;
+            break;
+        }
+        more = task->app->input_ready();
+        if (!more) {
+            break;
+        }
+    }
+    const int64_t due = task->app->next_due();
+    if (due != task->due) {
+        task->due = due;
+        const uint64_t one = 1; // dispatcher must recompute its timeout
+        if (write(m_wake, &one, sizeof(one)) < 0) {
+            zsys_warning("executor: failed to wake dispatcher");
+        }
+    }
+    if (more) {
+        task->state = task_t::queued;
+        push(task);
+        return;
+    }
+    int state = task_t::running;
+    if (!task->state.compare_exchange_strong(state, task_t::idle)) {
+        task->state = task_t::queued; // was asked to run again
+        push(task);
+    }
+}
+
+void ptmp::noexport::Executor::worker(size_t iworker)
+{
+    ptmp::internals::set_thread_name("executor-" + std::to_string(iworker));
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]{ return m_stop or m_pending > 0; });
+            if (m_stop) {
+                return;
+            }
+            --m_pending;
+        }
+        task_t* task = pop(iworker);
+        if (task) {
+            run(task, iworker);
+        }
+    }
+}
+
+void ptmp::noexport::Executor::dispatcher()
+{
+    ptmp::internals::set_thread_name("executor");
+    const int maxevents = 64;
+    epoll_event events[maxevents];
+    while (!m_stop) {
+        const int64_t now = zclock_mono();
+        int timeout = -1;
+        for (auto task : m_tasks) {
+            const int64_t due = task->due;
+            if (due < 0 or task->state == task_t::done) {
+                continue;
+            }
+            if (due <= now) {
+                schedule(task);
+                continue;
+            }
+            if (timeout < 0 or due - now < timeout) {
+                timeout = due - now;
+            }
+        }
+        int nevents = epoll_wait(m_epoll, events, maxevents, timeout);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            zsys_error("executor: epoll failed: %s", strerror(errno));
+            break;
+        }
+        for (int ind=0; ind<nevents; ++ind) {
+            task_t* task = (task_t*)events[ind].data.ptr;
+            if (!task) {
+                uint64_t count = 0;
+                if (read(m_wake, &count, sizeof(count)) < 0) {
+                    continue;   // already drained
+                }
+                continue;
+            }
+            schedule(task);
+        }
+    }
+}
@@ -0,0 +1,94 @@
+// an internal executor to run many ReactorApps on a few threads.  not
+// intended for general application.
+
+#ifndef PRIVATE_PTMP_EXECUTOR
+#define PRIVATE_PTMP_EXECUTOR
+
+#include "ReactorApp.h"
+#include "json.hpp"
+#include <czmq.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ptmp {
+    namespace noexport {
+
+        // Run ReactorApps as tasks on a fixed pool of worker threads
+        // instead of each on its own thread.  One dispatcher thread
+        // waits on the edge-triggered ZeroMQ file descriptors of all
+        // task inputs and on their timers and queues ready tasks.
+        // Each worker takes from its own queue first and steals from
+        // the others when idle.  A task runs on one worker at a time.
+        //
+        // See docs/composer.org.
+        class Executor {
+        public:
+
+            // The config is the composer's "executor" object.
+            Executor(const nlohmann::json& config);
+
+            // Stops the pool and destroys all tasks.
+            ~Executor();
+
+            // Make an app of the given agent type to run as a task.
+            // Return false if the type can not run as a task.  Must
+            // be called before start().
+            bool add(const std::string& type, const std::string& name,
+                     nlohmann::json& config);
+
+            void start();
+
+            size_t ntasks() const { return m_tasks.size(); }
+
+        private:
+
+            struct task_t {
+                enum state_t { idle=0, queued, running, again, done };
+
+                ReactorApp* app{nullptr};
+                std::string name;
+                // The app's pipe is one end, closed to stop any
+                // blocked send, and ctl the other.
+                zsock_t *pipe{nullptr}, *ctl{nullptr};
+                std::atomic<int> state{idle};
+                std::atomic<int64_t> due{-1};
+                size_t home{0}; // worker which last ran it
+            };
+
+            struct worker_t {
+                std::mutex mutex;
+                std::deque<task_t*> queue;
+                std::thread thread;
+            };
+
+            // Queue the task unless already queued, or have it run
+            // again if running.
+            void schedule(task_t* task);
+            void push(task_t* task);
+            task_t* pop(size_t iworker);
+            void run(task_t* task, size_t iworker);
+
+            void dispatcher();
+            void worker(size_t iworker);
+
+            std::vector<task_t*> m_tasks;
+            std::vector<worker_t*> m_workers;
+            std::thread m_dispatcher;
+            int m_epoll{-1}, m_wake{-1};
+            int m_steps{1};
+
+            std::mutex m_mutex;
+            std::condition_variable m_cond;
+            size_t m_pending{0};
+            std::atomic<bool> m_stop{false};
+        };
+    }
+}
+
+#endif
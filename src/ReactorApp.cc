@@ -1,6 +1,7 @@
 #include "ReactorApp.h"
 #include "ptmp/internals.h"
 #include "ptmp/data.h"
+#include <unordered_map>
 using namespace ptmp::noexport;
 using json = nlohmann::json;
 
@@ -17,13 +18,16 @@ int handle_timer_link(zloop_t* loop, int timer_id, void* varg)
     return app->metrics_base();
 }
 static
+int handle_timer_watermark(zloop_t* loop, int timer_id, void* varg)
+{
+    ReactorApp * app = (ReactorApp*)varg;
+    return app->watermark_base();
+}
+static
 int handle_input(zloop_t* loop, zsock_t* sock, void* varg)
 {
     ReactorApp * app = (ReactorApp*)varg;
-    zmsg_t* msg = zmsg_recv(sock);
-    ptmp::data::TPSet tpset;
-    ptmp::internals::recv(&msg, tpset);
-    return app->add_base(tpset);
+    return app->recv_base(sock);
 }
 
 
@@ -34,28 +38,50 @@ ptmp::noexport::ReactorApp::ReactorApp(zsock_t* pipe_, json& config, const std::
     if (!config["name"].is_null()) {
         name = config["name"];
     }
-    ptmp::internals::set_thread_name(name);
     if (!config["verbose"].is_null()) {
         verbose = config["verbose"];
     }
     if (!config["detid"].is_null()) {
         detid = config["detid"];
     }
+    if (config["schema"].is_number()) {
+        schema = config["schema"];
+    }
+    local = ptmp::internals::local_output(config["output"].dump());
+    if (config["output"]["socket"]["topic"].is_boolean()) {
+        topic = config["output"]["socket"]["topic"];
+    }
+    if (config["recv_batch"].is_number()) {
+        recv_batch = std::max(1, config["recv_batch"].get<int>());
+    }
+    size_t arena_kb = 1024;
+    if (config["arena_kb"].is_number()) {
+        arena_kb = config["arena_kb"];
+    }
+    in_arena = new ptmp::internals::ReusableArena(arena_kb*1024);
+    in_batch.reserve(recv_batch);
 
     looper = zloop_new();
     zloop_reader(looper, pipe, handle_pipe, this);
 
+    if (config["watermark"].is_number()) {
+        watermark_ms = config["watermark"];
+    }
+    if (watermark_ms > 0) {
+        zloop_timer(looper, watermark_ms, 0, handle_timer_watermark, this);
+    }
+
     if (config["metrics"].is_object()) {
         met = new ptmp::metrics::Metric(config["metrics"].dump());
-        int integ_time_ms = 10000;
+        metrics_ms = 10000;
         if (!config["metrics"]["period"].is_null()) {
-            integ_time_ms = config["metrics"]["period"];
+            metrics_ms = config["metrics"]["period"];
         }
         if (!config["tickperus"].is_null()) {
             tickperus = config["tickperus"];
         }
-        zsys_debug("metrics from %s on 0x%x every %d ms", name.c_str(), detid, integ_time_ms);
-        zloop_timer(looper, integ_time_ms, 0, handle_timer_link, this);
+        zsys_debug("metrics from %s on 0x%x every %d ms", name.c_str(), detid, metrics_ms);
+        zloop_timer(looper, metrics_ms, 0, handle_timer_link, this);
     }
 }
 void ptmp::noexport::ReactorApp::set_isock(zsock_t* isock_)
@@ -76,11 +102,21 @@ void ptmp::noexport::ReactorApp::set_osock(zsock_t* osock_)
         zsys_error("%s: output socket required", name.c_str());
         throw std::runtime_error("output socket required");
     }
+    sender = new ptmp::internals::CarefulSender(osock, pipe);
+    sender->set_local(local);
+    sender->set_topic(topic);
 }
 
 ptmp::noexport::ReactorApp::~ReactorApp()
 {
     zloop_destroy(&looper);
+    delete sender;
+    sender = nullptr;
+    delete in_arena;
+    in_arena = nullptr;
+    for (auto& msg : in_local) {
+        zmsg_destroy(&msg);
+    }
     zsock_destroy(&isock);
     zsock_destroy(&osock);
     if (met) {
@@ -92,11 +128,171 @@ ptmp::noexport::ReactorApp::~ReactorApp()
 
 void ptmp::noexport::ReactorApp::start()
 {
+    ptmp::internals::set_thread_name(name);
     start_time = ptmp::data::now();
     zloop_start(looper);
 }
 
+int ptmp::noexport::ReactorApp::step()
+{
+    const int64_t now = zclock_mono();
+    if (!start_time) {          // first step, timers fire after a period
+        start_time = ptmp::data::now();
+        due_watermark = now + watermark_ms;
+        due_metrics = now + metrics_ms;
+        if (sender) {           // a task must not hold its thread
+            sender->set_blocking(false);
+        }
+    }
+    if (met and now >= due_metrics) {
+        due_metrics = now + metrics_ms;
+        metrics_base();
+    }
+    // Take no more input until what is held has gone out.
+    if (sender and sender->pending()) {
+        if (sender->flush() != 0) {
+            return -1;
+        }
+        if (sender->pending()) {
+            return 1;
+        }
+    }
+    if (watermark_ms > 0 and now >= due_watermark) {
+        due_watermark = now + watermark_ms;
+        if (watermark_base() != 0) {
+            return -1;
+        }
+    }
+    if (input_ready()) {
+        if (recv_base(isock) != 0) {
+            return -1;
+        }
+    }
+    if (sender and sender->pending()) {
+        return 1;
+    }
+    return 0;
+}
+
+bool ptmp::noexport::ReactorApp::input_ready()
+{
+    return isock and (zsock_events(isock) & ZMQ_POLLIN);
+}
+
+int64_t ptmp::noexport::ReactorApp::next_due() const
+{
+    int64_t due = -1;
+    if (watermark_ms > 0) {
+        due = due_watermark;
+    }
+    if (met and (due < 0 or due_metrics < due)) {
+        due = due_metrics;
+    }
+    return due;
+}
+
+static std::unordered_map<std::string, app_maker_t>& app_makers()
+{
+    static std::unordered_map<std::string, app_maker_t> makers;
+    return makers;
+}
+
+bool ptmp::noexport::register_app(const std::string& type, app_maker_t maker)
+{
+    app_makers()[type] = maker;
+    return true;
+}
+
+ReactorApp* ptmp::noexport::make_app(const std::string& type, zsock_t* pipe, json& config)
+{
+    auto it = app_makers().find(type);
+    if (it == app_makers().end()) {
+        return nullptr;
+    }
+    return it->second(pipe, config);
+}
+
+// Drain up to recv_batch messages which are ready on the input and
+// hand them to the subclass in one go.  The batch is parsed into an
+// arena which is reset before the next batch.  Local messages are not
+// parsed, their TPSets are used in place and released with the batch.
+int ptmp::noexport::ReactorApp::recv_base(zsock_t* sock)
+{
+    in_batch.clear();
+    for (auto& msg : in_local) {
+        zmsg_destroy(&msg);
+    }
+    in_local.clear();
+    in_arena->reset();
+    for (size_t ind=0; ind<recv_batch; ++ind) {
+        if (ind and !(zsock_events(sock) & ZMQ_POLLIN)) {
+            break;
+        }
+        zmsg_t* msg = zmsg_recv(sock);
+        if (!msg) {
+            break;              // interrupted
+        }
+        if (ptmp::internals::msg_schema(msg) < 0) {
+            zsys_warning("%s: dropping malformed message", name.c_str());
+            zmsg_destroy(&msg);
+            continue;
+        }
+        ptmp::data::TPSet* tpset = nullptr;
+        if (const auto* shared = ptmp::internals::local_tpset(msg)) {
+            tpset = const_cast<ptmp::data::TPSet*>(shared);
+            in_local.push_back(msg);
+        }
+        else {
+            tpset = ptmp::internals::recv(&msg, in_arena->get());
+        }
+        if (ptmp::internals::is_watermark(*tpset)) {
+            // data received before the watermark goes first
+            if (!in_batch.empty()) {
+                int rc = this->add_batch(in_batch);
+                in_batch.clear();
+                if (rc != 0) {
+                    return rc;
+                }
+            }
+            int rc = this->add_watermark(*tpset);
+            if (rc != 0) {
+                return rc;
+            }
+            continue;
+        }
+        if (accept(*tpset)) {
+            in_batch.push_back(tpset);
+        }
+    }
+    if (in_batch.empty()) {
+        return 0;
+    }
+    return this->add_batch(in_batch);
+}
+
+int ptmp::noexport::ReactorApp::add_batch(std::vector<ptmp::data::TPSet*>& tpsets)
+{
+    for (auto tpset : tpsets) {
+        int rc = this->add(*tpset);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
 int ptmp::noexport::ReactorApp::add_base(ptmp::data::TPSet& tpset)
+{
+    if (ptmp::internals::is_watermark(tpset)) {
+        return this->add_watermark(tpset);
+    }
+    if (!accept(tpset)) {
+        return 0;
+    }
+    return this->add(tpset);
+}
+
+bool ptmp::noexport::ReactorApp::accept(ptmp::data::TPSet& tpset)
 {
     const auto this_count = tpset.count();
     if (last_in_count == 0) {
@@ -113,15 +309,11 @@ int ptmp::noexport::ReactorApp::add_base(ptmp::data::TPSet& tpset)
     if (met) {
         stats.iss.update(tpset, tickperus);
     }
-    if (tpset.tps_size() == 0) {
-        zsys_error("receive empty TPSet from det #0x%x", tpset.detid());
-        return 0;
-    }
     if (detid < 0) {        // forward if user doesn't provide
         detid = tpset.detid();
     }            
 
-    return this->add(tpset);
+    return true;
 }
 
 
@@ -131,6 +323,13 @@ int ReactorApp::metrics_base()
         return 0;
     }
 
+    if (sender) {
+        auto& ss = sender->stats();
+        stats.waits.count = ss.nblocked;
+        stats.waits.time_ms = ss.tblocked/1000;
+        stats.n_out_lost = ss.ndropped;
+        ss = ptmp::internals::CarefulSender::stats_t();
+    }
     stats.iss.finalize();
     stats.oss.finalize();
 
@@ -142,6 +341,9 @@ int ReactorApp::metrics_base()
         ,{"duty", (stats.waits.time_ms/1000.0)* stats.oss.real.hz}
     };
     j["lost"]["input"] = stats.n_in_lost;
+    j["lost"]["output"] = stats.n_out_lost;
+    const auto place = ptmp::internals::thread_placement();
+    j["placement"] = json{{"cpu", place.cpu}, {"node", place.node}, {"ncpus", place.ncpus}};
 
 
     //zsys_debug("metric %d from 0x%x", out_tpset_count, detid);
@@ -156,29 +358,49 @@ int ReactorApp::metrics_base()
 
 int ptmp::noexport::ReactorApp::send(ptmp::data::TPSet& tpset)
 {
-    // send carefully in case we are blocked we still want to be able to get shutdown
-    uint64_t nwait = 0;
-    ptmp::data::real_time_t then = ptmp::data::now();
-    while (! (zsock_events(osock) & ZMQ_POLLOUT)) {
-        if (zsock_events(pipe) & ZMQ_POLLIN) {
-            if (verbose) {
-                zsys_debug("window: got quit while waiting to output");
-            }
-            return -1;          // want to stop
-        }
-        zclock_sleep(1); // ms
-        ++nwait;
-    }
-    if (nwait) {
-        ++stats.waits.count;
-        stats.waits.time_ms += (ptmp::data::now() - then)/1000;
-    }
     tpset.set_count(out_tpset_count++);
     tpset.set_detid(detid);
     tpset.set_created(ptmp::data::now());
-    ptmp::internals::send(osock, tpset); // fixme: may throw
+    ptmp::internals::msg_header_t hdr{};
     if (met) {
-        stats.oss.update(tpset, tickperus);
+        ptmp::internals::make_header(tpset, hdr);
+    }
+    // send carefully in case we are blocked we still want to be able to get shutdown
+    int rc = 0;
+    if (local) {
+        auto* out = new ptmp::data::TPSet;
+        out->Swap(&tpset);
+        rc = (*sender)(out);
+    }
+    else {
+        rc = (*sender)(tpset, schema); // fixme: may throw
+    }
+    return sent(rc, hdr);
+}
+
+int ptmp::noexport::ReactorApp::send(ptmp::internals::msg_header_t& hdr,
+                                     const ptmp::internals::tpset_extra_t& extra,
+                                     const std::vector<const std::string*>& tps)
+{
+    hdr.count = out_tpset_count++;
+    hdr.detid = detid;
+    hdr.created = ptmp::data::now();
+    zmsg_t* msg = ptmp::internals::make_msg(hdr, extra, tps, schema);
+    int rc = (*sender)(&msg);
+    return sent(rc, hdr);
+}
+
+int ptmp::noexport::ReactorApp::sent(int rc, const ptmp::internals::msg_header_t& hdr)
+{
+    if (rc != 0) {
+        if (verbose) {
+            zsys_debug("%s: got quit while waiting to output", name.c_str());
+        }
+        return -1;          // want to stop
+    }
+    sent_since_tick = true;
+    if (met) {
+        stats.oss.update(hdr, tickperus);
     }
 
     if (verbose>0) {
@@ -191,3 +413,25 @@ int ptmp::noexport::ReactorApp::send(ptmp::data::TPSet& tpset)
 
     return 0;
 }
+
+// Send a watermark if nothing was sent since the last tick and the
+// subclass can promise a later tstart than the last watermark.
+int ptmp::noexport::ReactorApp::watermark_base()
+{
+    if (sent_since_tick or !sender) {
+        sent_since_tick = false;
+        return 0;
+    }
+    ptmp::data::data_time_t tstart = 0;
+    if (!this->output_watermark(tstart) or tstart <= last_watermark) {
+        return 0;
+    }
+    ptmp::data::TPSet wm;
+    ptmp::internals::make_watermark(wm, detid, tstart);
+    int rc = (*sender)(wm, schema);
+    if (rc != 0) {
+        return -1;
+    }
+    last_watermark = tstart;
+    return 0;
+}
@@ -6,9 +6,12 @@
 
 #include "SocketStats.h"
 #include "ptmp/metrics.h"
+#include "ptmp/internals.h"
 #include "json.hpp"
 #include <czmq.h>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace ptmp {
     namespace noexport {
@@ -21,6 +24,24 @@ namespace ptmp {
             // subclass must provide
             virtual int add(ptmp::data::TPSet& tpset) = 0;
 
+            // subclass may provide in order to handle all TPSets
+            // received in one reactor wakeup together.  The default
+            // calls add() on each in turn.  The TPSets are owned by
+            // the base and are freed when the next batch arrives.
+            // Those from local messages are shared and must not be
+            // modified.
+            virtual int add_batch(std::vector<ptmp::data::TPSet*>& tpsets);
+
+            // subclass may provide in order to use input watermarks,
+            // TPSets marked as such.  These are not passed to add().
+            // Any data received ahead of the watermark is added first.
+            virtual int add_watermark(ptmp::data::TPSet& wm) { return 0; }
+
+            // subclass may provide in order to have watermarks sent
+            // when output is quiet.  Return true and set tstart if no
+            // output TPSet with an earlier tstart will be sent.
+            virtual bool output_watermark(ptmp::data::data_time_t& tstart) { return false; }
+
             // subclass may provide in order to fill in jmet with
             // additional info.  The stats collected in the base are
             // finalized prior to call so subclass may utilize them.
@@ -29,26 +50,68 @@ namespace ptmp {
             // start reactor
             void start();
 
+            // Instead of start(), an Executor may run the app as a
+            // task by calling step() when input is ready, a timer is
+            // due or output may have become writable.  It runs due
+            // timers and receives one batch.  It never waits on the
+            // output, output which can not be sent is held.  Return
+            // -1 to stop, 1 if output is held and step() should be
+            // called again once the output is writable, else 0.
+            int step();
+
+            // True if input holds messages not yet received.
+            bool input_ready();
+
+            // The zclock_mono() ms at which step() must next run for
+            // a timer or -1 if no timers.
+            int64_t next_due() const;
+
+            zsock_t* input() const { return isock; }
+            zsock_t* output() const { return osock; }
+
         protected:
 
             // Subclass should call:
             void set_isock(zsock_t* sock);
             void set_osock(zsock_t* sock);
 
-            // Subclass may call to send out a tpset
+            // Subclass may call to send out a tpset.  If the output
+            // is local the tpset content is taken, not copied.
             int send(ptmp::data::TPSet& tpset);
 
+            // True if the output socket is configured "local", all
+            // its peers in this process.
+            bool local_output() const { return local; }
+
+            // Subclass may call to send out a tpset already encoded
+            // in pieces, see ptmp::internals::make_msg().  The count,
+            // detid and created of hdr are set here.
+            int send(ptmp::internals::msg_header_t& hdr,
+                     const ptmp::internals::tpset_extra_t& extra,
+                     const std::vector<const std::string*>& tps);
+
             std::string name{""};
             int verbose{0};
             int detid{-1};
-            ptmp::data::real_time_t start_time;
+            ptmp::data::real_time_t start_time{0};
             uint64_t out_tpset_count{0};
             uint32_t tickperus{50};
             uint32_t last_in_count{0};
+            // most messages to drain from input per reactor wakeup
+            size_t recv_batch{64};
+            int schema{0};      // output message schema version
+            bool local{false};  // output sends local messages
+            bool topic{false};  // output sends topic frames
+            int watermark_ms{0};    // quiet time before sending a watermark, 0 never
+            int metrics_ms{0};      // metrics period if met
+            int64_t due_watermark{0}, due_metrics{0}; // when run by step()
+            bool sent_since_tick{false};
+            ptmp::data::data_time_t last_watermark{0};
 
             ptmp::metrics::Metric* met{nullptr};
 
             zsock_t *pipe{nullptr}, *isock{nullptr}, *osock{nullptr};
+            ptmp::internals::CarefulSender* sender{nullptr};
             zloop_t *looper{nullptr};
             
             struct wait_stats_t {
@@ -58,17 +121,46 @@ namespace ptmp {
                 socket_stats_t iss, oss;
                 wait_stats_t waits;
                 uint32_t n_in_lost{0};
+                uint64_t n_out_lost{0};
             };
 
             stats_t stats;
 
 
+            // Holds the TPSets of the current received batch
+            ptmp::internals::ReusableArena* in_arena{nullptr};
+            std::vector<ptmp::data::TPSet*> in_batch;
+            // Local messages whose TPSets are in the batch
+            std::vector<zmsg_t*> in_local;
+
+            // Bookkeeping after sending with sender's return code.
+            int sent(int rc, const ptmp::internals::msg_header_t& hdr);
+
+            // Do base bookkeeping.  Return false if tpset should not
+            // be passed on to the subclass.
+            bool accept(ptmp::data::TPSet& tpset);
+
         public:                 // so looper handlers can call
             int add_base(ptmp::data::TPSet& tpset);
+            int recv_base(zsock_t* sock);
             int metrics_base();
+            int watermark_base();
 
         };                      // ReactorApp
+
+        // Make a ReactorApp subclass by agent type alias so that an
+        // Executor may run it.  Return nullptr if type is not known.
+        typedef std::function<ReactorApp*(zsock_t* pipe, nlohmann::json& config)> app_maker_t;
+        ReactorApp* make_app(const std::string& type, zsock_t* pipe, nlohmann::json& config);
+        bool register_app(const std::string& type, app_maker_t maker);
     }
 }
 
+// Register a ReactorApp subclass for make_app() under an alias which
+// should match its PTMP_AGENT().
+#define PTMP_REACTOR_APP(TYPE, ALIAS)                                   \
+    static bool ptmp_reactor_app_##ALIAS =                              \
+        ptmp::noexport::register_app(#ALIAS, [](zsock_t* pipe, nlohmann::json& config) { \
+                return (ptmp::noexport::ReactorApp*) new TYPE(pipe, config); });
+
 #endif
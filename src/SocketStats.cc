@@ -11,16 +11,22 @@ void time_stats_t::update(int64_t now, int64_t then)
     lat2 += this_lat*this_lat;
 }
 void socket_stats_t::update(ptmp::data::TPSet& tpset, int tickperus)
+{
+    ptmp::internals::msg_header_t hdr;
+    ptmp::internals::make_header(tpset, hdr);
+    update(hdr, tickperus);
+}
+void socket_stats_t::update(const ptmp::internals::msg_header_t& hdr, int tickperus)
 {
     int64_t real_now = ptmp::data::now();
-    int64_t data_now = tpset.tstart() / tickperus;
+    int64_t data_now = hdr.tstart / tickperus;
     if (ntpsets++ == 0) {
         real.t0 = real_now;
         data.t0 = data_now;
     }
-    ntps += tpset.tps_size();
+    ntps += hdr.ntps;
     real.tf = real_now;
-    real.update(real_now, tpset.created());
+    real.update(real_now, hdr.created);
     data.tf = data_now;
     data.update(real_now, data_now);
 }
@@ -1,6 +1,7 @@
 #ifndef PRIVATE_PTMP_SOCKETSTATS
 #define PRIVATE_PTMP_SOCKETSTATS
 #include "ptmp/data.h"
+#include "ptmp/internals.h"
 
 #include "json.hpp"
 
@@ -31,6 +32,7 @@ namespace ptmp {
             time_stats_t real, data;
 
             void update(ptmp::data::TPSet& tpset, int tickperus = 50);
+            void update(const ptmp::internals::msg_header_t& hdr, int tickperus = 50);
             void finalize();
 
             nlohmann::json jsonify();
@@ -2,8 +2,12 @@
 #include "ptmp/internals.h"
 #include "ptmp/factory.h"
 #include "ptmp/actors.h"
+#include "ptmp/archive.h"
+#include "ptmp/recorder.h"
+#include "ptmp/metrics.h"
 
 #include <cstdio>
+#include <stdexcept>
 
 #include "json.hpp"
 
@@ -46,42 +50,60 @@ void ptmp::actor::cat(zsock_t* pipe, void* vargs)
             zsys_info("czmqat: osock: %s", cfg.c_str());
         }
     }
+    // An input file may be an archive or in the legacy format.
     FILE* ifp = NULL;
+    ptmp::internals::ArchiveReader* iar = NULL;
     std::string ifname="";
     if (!config["ifile"].is_null()) {
         ifname = config["ifile"];
-        ifp = fopen(ifname.c_str(), "r");
-        if (ifp) {
-            zsys_info("czmqat: ifile: %s", ifname.c_str());
+        iar = ptmp::internals::ArchiveReader::open(ifname);
+        if (iar) {
+            zsys_info("czmqat: ifile: %s (archive, %ld messages)",
+                      ifname.c_str(), iar->nrecords());
+        }
+        else if (!ptmp::internals::is_archive(ifname)) {
+            ifp = fopen(ifname.c_str(), "r");
+            if (ifp) {
+                zsys_info("czmqat: ifile: %s", ifname.c_str());
+            }
         }
     }
-    FILE* ofp = NULL;
-    std::string ofname="";
+    // Output files are written from a thread of their own, see
+    // ptmp/recorder.h for the options.
+    ptmp::internals::Recorder* recorder = NULL;
     if (!config["ofile"].is_null()) {
-        ofname = config["ofile"];
-        ofp = fopen(ofname.c_str(), "w");
-        if (ofp) {
-            zsys_info("czmqat: ofile: %s", ofname.c_str());
+        try {
+            recorder = new ptmp::internals::Recorder(config);
+            zsys_info("czmqat: ofile: %s", config["ofile"].get<std::string>().c_str());
+        }
+        catch (const std::runtime_error& err) {
+            zsys_error("czmqat: no ofile: %s", err.what());
+        }
+    }
+    ptmp::metrics::Metric* met = NULL;
+    int met_ms = 10000;
+    int64_t next_met = 0;
+    if (recorder and config["metrics"].is_object()) {
+        met = new ptmp::metrics::Metric(config["metrics"].dump());
+        if (config["metrics"]["period"].is_number()) {
+            met_ms = config["metrics"]["period"];
         }
+        next_met = zclock_mono() + met_ms;
     }
     zsock_signal(pipe, 0); // signal ready    
 
-    if (! (isock or ifp)) {
+    if (! (isock or ifp or iar)) {
         zsys_error("czmqat: no input, why bother?");
+        if (osock) zsock_destroy(&osock);
+        if (recorder) delete recorder;
+        if (met) delete met;
+        zsock_wait(pipe);       // for quit, so destruction does not hang
         return;
     }
 
-    const int output_timeout = 100;
-    zmq_pollitem_t pollitems[2];
-    int npollitems = 1;
-    pollitems[0].socket = zsock_resolve(pipe);
-    pollitems[0].events = ZMQ_POLLIN;
-    if (osock) {
-        void* vsock = zsock_resolve(osock);
-        assert(vsock);
-        pollitems[1].socket = vsock;
-        pollitems[1].events = ZMQ_POLLOUT;
-        ++npollitems;
+    ptmp::internals::CarefulSender sender(osock, pipe);
+    if (config["output"]["socket"]["topic"].is_boolean()) {
+        sender.set_topic(config["output"]["socket"]["topic"]);
     }
 
     zpoller_t* poller = zpoller_new(pipe, NULL);
@@ -97,14 +119,30 @@ void ptmp::actor::cat(zsock_t* pipe, void* vargs)
         if (number > 0 and count >= number) {
             break;
         }
-        ++count;
 
-        void* which = zpoller_wait(poller, timeout);
+        int wait_ms = timeout;
+        if (met and timeout < 0) {
+            wait_ms = std::max((int64_t)0, next_met - zclock_mono());
+        }
+        void* which = zpoller_wait(poller, wait_ms);
+        if (met and zclock_mono() >= next_met) {
+            json j;
+            j["recorder"] = recorder->metrics();
+            (*met)(j);
+            next_met = zclock_mono() + met_ms;
+        }
         if (which == pipe) {
             zsys_info("czmqat: got quit");
             got_quit = true;
             goto cleanup;
         }
+        if (isock and !which) {
+            if (zpoller_terminated(poller)) {
+                break;
+            }
+            continue;           // woke for metrics
+        }
+        ++count;
 
         zmsg_t* msg=NULL;
 
@@ -115,6 +153,13 @@ void ptmp::actor::cat(zsock_t* pipe, void* vargs)
                 break;
             }
         }
+        else if (iar) {
+            msg = iar->read();
+            if (!msg) {
+                zsys_info("czmqat: end of file %s after %d", ifname.c_str(), count);
+                break;
+            }
+        }
         else if (ifp) {
             msg = ptmp::internals::read(ifp);
             if (!msg) {
@@ -133,32 +178,25 @@ void ptmp::actor::cat(zsock_t* pipe, void* vargs)
             ptmp::internals::microsleep(delayus);
         }
 
-        if (ofp) {
-            ptmp::internals::write(ofp, msg);
+        if (recorder) {
+            // Never waits.  A full queue drops and is counted.
+            zmsg_t* rec = osock ? ptmp::internals::dup_msg(msg) : msg;
+            recorder->push(&rec);
+            if (rec) {
+                zmsg_destroy(&rec);
+            }
+            if (!osock) {
+                msg = NULL;
+            }
         }
         if (osock) {
-            // Note, this will block if using eg PUSH and then this
-            // actor will hang even if there is a shutdown waiting.
-            
-            while (true) {
-                int rc = zmq_poll(pollitems, 2, output_timeout);
-                if (rc == 0) {
-                    continue;   // keep waiting
-                }
-                if (pollitems[1].revents & ZMQ_POLLOUT) {
-                    int rc = zmsg_send(&msg, osock);
-                    if (rc != 0) {
-                        zsys_warning("czmqat: send failed after %d", count);
-                        break;
-                    }
-                    //zsys_debug("czmqat: send %d", count);
-                    break;
-                }
-                if (pollitems[0].revents & ZMQ_POLLIN) {
-                    zsys_info("czmqat: got quit");
-                    got_quit = true;
-                    goto cleanup;
-                }
+            // Send carefully so a blocked output (eg PUSH at HWM)
+            // does not hang this actor if a shutdown is waiting.
+            int rc = sender(&msg);
+            if (rc != 0) {
+                zsys_info("czmqat: got quit");
+                got_quit = true;
+                goto cleanup;
             }
         }
 
@@ -170,13 +208,16 @@ void ptmp::actor::cat(zsock_t* pipe, void* vargs)
 
   cleanup:
     
-    zsys_debug("czmqat: finished after %d", count);
+    zsys_debug("czmqat: finished after %d, output blocked %ld times for %.3f s",
+               count, sender.stats().nblocked, 1e-6*sender.stats().tblocked);
 
     zpoller_destroy(&poller);
     if (isock) zsock_destroy(&isock);
     if (osock) zsock_destroy(&osock);
     if (ifp) fclose(ifp);
-    if (ofp) fclose(ofp);
+    if (iar) delete iar;
+    if (recorder) delete recorder; // drains its queue
+    if (met) delete met;
     if (got_quit) {
         return;
     }
@@ -5,14 +5,159 @@
 #include "ptmp/internals.h"
 #include "ptmp/factory.h"
 #include "ptmp/actors.h"
+#include "Executor.h"
 
 #include <cstdio>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "json.hpp"
 using json = nlohmann::json;
 
 PTMP_AGENT(ptmp::TPComposer, composer)
 
+// Agent types which accept local messages and may send them.
+static const std::set<std::string> local_types{
+    "window", "filter", "zipper", "zipper_tree"};
+
+// Return the bind and connect addresses of the proxy's input or
+// output socket, if any.
+static std::vector<std::string> socket_addresses(const json& jprox, const char* io)
+{
+    std::vector<std::string> ret;
+    const json& jdata = jprox["data"];
+    if (!jdata.is_object() or !jdata.count(io) or !jdata[io].count("socket")) {
+        return ret;
+    }
+    const json& jsock = jdata[io]["socket"];
+    for (const char* bc : {"bind", "connect"}) {
+        if (jsock.count(bc) and jsock[bc].is_array()) {
+            for (const auto& jaddr : jsock[bc]) {
+                ret.push_back(jaddr);
+            }
+        }
+    }
+    return ret;
+}
+
+// Mark as "local" each output socket all of whose addresses are
+// inproc:// and used only between agents of this composer which can
+// handle local messages.  Those then pass TPSets without
+// serializing.  An address used by any other agent, or only on one
+// side, is left as is.
+static void mark_local(json& config)
+{
+    struct use_t { int nout{0}, nin{0}; bool ok{true}; };
+    std::map<std::string, use_t> uses;
+    for (const auto& jprox : config["proxies"]) {
+        const bool ok = local_types.count(jprox["type"].get<std::string>()) > 0;
+        for (const auto& addr : socket_addresses(jprox, "input")) {
+            ++uses[addr].nin;
+            uses[addr].ok = uses[addr].ok and ok;
+        }
+        for (const auto& addr : socket_addresses(jprox, "output")) {
+            ++uses[addr].nout;
+            uses[addr].ok = uses[addr].ok and ok;
+        }
+    }
+    for (auto& jprox : config["proxies"]) {
+        const auto addrs = socket_addresses(jprox, "output");
+        if (addrs.empty() or jprox["data"]["output"]["socket"].count("local")) {
+            continue;           // none or user decided
+        }
+        bool local = true;
+        for (const auto& addr : addrs) {
+            const use_t& use = uses[addr];
+            local = local and addr.compare(0, 9, "inproc://") == 0
+                and use.ok and use.nout and use.nin;
+        }
+        if (local) {
+            zsys_debug("composer: output of \"%s\" is local",
+                       jprox["name"].get<std::string>().c_str());
+            jprox["data"]["output"]["socket"]["local"] = true;
+        }
+    }
+}
+
+// Return the "numa" node of the configuration object, -1 if none.
+static int numa_node(const json& jcfg, const std::string& what)
+{
+    const json jnuma = jcfg.value("numa", json());
+    if (jnuma.is_null()) {
+        return -1;
+    }
+    if (!jnuma.is_number_integer()) {
+        zsys_error("composer: \"numa\" for \"%s\" is not a node number: %s",
+                   what.c_str(), jnuma.dump().c_str());
+        return -1;
+    }
+    return jnuma;
+}
+
+// Return the "numa_strict" of the configuration object.
+static bool numa_strict(const json& jcfg, const std::string& what)
+{
+    const json jstrict = jcfg.value("numa_strict", json());
+    if (jstrict.is_null()) {
+        return false;
+    }
+    if (!jstrict.is_boolean()) {
+        zsys_error("composer: \"numa_strict\" for \"%s\" is not a boolean: %s",
+                   what.c_str(), jstrict.dump().c_str());
+        return false;
+    }
+    return jstrict;
+}
+
+// Apply any "cpus" and "numa" placement in the configuration object
+// to the calling thread.  Threads started after inherit it.  Return
+// true if any was given.
+static bool place(const json& jcfg, const std::string& what)
+{
+    const json jcpus = jcfg.value("cpus", json());
+    std::vector<int> cpus;
+    if (jcpus.is_string()) {
+        cpus = ptmp::internals::parse_cpulist(jcpus.get<std::string>());
+    }
+    else if (jcpus.is_array()) {
+        for (const auto& jcpu : jcpus) {
+            if (!jcpu.is_number_integer()) {
+                zsys_error("composer: \"cpus\" for \"%s\" holds a non-integer: %s",
+                           what.c_str(), jcpu.dump().c_str());
+                cpus.clear();
+                break;
+            }
+            cpus.push_back(jcpu);
+        }
+    }
+    else if (!jcpus.is_null()) {
+        zsys_error("composer: \"cpus\" for \"%s\" is not a list: %s",
+                   what.c_str(), jcpus.dump().c_str());
+    }
+    const int node = numa_node(jcfg, what);
+    if (node >= 0) {
+        const bool strict = numa_strict(jcfg, what);
+        if (!ptmp::internals::set_thread_numa(node, strict)) {
+            zsys_warning("composer: failed to set NUMA node %d for \"%s\"", node, what.c_str());
+        }
+        if (cpus.empty()) {
+            cpus = ptmp::internals::numa_cpus(node);
+        }
+    }
+    if (!cpus.empty() and !ptmp::internals::set_thread_cpus(cpus)) {
+        zsys_warning("composer: failed to set CPUs for \"%s\"", what.c_str());
+    }
+    return !cpus.empty() or node >= 0;
+}
+
+static void log_placement(const std::string& what)
+{
+    const auto p = ptmp::internals::thread_placement();
+    zsys_debug("composer: \"%s\" placed on %d CPUs, now on CPU %d node %d",
+               what.c_str(), p.ncpus, p.cpu, p.node);
+}
+
 void ptmp::actor::composer(zsock_t* pipe, void* vargs)
 {
     auto config = json::parse((const char*) vargs);
@@ -23,20 +168,51 @@ void ptmp::actor::composer(zsock_t* pipe, void* vargs)
     }
     ptmp::internals::set_thread_name(name);
 
+    // The composer's own placement is the default for its agents.
+    place(config, name);
+    const std::vector<int> cpus = ptmp::internals::thread_cpus();
+    const int numa = numa_node(config, name);
+    const bool strict = numa_strict(config, name);
+    log_placement(name);
 
     zpoller_t* poller = zpoller_new(pipe, NULL);
 
     zsock_signal(pipe, 0); // signal ready    
 
+    mark_local(config);
+
+    // With an "executor", agents which can run as tasks share its
+    // thread pool and the rest get their own threads as usual.
+    ptmp::noexport::Executor* executor = nullptr;
+    if (config["executor"].is_object()) {
+        executor = new ptmp::noexport::Executor(config["executor"]);
+    }
+
+    // Agents given their own placement get their own thread.
+
     std::vector<ptmp::TPAgent*> agents;
     std::unordered_map<ptmp::TPAgent*, std::string> agent_name;
     for (auto& jprox : config["proxies"]) {
         const std::string name = jprox["name"];
         const std::string type = jprox["type"];
-        const std::string data = jprox["data"].dump();
 
+        const bool placed = jprox.count("cpus") or jprox.count("numa");
+        if (executor and !placed and executor->add(type, name, jprox["data"])) {
+            zsys_info("composer: starting %s task \"%s\"", type.c_str(), name.c_str());
+            continue;
+        }
+
+        const std::string data = jprox["data"].dump();
         zsys_info("composer: starting %s agent \"%s\"", type.c_str(), name.c_str());
+        if (placed) {
+            place(jprox, name);
+            log_placement(name);
+        }
         ptmp::TPAgent* agent = ptmp::factory::make<ptmp::TPAgent>(type, data);
+        if (placed) {           // back to the composer's own
+            ptmp::internals::set_thread_cpus(cpus);
+            ptmp::internals::set_thread_numa(numa, strict);
+        }
         if (!agent) {
             zsys_error("composer: failed to create agent \"%s\" of type \"%s\"",
                        name.c_str(), type.c_str());
@@ -45,11 +221,20 @@ void ptmp::actor::composer(zsock_t* pipe, void* vargs)
         agents.push_back(agent);
         agent_name[agent] = name;
     }
-    
+    if (executor) {
+        place(config["executor"], name + "-executor");
+        executor->start();
+        ptmp::internals::set_thread_cpus(cpus);
+        ptmp::internals::set_thread_numa(numa, strict);
+    }
 
     // wait forever or until we get interupt or quit
     void* which = zpoller_wait(poller, -1);
 
+    if (executor) {
+        zsys_debug("composer: stopping %ld tasks", executor->ntasks());
+        delete executor;
+    }
     for (auto& agent : agents) {
         zsys_debug("composer: deleting %s", agent_name[agent].c_str());
         delete agent;
@@ -0,0 +1,598 @@
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/archive.h"
+#include "ptmp/factory.h"
+#include "ptmp/actors.h"
+
+#include "json.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+PTMP_AGENT(ptmp::TPFilePlay, fileplay)
+
+using json = nlohmann::json;
+using namespace ptmp::internals;
+
+namespace {
+
+    // A message read ahead and its header.
+    struct play_msg_t {
+        zmsg_t* msg;
+        msg_header_t hdr;
+    };
+    typedef std::deque<play_msg_t> play_queue_t;
+
+    // One captured file.
+    struct play_file_t {
+        std::string name;
+        ArchiveReader* ar{nullptr};
+        FILE* fp{nullptr};
+        play_queue_t ready;     // the player's
+        play_queue_t loaded;    // the loader's, under its lock
+        bool eof{false};        // under the loader's lock
+        uint64_t nread{0}, nbad{0};
+
+        // Return the next TPSet message and its header, or nullptr
+        // at the end of the file.
+        zmsg_t* read(msg_header_t& hdr) {
+            while (true) {
+                zmsg_t* msg = ar ? ar->read() : ptmp::internals::read(fp);
+                if (!msg) {
+                    return nullptr;
+                }
+                if (msg_header(msg, hdr)) {
+                    ++nread;
+                    return msg;
+                }
+                ++nbad;
+                zmsg_destroy(&msg);
+            }
+        }
+
+        ~play_file_t() {
+            for (auto& pm : ready) { zmsg_destroy(&pm.msg); }
+            for (auto& pm : loaded) { zmsg_destroy(&pm.msg); }
+            delete ar;
+            if (fp) { fclose(fp); }
+        }
+    };
+
+    // Reads ahead of the player, one thread for all files.
+    class play_loader_t {
+    public:
+        play_loader_t(const std::vector<play_file_t*>& files, size_t readahead)
+            : m_files(files), m_readahead(std::max((size_t)2, readahead)) {
+            m_thread = std::thread(&play_loader_t::run, this);
+        }
+        ~play_loader_t() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_cond.notify_all();
+            m_thread.join();
+        }
+
+        // Move what was read of the file to its empty ready queue,
+        // waiting if needed.  Return false at the end of the file.
+        bool take(play_file_t* file) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]{ return !file->loaded.empty() or file->eof; });
+            std::swap(file->ready, file->loaded);
+            m_cond.notify_all();
+            return !file->ready.empty();
+        }
+
+    private:
+        void run() {
+            set_thread_name("fileplay-read");
+            while (true) {
+                play_file_t* file = nullptr;
+                size_t want = 0;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cond.wait(lock, [&]{
+                            return m_stop or (file = next(want)) != nullptr; });
+                    if (m_stop) {
+                        return;
+                    }
+                }
+                play_queue_t got;
+                bool eof = false;
+                while (got.size() < want) {
+                    play_msg_t pm;
+                    pm.msg = file->read(pm.hdr);
+                    if (!pm.msg) {
+                        eof = true;
+                        break;
+                    }
+                    got.push_back(pm);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    file->loaded.insert(file->loaded.end(), got.begin(), got.end());
+                    file->eof = eof;
+                }
+                m_cond.notify_all();
+            }
+        }
+
+        // The file with the least read ahead, if it is under half.
+        // Call with the lock held.
+        play_file_t* next(size_t& want) {
+            play_file_t* best = nullptr;
+            for (auto file : m_files) {
+                if (file->eof or file->loaded.size() >= m_readahead/2) {
+                    continue;
+                }
+                if (!best or file->loaded.size() < best->loaded.size()) {
+                    best = file;
+                }
+            }
+            if (best) {
+                want = m_readahead - best->loaded.size();
+            }
+            return best;
+        }
+
+        const std::vector<play_file_t*>& m_files;
+        size_t m_readahead;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_stop{false};
+        std::thread m_thread;
+    };
+
+    // A message to send.  Clones share the TPSet of their message.
+    struct play_item_t {
+        ptmp::data::data_time_t tstart{0}; // as sent
+        uint32_t detid{0};                 // as sent
+        uint64_t seq{0};                   // keeps clones in order
+        zmsg_t* msg{nullptr};              // when not cloned
+        std::shared_ptr<ptmp::data::TPSet> tpset; // when cloned
+        int64_t toffset{0};
+
+        bool operator>(const play_item_t& other) const {
+            return tstart > other.tstart or (tstart == other.tstart and seq > other.seq);
+        }
+    };
+
+    // Make count synthetic links of each message.  Clone k has
+    // detid + detid_offset + k*detid_step and its times moved by
+    // k*toffset.
+    struct play_clone_t {
+        int count{0};
+        uint32_t detid_offset{0}, detid_step{1};
+        int64_t toffset{0};
+    };
+
+    struct play_output_t {
+        zsock_t* sock{nullptr};
+        CarefulSender* sender{nullptr};
+        bool bydetid{false};
+        uint32_t detid{0};
+        std::set<uint32_t> detids; // sent so far, for watermarks
+        uint32_t count{0};
+        ptmp::data::data_time_t last_tstart{0};
+        uint64_t nsent{0}, ntardy{0};
+
+        ~play_output_t() {
+            delete sender;
+            zsock_destroy(&sock);
+        }
+    };
+
+    // Return nullptr if the socket can not be made.
+    play_output_t* make_output(json& jcfg, zsock_t* pipe)
+    {
+        zsock_t* sock = nullptr;
+        try {
+            sock = endpoint(jcfg.dump());
+        }
+        catch (const std::exception& err) {
+            zsys_error("fileplay: %s", err.what());
+        }
+        if (!sock) {
+            zsys_error("fileplay: failed to make output %s", jcfg.dump().c_str());
+            return nullptr;
+        }
+        play_output_t* out = new play_output_t;
+        out->sock = sock;
+        out->sender = new CarefulSender(sock, pipe);
+        if (jcfg["socket"]["topic"].is_boolean()) {
+            out->sender->set_topic(jcfg["socket"]["topic"]);
+        }
+        return out;
+    }
+}
+
+void ptmp::actor::fileplay(zsock_t* pipe, void* vargs)
+{
+    auto config = json::parse((const char*) vargs);
+
+    std::string name = "fileplay";
+    if (config["name"].is_string()) {
+        name = config["name"];
+    }
+    set_thread_name(name);
+
+    // As for TPReplay, speed is hardware clock ticks per microsecond.
+    // Zero plays as fast as possible.
+    double speed = 50.0;
+    if (config["speed"].is_number()) {
+        speed = config["speed"];
+    }
+    int rewrite_count = 0;
+    if (config["rewrite_count"].is_number()) {
+        rewrite_count = config["rewrite_count"];
+    }
+    int rewrite_tstart = 0;
+    if (config["rewrite_tstart"].is_number()) {
+        rewrite_tstart = config["rewrite_tstart"];
+    }
+    bool rewrite_created = true;
+    if (config["rewrite_created"].is_boolean()) {
+        rewrite_created = config["rewrite_created"];
+    }
+    int watermark = 0;
+    if (config["watermark"].is_number()) {
+        watermark = config["watermark"];
+    }
+    const ptmp::data::real_time_t watermark_us = 1000*watermark;
+    int schema = msg_schema_v0;
+    if (config["schema"].is_number()) {
+        schema = config["schema"];
+    }
+    size_t readahead = 1024;
+    if (config["readahead"].is_number()) {
+        readahead = config["readahead"];
+    }
+    // Bad configuration is reported and nothing is played.
+    bool bad = false;
+
+    play_clone_t clone;
+    if (config["clone"].is_object()) {
+        auto& jc = config["clone"];
+        if (jc["count"].is_number()) {
+            clone.count = jc["count"];
+        }
+        if (jc["detid_offset"].is_number()) {
+            clone.detid_offset = jc["detid_offset"];
+        }
+        if (jc["detid_step"].is_number()) {
+            clone.detid_step = jc["detid_step"];
+        }
+        if (jc["toffset"].is_number()) {
+            clone.toffset = jc["toffset"];
+        }
+        if (clone.toffset < 0) {
+            zsys_error("fileplay: clone toffset must not be negative");
+            bad = true;
+        }
+    }
+
+    std::vector<play_file_t*> files;
+    if (config["files"].is_array()) {
+        for (auto& jf : config["files"]) {
+            if (!jf.is_string()) {
+                zsys_error("fileplay: file names must be strings: %s", jf.dump().c_str());
+                bad = true;
+                continue;
+            }
+            play_file_t* file = new play_file_t;
+            file->name = jf;
+            file->fp = fopen(file->name.c_str(), "r");
+            if (!file->fp) {
+                zsys_error("fileplay: failed to open %s", file->name.c_str());
+                delete file;
+                continue;
+            }
+            file->ar = ArchiveReader::open(file->name);
+            if (file->ar) {
+                fclose(file->fp);
+                file->fp = nullptr;
+            }
+            else if (is_archive(file->name)) {
+                zsys_error("fileplay: failed to read archive %s", file->name.c_str());
+                delete file;
+                continue;
+            }
+            files.push_back(file);
+        }
+    }
+
+    std::vector<play_output_t*> outputs;
+    play_output_t* defout = nullptr;
+    std::unordered_map<uint32_t, play_output_t*> bydetid;
+    if (config["output"].is_object()) {
+        defout = make_output(config["output"], pipe);
+        if (defout) {
+            outputs.push_back(defout);
+        }
+        else {
+            bad = true;
+        }
+    }
+    if (config["outputs"].is_array()) {
+        for (auto& jo : config["outputs"]) {
+            if (!jo["detid"].is_number()) {
+                zsys_error("fileplay: output needs a detid: %s", jo.dump().c_str());
+                bad = true;
+                continue;
+            }
+            play_output_t* out = make_output(jo, pipe);
+            if (!out) {
+                bad = true;
+                continue;
+            }
+            out->bydetid = true;
+            out->detid = jo["detid"];
+            bydetid[out->detid] = out;
+            outputs.push_back(out);
+        }
+    }
+
+    zsock_signal(pipe, 0);      // signal ready
+
+    if (bad) {
+        for (auto out : outputs) {
+            delete out;
+        }
+        outputs.clear();
+        bydetid.clear();
+        defout = nullptr;
+    }
+    if (files.empty() or outputs.empty()) {
+        zsys_error("fileplay: need files and outputs");
+    }
+
+    zpoller_t* poller = zpoller_new(pipe, NULL);
+    play_loader_t* loader = new play_loader_t(files, readahead);
+
+    // The files in order of the tstart of their next message.
+    typedef std::pair<ptmp::data::data_time_t, size_t> head_t;
+    std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t> > heads;
+    for (size_t ind=0; ind<files.size() and !outputs.empty(); ++ind) {
+        if (loader->take(files[ind])) {
+            heads.push(head_t(files[ind]->ready.front().hdr.tstart, ind));
+        }
+    }
+
+    // Without any rewrite, messages go out as read.
+    const bool rewrite = rewrite_created or rewrite_count or rewrite_tstart;
+
+    // Clones wait here until no earlier message may come from a file.
+    std::priority_queue<play_item_t, std::vector<play_item_t>,
+                        std::greater<play_item_t> > pending;
+    uint64_t seq = 0;
+
+    // Take the earliest message from the files.
+    auto pop_file = [&](play_msg_t& pm) {
+        const size_t ifile = heads.top().second;
+        heads.pop();
+        play_file_t* file = files[ifile];
+        pm = file->ready.front();
+        file->ready.pop_front();
+        if (!file->ready.empty() or loader->take(file)) {
+            heads.push(head_t(file->ready.front().hdr.tstart, ifile));
+        }
+    };
+
+    // Set the next item to send, return false when all are sent.
+    auto next_item = [&](play_item_t& item) {
+        if (!clone.count) {
+            if (heads.empty()) {
+                return false;
+            }
+            play_msg_t pm;
+            pop_file(pm);
+            item.msg = pm.msg;
+            item.tstart = pm.hdr.tstart;
+            item.detid = pm.hdr.detid;
+            return true;
+        }
+        // Offsets are not negative so the next file message bounds
+        // the times of any clone still to be made.
+        while (!heads.empty() and (pending.empty() or heads.top().first <= pending.top().tstart)) {
+            play_msg_t pm;
+            pop_file(pm);
+            auto tpset = std::make_shared<ptmp::data::TPSet>();
+            recv(&pm.msg, *tpset);
+            for (int ind=0; ind<clone.count; ++ind) {
+                play_item_t one;
+                one.toffset = ind*clone.toffset;
+                one.tstart = pm.hdr.tstart + one.toffset;
+                one.detid = pm.hdr.detid + clone.detid_offset + ind*clone.detid_step;
+                one.seq = seq++;
+                one.tpset = tpset;
+                pending.push(one);
+            }
+        }
+        if (pending.empty()) {
+            return false;
+        }
+        item = pending.top();
+        pending.pop();
+        return true;
+    };
+
+    ptmp::data::real_time_t first_created = 0, last_sent = 0;
+    ptmp::data::data_time_t first_tstart = 0;
+    uint64_t count = 0, nunrouted = 0;
+    bool got_quit = false;
+    play_item_t item;
+    while (!zsys_interrupted) {
+        // The sender only sees the pipe when it must wait so check
+        // here too, as at full speed that may be never.
+        if (zsock_events(pipe) & ZMQ_POLLIN) {
+            got_quit = true;
+            break;
+        }
+        if (!next_item(item)) {
+            break;
+        }
+        const ptmp::data::data_time_t tstart = item.tstart;
+
+        play_output_t* out = defout;
+        auto it = bydetid.find(item.detid);
+        if (it != bydetid.end()) {
+            out = it->second;
+        }
+        if (!out) {
+            ++nunrouted;
+            zmsg_destroy(&item.msg);
+            continue;
+        }
+        if (out->nsent and tstart < out->last_tstart) {
+            ++out->ntardy;      // the file was out of order
+            zmsg_destroy(&item.msg);
+            continue;
+        }
+
+        // Wait until due, sending watermarks if it is a while.
+        if (speed > 0) {
+            if (!first_created) {
+                first_created = last_sent = ptmp::data::now();
+                first_tstart = tstart;
+            }
+            // Signed, in case a file is out of order.
+            const int64_t dtick = tstart - first_tstart;
+            const ptmp::data::real_time_t due = first_created + dtick/speed;
+            while (!got_quit) {
+                const ptmp::data::real_time_t t_now = ptmp::data::now();
+                if (t_now >= due) {
+                    break;
+                }
+                ptmp::data::real_time_t left = due - t_now;
+                if (watermark_us) {
+                    if (t_now - last_sent >= watermark_us) {
+                        // Nothing earlier than the pending message will
+                        // follow, for any detid sent to each output.
+                        ptmp::data::data_time_t wm_tstart = tstart;
+                        if (rewrite_tstart != 0) {
+                            wm_tstart = (t_now - rewrite_tstart)*speed;
+                        }
+                        for (auto wout : outputs) {
+                            std::set<uint32_t> detids = wout->detids;
+                            if (wout->bydetid) {
+                                detids.insert(wout->detid);
+                            }
+                            else if (wout == out) {
+                                detids.insert(item.detid);
+                            }
+                            for (uint32_t detid : detids) {
+                                ptmp::data::TPSet wm;
+                                make_watermark(wm, detid, wm_tstart);
+                                if ((*wout->sender)(wm, schema) != 0) {
+                                    got_quit = true;
+                                    break;
+                                }
+                            }
+                            if (got_quit) {
+                                break;
+                            }
+                        }
+                        last_sent = t_now;
+                        continue;
+                    }
+                    left = std::min(left, last_sent + watermark_us - t_now);
+                }
+                if (left < 2000) {
+                    microsleep(left);
+                    continue;
+                }
+                void* which = zpoller_wait(poller, left/1000 - 1);
+                if (which == pipe or zpoller_terminated(poller)) {
+                    got_quit = which == pipe;
+                    break;
+                }
+            }
+            if (got_quit or zsys_interrupted) {
+                zmsg_destroy(&item.msg);
+                break;
+            }
+        }
+
+        int rc = 0;
+        if (item.msg and !rewrite) {
+            rc = (*out->sender)(&item.msg);
+        }
+        else {
+            ptmp::data::TPSet tpset;
+            if (item.msg) {
+                recv(&item.msg, tpset);
+            }
+            else {
+                tpset = *item.tpset;
+                tpset.set_detid(item.detid);
+                tpset.set_tstart(item.tstart);
+                for (auto& tp : *tpset.mutable_tps()) {
+                    tp.set_tstart(tp.tstart() + item.toffset);
+                }
+                item.tpset.reset();
+            }
+            if (rewrite_created) {
+                tpset.set_created(ptmp::data::now());
+            }
+            if (rewrite_count) {
+                tpset.set_count(out->count);
+            }
+            if (rewrite_tstart != 0) {
+                tpset.set_tstart((ptmp::data::now() - rewrite_tstart)*speed);
+            }
+            rc = (*out->sender)(tpset, schema);
+        }
+        if (rc != 0) {
+            got_quit = true;
+            break;
+        }
+        ++out->count;
+        ++out->nsent;
+        out->last_tstart = tstart;
+        out->detids.insert(item.detid);
+        last_sent = ptmp::data::now();
+        ++count;
+    }
+
+    zsys_debug("fileplay: finished after %ld from %ld files, %ld not routed",
+               count, files.size(), nunrouted);
+    for (auto out : outputs) {
+        if (out->ntardy) {
+            zsys_warning("fileplay: dropped %ld out of order", out->ntardy);
+        }
+        delete out;
+    }
+    delete loader;
+    for (auto file : files) {
+        if (file->nbad) {
+            zsys_warning("fileplay: skipped %ld malformed in %s", file->nbad, file->name.c_str());
+        }
+        delete file;
+    }
+    zpoller_destroy(&poller);
+
+    if (got_quit) {
+        return;
+    }
+    zsys_debug("fileplay: waiting for quit");
+    zsock_wait(pipe);
+}
+
+
+ptmp::TPFilePlay::TPFilePlay(const std::string& config)
+    : m_actor(zactor_new(ptmp::actor::fileplay, (void*)config.c_str()))
+{
+}
+
+ptmp::TPFilePlay::~TPFilePlay()
+{
+    zsock_signal(zactor_sock(m_actor), 0); // signal quit
+    zactor_destroy(&m_actor);
+}
@@ -79,6 +79,7 @@ public:
         
 
 };
+PTMP_REACTOR_APP(FilterApp, filter)
 
 
 // The actor function (reactor pattern)
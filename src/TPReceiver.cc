@@ -23,3 +23,11 @@ bool ptmp::TPReceiver::operator()(ptmp::data::TPSet& tps, int toms)
     return true;
 }
 
+ptmp::data::TPSet* ptmp::TPReceiver::operator()(google::protobuf::Arena& arena, int toms)
+{
+    zmsg_t* msg = m_sock->msg(toms);
+    if (!msg) {
+        return nullptr;
+    }
+    return ptmp::internals::recv(&msg, &arena);
+}
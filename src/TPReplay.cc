@@ -52,11 +52,28 @@ void ptmp::actor::replay(zsock_t* pipe, void* vargs)
     if (config["rewrite_tstart"].is_number()) {
         rewrite_tstart = config["rewrite_tstart"];
     }
-    
+
+    // if nonzero, while waiting longer than this many ms to send the
+    // next message, send a watermark each time this much time passes.
+    int watermark = 0;
+    if (config["watermark"].is_number()) {
+        watermark = config["watermark"];
+    }
+    const ptmp::data::real_time_t watermark_us = 1000*watermark;
+
+    // The message schema version to use for output (0 or 2).
+    int schema = ptmp::internals::msg_schema_v0;
+    if (config["schema"].is_number()) {
+        schema = config["schema"];
+    }
 
     zsock_signal(pipe, 0);      // signal ready
 
     zpoller_t* poller = zpoller_new(pipe, isock, NULL);
+    ptmp::internals::CarefulSender sender(osock, pipe);
+    if (config["output"]["socket"]["topic"].is_boolean()) {
+        sender.set_topic(config["output"]["socket"]["topic"]);
+    }
 
     int wait_time_ms = -1;
 
@@ -88,10 +105,24 @@ void ptmp::actor::replay(zsock_t* pipe, void* vargs)
             break;
         }
 
-        // unpack message to get timing
+        // peek at header to get timing before paying for a full parse
+        ptmp::internals::msg_header_t hdr;
+        if (!ptmp::internals::msg_header(msg, hdr)) {
+            zsys_warning("replay: dropping malformed message");
+            zmsg_destroy(&msg);
+            continue;
+        }
+        const ptmp::data::data_time_t tstart = hdr.tstart;
+
+        if (last_created != 0 and tstart < last_tstart) {
+            // tardy
+            zsys_debug("replay: tardy %d", hdr.count);
+            zmsg_destroy(&msg);
+            continue;
+        }
+
         ptmp::data::TPSet tpset;
         ptmp::internals::recv(&msg, tpset);
-        const ptmp::data::data_time_t tstart = tpset.tstart();
 
         if (last_created == 0) { // first message
             first_created = last_created = ptmp::data::now();
@@ -105,27 +136,16 @@ void ptmp::actor::replay(zsock_t* pipe, void* vargs)
                 tpset.set_tstart((tpset.created() - rewrite_tstart)*speed);
             }
 
-            // fixme: kludge to avoid output block stopping shutdown
-            while (! (zsock_events(osock) & ZMQ_POLLOUT)) {
-                if (zsock_events(pipe) & ZMQ_POLLIN) {
-                    got_quit = true;
-                    goto cleanup;
-                }
-                zclock_sleep(1); // ms
+            // send carefully so output block does not stop shutdown
+            if (sender(tpset, schema) != 0) {
+                got_quit = true;
+                goto cleanup;
             }
-
-            ptmp::internals::send(osock, tpset);
             ++count;
             zsys_debug("replay: first");
             continue;
         }
 
-        if (tstart < last_tstart) {
-            // tardy
-            zsys_debug("replay: tardy %d", tpset.count());
-            continue;
-        }
-
         const ptmp::data::real_time_t delta_tau = (tstart - first_tstart)/speed;
         const ptmp::data::real_time_t t_now = ptmp::data::now();
         const ptmp::data::real_time_t delta_t = t_now - first_created;
@@ -133,7 +153,24 @@ void ptmp::actor::replay(zsock_t* pipe, void* vargs)
         last_tstart = tstart;
         last_created = t_now;
         if (to_sleep > 0) {
-            ptmp::internals::microsleep(to_sleep);
+            ptmp::data::real_time_t left = to_sleep;
+            while (watermark_us and left > watermark_us) {
+                ptmp::internals::microsleep(watermark_us);
+                left -= watermark_us;
+
+                // Nothing earlier than the pending message will follow.
+                ptmp::data::TPSet wm;
+                ptmp::data::data_time_t wm_tstart = tstart;
+                if (rewrite_tstart != 0) {
+                    wm_tstart = (ptmp::data::now() - rewrite_tstart)*speed;
+                }
+                ptmp::internals::make_watermark(wm, hdr.detid, wm_tstart);
+                if (sender(wm, schema) != 0) {
+                    got_quit = true;
+                    goto cleanup;
+                }
+            }
+            ptmp::internals::microsleep(left);
         }
         {
             tpset.set_created(ptmp::data::now());
@@ -144,22 +181,18 @@ void ptmp::actor::replay(zsock_t* pipe, void* vargs)
                 tpset.set_tstart((tpset.created() - rewrite_tstart)*speed);
             }
 
-            // fixme: kludge to avoid output block stopping shutdown
-            while (! (zsock_events(osock) & ZMQ_POLLOUT)) {
-                if (zsock_events(pipe) & ZMQ_POLLIN) {
-                    got_quit = true;
-                    goto cleanup;
-                }
-                zclock_sleep(1); // ms
+            // send carefully so output block does not stop shutdown
+            if (sender(tpset, schema) != 0) {
+                got_quit = true;
+                goto cleanup;
             }
-
-            ptmp::internals::send(osock, tpset);
             ++count;
         }
     }
 
   cleanup:
-    zsys_debug("replay: finished after %d", count);
+    zsys_debug("replay: finished after %d, output blocked %ld times for %.3f s",
+               count, sender.stats().nblocked, 1e-6*sender.stats().tblocked);
 
     zpoller_destroy(&poller);
     zsock_destroy(&isock);
@@ -17,5 +17,6 @@ ptmp::TPSender::~TPSender()
 
 void ptmp::TPSender::operator()(const data::TPSet& tps)
 {
-    ptmp::internals::send(m_sock->get(), tps);
+    ptmp::internals::send(m_sock->get(), tps, ptmp::internals::msg_schema_v0,
+                          m_sock->topic());
 }
@@ -17,28 +17,14 @@ PTMP_AGENT(ptmp::TPSorted, sorted)
 using json = nlohmann::json;
 
 
-// This is probably a painfully slow function that gets run multiple
-// times on the same message.  The PTMP message coded design is
-// systemically not optimal.  A header with count/detid/tstart should
-// be cheap to unpack.  Something like zproto_codec_c would be better.
-// The payload could still be in protobuf.  With just one message type
-// this is all messy enough but if ptmp expands to multiple message
-// types then things will get even hairier.
-//
-// For now, just forge ahead and see how bad it performs, but keep
-// this function static to contain the cancer.
-struct msg_header_t {
-    uint32_t count, detid;
-    ptmp::data::data_time_t tstart;
-    ptmp::data::real_time_t created;
-};
+// Message headers are read via ptmp::internals::msg_header() which
+// is cheap for schema v2 messages but must parse the payload of v0.
+using ptmp::internals::msg_header_t;
 static msg_header_t msg_header(zmsg_t* msg)
 {
-    zmsg_first(msg);            // msg id
-    zframe_t* pay = zmsg_next(msg);
-    ptmp::data::TPSet tps;
-    tps.ParseFromArray(zframe_data(pay), zframe_size(pay));
-    return msg_header_t{tps.count(), tps.detid(), tps.tstart(), tps.created()};
+    msg_header_t hdr{};
+    ptmp::internals::msg_header(msg, hdr);
+    return hdr;
 }
 
 static void header_dump(std::string s, msg_header_t& h)
@@ -152,7 +138,7 @@ void ptmp::actor::sorted(zsock_t* pipe, void* vargs)
     for (size_t ind=0; ind<ninputs; ++ind) {
         zsock_t* s = input[ind];
         sockinfo.push_back({ind, s, zpoller_new(s, NULL), 0,
-                            {0,0,EOT}, NULL, 0,0});
+                            {EOT,0,0,0,0,0}, NULL, 0,0});
     }
 
     zpoller_t* pipe_poller = zpoller_new(pipe, NULL);
@@ -268,6 +254,8 @@ void ptmp::actor::sorted(zsock_t* pipe, void* vargs)
         si.msg = NULL;
         last_msg_time = si.msg_header.tstart;
         si.msg_header.tstart = EOT;
+        // a local TPSet can not be copied or leave the process
+        ptmp::internals::materialize(&msg);
 
         // send out message to all outputs
         int sends_left = output.size();
@@ -4,7 +4,11 @@
 #include "ptmp/factory.h"
 #include "ptmp/actors.h"
 
-#include <queue>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <vector>
 
 PTMP_AGENT(ptmp::TPWindow, window)
 
@@ -18,29 +22,33 @@ using json = nlohmann::json;
 // 
 // - tspan :: the duration of the window in HW clock ticks
 //
+// - tstride :: the time between starts of consecutive windows.  It
+//   must divide tspan.  Equal to tspan gives tumbling windows while
+//   smaller gives sliding windows which overlap by tspan-tstride.
+//
 // - toff :: an offset in HW clock ticks from if t=0 was a boundary.
 //
+// Time is partitioned into slices of duration tstride and window wind
+// covers the nslices() slices starting with slice index wind.
+//
 struct time_window_t {
 
-    ptmp::data::data_time_t wind;
-    ptmp::data::data_time_t toff, tspan;
+    ptmp::data::data_time_t wind{0};
+    ptmp::data::data_time_t toff{0}, tspan{0}, tstride{0};
 
-    time_window_t(ptmp::data::data_time_t tspan_,
-                  ptmp::data::data_time_t toff_,
-                  ptmp::data::data_time_t wind_ = 0)
-        : tspan(tspan_), toff(toff_%tspan_), wind(wind_) { }
-    time_window_t() : tspan(0), toff(0), wind(0) { }
     void init(ptmp::data::data_time_t tspan_,
               ptmp::data::data_time_t toff_,
+              ptmp::data::data_time_t tstride_,
               ptmp::data::data_time_t wind_ = 0) {
         tspan = tspan_;
-        toff = toff_%tspan_;
+        tstride = tstride_;
+        toff = toff_%tstride_;
         wind = wind_;
     }
 
     // return the begin time of the window
     ptmp::data::data_time_t tbegin() const {
-        return wind*tspan + toff;
+        return wind*tstride + toff;
     }
 
     // Return true if t is in time window
@@ -56,8 +64,21 @@ struct time_window_t {
         return 0;
     }
 
+    // number of slices in one window
+    ptmp::data::data_time_t nslices() const {
+        return tspan / tstride;
+    }
+
+    // return the index of the slice holding t
+    ptmp::data::data_time_t index(ptmp::data::data_time_t t) const {
+        return (t-toff) / tstride;
+    }
+
+    // set to the earliest window holding t
     void set_bytime(ptmp::data::data_time_t t) {
-        wind = (t-toff) / tspan;
+        const ptmp::data::data_time_t islice = index(t);
+        const ptmp::data::data_time_t nslice = nslices();
+        wind = islice+1 >= nslice ? islice+1-nslice : 0;
     }
     void advance() {
         ++wind;
@@ -65,60 +86,398 @@ struct time_window_t {
 
 };
 
-struct tp_greater_t {
-    bool operator()(const ptmp::data::TrigPrim& a, const ptmp::data::TrigPrim& b) {
-        // give priority to smaller times
-        return a.tstart() > b.tstart();
-    }
+// A trigger primitive reduced to plain data for buffering.  The
+// detid of its TPSet is kept, in what would be padding, for shedding.
+struct tp_pod_t {
+    ptmp::data::data_time_t tstart;
+    uint32_t channel, tspan, adcsum, adcpeak, flags, detid;
 };
 
+// The TPs buffered for one slice of time.  Once a window needs them
+// they are sorted and encoded, once, to be shared by every window
+// which overlaps the slice.
+struct tp_slice_t {
+    ptmp::data::data_time_t islice{0};
+    ptmp::data::data_time_t tmin{0};
+    std::vector<tp_pod_t> tps;
+
+    // valid when encoded is true, wire and ends only if encoded to wire
+    bool encoded{false};
+    std::string wire;
+    std::vector<uint32_t> ends; // end offset in wire of each TP
+    ptmp::internals::tpset_extra_t extra;
+
+    // sort and encode if not yet done.  Without to_wire, only sort
+    // and find extra, for output which sends the TPs unencoded.
+    void encode(bool to_wire = true) {
+        if (encoded) { return; }
+        std::sort(tps.begin(), tps.end(),
+                  [](const tp_pod_t& a, const tp_pod_t& b) {
+                      return a.tstart < b.tstart; });
+        wire.clear();
+        ends.clear();
+        extra = ptmp::internals::tpset_extra_t{tps.front().channel, tps.front().channel, 0};
+        for (const auto& tp : tps) {
+            if (to_wire) {
+                ptmp::internals::encode_tp(wire, tp.channel, tp.tstart, tp.tspan,
+                                           tp.adcsum, tp.adcpeak, tp.flags);
+                ends.push_back(wire.size());
+            }
+            extra.totaladc += tp.adcsum;
+            extra.chanbeg = std::min(extra.chanbeg, tp.channel);
+            extra.chanend = std::max(extra.chanend, tp.channel);
+        }
+        encoded = true;
+    }
+
+    void clear() {
+        tps.clear();
+        wire.clear();
+        ends.clear();
+        encoded = false;
+    }
+};
 
-// a priority queue of TPs ordered by tstart that also keeps track of
-// the highest tstart its seen.
-class priority_tp_span_t {
+// A buffer of TPs bucketed by the index of the slice holding their
+// tstart.  Slices starting from the earliest held live in a fixed ring
+// which keep their memory after being retired.  Any beyond the reach
+// of the ring wait in an overflow map until the ring advances to them.
+// It also keeps track of the highest tstart seen.
+class tp_window_buffer_t {
 public:
-    typedef ptmp::data::TrigPrim value_type;
-    typedef typename std::vector<value_type> collection_type;
 
-    ptmp::data::data_time_t span() const {
-        if (empty()) { return 0; }
-        return m_recent - m_pqueue.top().tstart();
+    // Set window definition and ring size in number of slices.
+    void init(const time_window_t& win, size_t nslices) {
+        m_win = win;
+        size_t nring = 16;
+        while (nring < nslices) {
+            nring <<= 1;
+        }
+        m_ring.resize(nring);
+        m_mask = nring-1;
     }
 
+    // Slices are encoded to protobuf wire bytes unless this is
+    // false, in which case they are only sorted.
+    void set_wire(bool wire) { m_wire = wire; }
+
     ptmp::data::data_time_t covers(ptmp::data::data_time_t t) const {
         if (empty()) { return 0; }
         return m_recent - t;
     }
 
-    // Add a TP to the queue.  
-    void add(const ptmp::data::TrigPrim& tp) {
-        ptmp::data::data_time_t tstart = tp.tstart();
+    // Add a TP to its slice.
+    void add(const ptmp::data::TrigPrim& tp, uint32_t detid) {
+        add(tp_pod_t{tp.tstart(), tp.channel(), tp.tspan(),
+                    tp.adcsum(), tp.adcpeak(), tp.flags(), detid});
+    }
+    void add(const tp_pod_t& tp) {
+        const ptmp::data::data_time_t tstart = tp.tstart;
+        const ptmp::data::data_time_t islice = m_win.index(tstart);
+        if (empty()) {
+            m_first = islice;
+        }
+        else if (islice < m_first) {
+            rebase(islice);
+        }
+        tp_slice_t& s = slice(islice);
+        if (s.tps.empty() or tstart < s.tmin) {
+            s.tmin = tstart;
+        }
+        s.tps.push_back(tp);
+        s.encoded = false;
+        ++m_size;
         m_recent = std::max(m_recent, tstart);
-        m_pqueue.push(tp);
     }
 
-    // forward methods
-    bool empty() const { return m_pqueue.empty(); }
-    size_t size() const { return m_pqueue.size(); }
-    const value_type& top() const { return m_pqueue.top(); }
-    void pop() { m_pqueue.pop(); }
+    bool empty() const { return m_size == 0; }
+    size_t size() const { return m_size; }
+
+    // Return the smallest tstart held.  Buffer must not be empty.
+    ptmp::data::data_time_t tmin() const {
+        ptmp::data::data_time_t t = 0;
+        tmin_from(m_first, t);
+        return t;
+    }
+
+    // Set t to the smallest tstart held in slices from islice on.
+    // Return false if there are none.
+    bool tmin_from(ptmp::data::data_time_t islice, ptmp::data::data_time_t& t) const {
+        islice = std::max(islice, m_first);
+        for (auto ind = islice; ind < m_first + m_ring.size(); ++ind) {
+            const tp_slice_t& s = m_ring[ind & m_mask];
+            if (!s.tps.empty()) {
+                t = s.tmin;
+                return true;
+            }
+        }
+        auto it = m_far.lower_bound(islice);
+        if (it == m_far.end()) {
+            return false;
+        }
+        t = it->second.tmin;
+        return true;
+    }
+
+    // Return the slice islice or nullptr if it holds no TPs.
+    const tp_slice_t* find(ptmp::data::data_time_t islice) const {
+        if (islice < m_first) {
+            return nullptr;
+        }
+        const tp_slice_t* s = nullptr;
+        if (islice - m_first < m_ring.size()) {
+            s = &m_ring[islice & m_mask];
+        }
+        else {
+            auto it = m_far.find(islice);
+            if (it != m_far.end()) {
+                s = &it->second;
+            }
+        }
+        if (!s or s->tps.empty()) {
+            return nullptr;
+        }
+        return s;
+    }
+
+    // Return the encoded slice islice or nullptr if it holds no TPs.
+    // Valid until the next add() or retire().
+    const tp_slice_t* encoded(ptmp::data::data_time_t islice) {
+        tp_slice_t* s = const_cast<tp_slice_t*>(find(islice));
+        if (s) {
+            s->encode(m_wire);
+        }
+        return s;
+    }
+
+    // Encode all slices before islice.
+    void encode_until(ptmp::data::data_time_t islice) {
+        for (auto ind = m_first; ind < std::min(islice, m_first + m_ring.size()); ++ind) {
+            tp_slice_t& s = m_ring[ind & m_mask];
+            if (!s.tps.empty()) {
+                s.encode(m_wire);
+            }
+        }
+        for (auto it = m_far.begin(); it != m_far.end() and it->first < islice; ++it) {
+            it->second.encode(m_wire);
+        }
+    }
+
+    // Call func on every TP held.
+    template<typename Func>
+    void for_each_tp(Func func) const {
+        for (const auto& s : m_ring) {
+            for (const auto& tp : s.tps) { func(tp); }
+        }
+        for (const auto& one : m_far) {
+            for (const auto& tp : one.second.tps) { func(tp); }
+        }
+    }
+
+    // Drop every TP for which pred is true.  Return number dropped.
+    template<typename Pred>
+    size_t drop_if(Pred pred) {
+        size_t ndropped = 0;
+        auto drop = [&](tp_slice_t& s) {
+            if (s.tps.empty()) { return; }
+            auto end = std::remove_if(s.tps.begin(), s.tps.end(), pred);
+            const size_t n = s.tps.end() - end;
+            if (!n) { return; }
+            s.tps.erase(end, s.tps.end());
+            s.encoded = false;
+            if (!s.tps.empty()) {
+                s.tmin = std::min_element(s.tps.begin(), s.tps.end(),
+                                          [](const tp_pod_t& a, const tp_pod_t& b) {
+                                              return a.tstart < b.tstart; })->tstart;
+            }
+            ndropped += n;
+        };
+        for (auto& s : m_ring) { drop(s); }
+        for (auto it = m_far.begin(); it != m_far.end();) {
+            drop(it->second);
+            if (it->second.tps.empty()) {
+                it = m_far.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        m_size -= ndropped;
+        return ndropped;
+    }
+
+    // Drop the TPs of slice islice and all before it.
+    void retire(ptmp::data::data_time_t islice) {
+        if (islice < m_first) {
+            return;
+        }
+        for (auto ind = m_first; ind < std::min(islice+1, m_first + m_ring.size()); ++ind) {
+            tp_slice_t& s = m_ring[ind & m_mask];
+            m_size -= s.tps.size();
+            s.clear();
+        }
+        while (!m_far.empty() and m_far.begin()->first <= islice) {
+            m_size -= m_far.begin()->second.tps.size();
+            m_far.erase(m_far.begin());
+        }
+        rebase(islice+1);
+    }
 
 private:
-    std::priority_queue<value_type, collection_type, tp_greater_t> m_pqueue;
+
+    // The slice islice which must not precede m_first.
+    tp_slice_t& slice(ptmp::data::data_time_t islice) {
+        tp_slice_t& s = (islice - m_first < m_ring.size())
+            ? m_ring[islice & m_mask] : m_far[islice];
+        s.islice = islice;
+        return s;
+    }
+
+    // Move the first slice of the ring, spilling to or filling from
+    // the overflow as needed.
+    void rebase(ptmp::data::data_time_t first) {
+        const size_t nring = m_ring.size();
+        if (first < m_first) {
+            for (auto islice = std::max(first+nring, m_first); islice < m_first+nring; ++islice) {
+                tp_slice_t& s = m_ring[islice & m_mask];
+                if (s.tps.empty()) { continue; }
+                std::swap(m_far[islice], s);
+                s.clear();
+            }
+        }
+        m_first = first;
+        while (!m_far.empty() and m_far.begin()->first - m_first < nring) {
+            auto it = m_far.begin();
+            tp_slice_t& s = m_ring[it->first & m_mask];
+            std::swap(s, it->second);
+            m_far.erase(it);
+        }
+    }
+
+    time_window_t m_win;
+    std::vector<tp_slice_t> m_ring;
+    size_t m_mask{0};
+    std::map<ptmp::data::data_time_t, tp_slice_t> m_far;
+
+    // slice index of first ring entry
+    ptmp::data::data_time_t m_first{0};
+    size_t m_size{0};
 
     // most recent (largest) hw clock seen
     ptmp::data::data_time_t m_recent{0};
+    bool m_wire{true};
+};
+
+
+// One channel range shard of a multi-threaded window.  Its thread
+// adds batches of TPs as they are handed to it, without reply, so the
+// reactor thread goes on to receive and parse more input.  Only when
+// a window is due does the reactor ask it to encode and wait for it.
+// After that reply, and until it sends the next command, the reactor
+// thread owns the buffer.
+struct window_shard_t {
+    tp_window_buffer_t buffer;
+
+    // TPs staged by the reactor thread for the next batch
+    std::vector<tp_pod_t> staged;
+
+    void add(std::vector<tp_pod_t>* batch) {
+        for (const auto& tp : *batch) {
+            buffer.add(tp);
+        }
+        delete batch;
+    }
+};
+
+// Commands, as picture "sp8": "add" with a batch to take over or
+// "encode" with the slice to encode up to (0 for none), which replies.
+static void window_shard(zsock_t* pipe, void* vargs)
+{
+    window_shard_t* shard = (window_shard_t*)vargs;
+    zsock_signal(pipe, 0);      // signal ready
+    while (true) {
+        char* cmd = nullptr;
+        void* batch = nullptr;
+        uint64_t until = 0;
+        int rc = zsock_recv(pipe, "sp8", &cmd, &batch, &until);
+        if (rc != 0 or !cmd) {
+            break;              // interrupted
+        }
+        const bool term = streq(cmd, "$TERM");
+        const bool add = streq(cmd, "add");
+        zstr_free(&cmd);
+        if (term) {
+            break;
+        }
+        if (add) {
+            shard->add((std::vector<tp_pod_t>*)batch);
+            continue;
+        }
+        if (until) {
+            shard->buffer.encode_until(until);
+        }
+        zsock_signal(pipe, 0);
+    }
+}
+
+// Read cursor over the TPs of one shard's slices of one window.
+struct shard_cursor_t {
+    std::vector<const tp_slice_t*> slices;
+    size_t islice{0}, itp{0};
+
+    bool done() const { return islice == slices.size(); }
+    const tp_pod_t& tp() const { return slices[islice]->tps[itp]; }
+    void next() {
+        if (++itp == slices[islice]->tps.size()) {
+            itp = 0;
+            ++islice;
+        }
+    }
+    // append encoded bytes of current TP
+    void copy(std::string& out) const {
+        const tp_slice_t* s = slices[islice];
+        const uint32_t beg = itp ? s->ends[itp-1] : 0;
+        out.append(s->wire.data() + beg, s->ends[itp] - beg);
+    }
 };
 
 class WindowApp : public ptmp::noexport::ReactorApp {
-    ptmp::data::data_time_t tspan{0}, toff{0}, tbuf{0};
+    ptmp::data::data_time_t tspan{0}, toff{0}, tbuf{0}, tstride{0};
 
     time_window_t window;
-    priority_tp_span_t buffer;
+    tp_window_buffer_t buffer;
+
+    // encoded slices of the outgoing window
+    std::vector<const std::string*> out_slices;
+
+    // Sharded mode, when more than one shard, splits TPs by channel
+    // range.
+    std::vector<window_shard_t*> shards;
+    std::vector<zactor_t*> shard_actors;
+    std::vector<shard_cursor_t> cursors;
+    std::string out_wire;
+    uint32_t shard_chans{128};
+    size_t held_tps{0};         // over all shards, staged or added
+    ptmp::data::data_time_t recent{0};
+    ptmp::data::data_time_t held_tmin{std::numeric_limits<ptmp::data::data_time_t>::max()};
+
+    // Input watermark by detid.  Sources which have only sent data
+    // are held at zero so they keep windows waiting on tbuf.
+    std::map<uint32_t, ptmp::data::data_time_t> in_watermarks;
+
+    // Budget on the number of TPs held, zero for none, and how to
+    // shed TPs when it is exceeded.
+    enum class shed_policy_t { oldest, lowest_adc, detid };
+    size_t budget_tps{0};
+    shed_policy_t shed_policy{shed_policy_t::oldest};
+    std::string shed_name{"oldest"};
 
     // fodder for additional metrics with window semantics not held in
     // base
     size_t count_tardy_tps{0};
+    size_t count_shed_tps{0}, count_shed_events{0};
+    uint32_t shed_adc_max{0};
+    std::map<uint32_t, size_t> shed_detids;
 
 public:
 
@@ -135,85 +494,521 @@ public:
             zsys_error("window (%s): requires finite tspan", name.c_str());
             throw std::runtime_error("tpwindow requires finite tspan");
         }
+        tstride = tspan;
+        if (config["tstride"].is_number()) {
+            tstride = config["tstride"];
+        }
+        if (!tstride or tstride > tspan or tspan % tstride) {
+            zsys_error("window (%s): tstride %ld must divide tspan %ld",
+                       name.c_str(), tstride, tspan);
+            throw std::runtime_error("tpwindow requires tstride to divide tspan");
+        }
         if (config["tbuf"].is_number()) {
             tbuf = config["tbuf"].get<int>();
         }
         tbuf = std::max(tspan, tbuf);
-        window.init(tspan, toff);
+        window.init(tspan, toff, tstride);
+        buffer.init(window, (tbuf+2*tspan)/tstride + 2);
+
+        if (config["budget_tps"].is_number()) {
+            budget_tps = config["budget_tps"];
+        }
+        if (config["shed_policy"].is_string()) {
+            shed_name = config["shed_policy"];
+        }
+        if (shed_name == "oldest") {
+            shed_policy = shed_policy_t::oldest;
+        }
+        else if (shed_name == "lowest_adc") {
+            shed_policy = shed_policy_t::lowest_adc;
+        }
+        else if (shed_name == "detid") {
+            shed_policy = shed_policy_t::detid;
+        }
+        else {
+            zsys_error("window (%s): unknown shed_policy \"%s\"",
+                       name.c_str(), shed_name.c_str());
+            throw std::runtime_error("tpwindow given unknown shed_policy");
+        }
+
+        int nshards = 1;
+        if (config["shards"].is_number()) {
+            nshards = config["shards"];
+        }
+        if (config["shard_chans"].is_number()) {
+            shard_chans = std::max(1, config["shard_chans"].get<int>());
+        }
+        if (nshards > 1) {
+            for (int ind=0; ind<nshards; ++ind) {
+                window_shard_t* shard = new window_shard_t;
+                shard->buffer.init(window, (tbuf+2*tspan)/tstride + 2);
+                shards.push_back(shard);
+                shard_actors.push_back(zactor_new(window_shard, shard));
+            }
+            cursors.resize(nshards);
+        }
 
         set_osock(ptmp::internals::endpoint(config["output"].dump()));
         set_isock(ptmp::internals::endpoint(config["input"].dump()));
 
+        // local output sends TPSets, so skip encoding slices
+        buffer.set_wire(!local_output());
+        for (auto shard : shards) {
+            shard->buffer.set_wire(!local_output());
+        }
     } // ctor
 
+    // Hold a TP in the buffer or stage it for its shard.
+    void hold(const ptmp::data::TrigPrim& tp, uint32_t detid) {
+        if (shards.empty()) {
+            buffer.add(tp, detid);
+            return;
+        }
+        const tp_pod_t pod{tp.tstart(), tp.channel(), tp.tspan(),
+                tp.adcsum(), tp.adcpeak(), tp.flags(), detid};
+        shards[(pod.channel / shard_chans) % shards.size()]->staged.push_back(pod);
+        ++held_tps;
+        recent = std::max(recent, pod.tstart);
+        held_tmin = std::min(held_tmin, pod.tstart);
+    }
+
+    bool holding() const {
+        return shards.empty() ? !buffer.empty()
+            : held_tmin != std::numeric_limits<ptmp::data::data_time_t>::max();
+    }
+    ptmp::data::data_time_t held_min() const {
+        return shards.empty() ? buffer.tmin() : held_tmin;
+    }
+
+    // Move the window to the earliest one holding t but never back.
+    void advance(ptmp::data::data_time_t t) {
+        const auto wind = window.wind;
+        window.set_bytime(t);
+        window.wind = std::max(window.wind, wind);
+    }
+
+    // The lowest watermark over all known inputs.
+    ptmp::data::data_time_t input_watermark() const {
+        if (in_watermarks.empty()) {
+            return 0;
+        }
+        ptmp::data::data_time_t wm = std::numeric_limits<ptmp::data::data_time_t>::max();
+        for (const auto& one : in_watermarks) {
+            wm = std::min(wm, one.second);
+        }
+        return wm;
+    }
+
     int add_input(ptmp::data::TPSet& tpset) {
-        
+        in_watermarks.emplace(tpset.detid(), 0);
 
         // If we don't know when we are, buffer takes precedence and sets window.
         if (window.wind == 0) { 
             for (const auto& tp : tpset.tps()) {
-                buffer.add(tp);
+                hold(tp, tpset.detid());
             }
-            window.set_bytime(buffer.top().tstart());
+            window.set_bytime(held_min());
+            return 0;
         }
-        else {
-            for (const auto& tp : tpset.tps()) {
-                if (window.cmp(tp.tstart()) < 0) {
-                    if (verbose) {
-                        zsys_debug("window: channel %d tardy TP at -%ld + %ld data time ticks",
-                                   tp.channel(), window.tbegin()-tp.tstart(), tp.tspan());
-                    }
-                    ++count_tardy_tps;
-                    return 0;
+
+        // If all held TPs went out, the window jumps ahead to the new ones.
+        const bool was_holding = holding();
+        for (const auto& tp : tpset.tps()) {
+            if (window.cmp(tp.tstart()) < 0) {
+                if (verbose) {
+                    zsys_debug("window: channel %d tardy TP at -%ld + %ld data time ticks",
+                               tp.channel(), window.tbegin()-tp.tstart(), tp.tspan());
                 }
-                buffer.add(tp);
+                ++count_tardy_tps;
+                break;
             }
+            hold(tp, tpset.detid());
+        }
+        if (!was_holding and holding()) {
+            advance(held_min());
         }
         // finished processing fresh input.
         return 0;
     }
 
+    // For local output, fill the window summary of a TPSet.
+    void start_tpset(ptmp::data::TPSet& tpset,
+                     const ptmp::internals::msg_header_t& hdr,
+                     const ptmp::internals::tpset_extra_t& extra) {
+        tpset.set_tstart(window.tbegin());
+        tpset.set_tspan(tspan);
+        tpset.set_chanbeg(extra.chanbeg);
+        tpset.set_chanend(extra.chanend);
+        tpset.set_totaladc(extra.totaladc);
+        tpset.mutable_tps()->Reserve(hdr.ntps);
+    }
+
+    // For local output, append a held TP to a TPSet.
+    void add_tp(ptmp::data::TPSet& tpset, const tp_pod_t& pod) {
+        ptmp::data::TrigPrim* tp = tpset.add_tps();
+        tp->set_channel(pod.channel);
+        tp->set_tstart(pod.tstart);
+        tp->set_tspan(pod.tspan);
+        tp->set_adcsum(pod.adcsum);
+        tp->set_adcpeak(pod.adcpeak);
+        if (pod.flags) {
+            tp->set_flags(pod.flags);
+        }
+    }
+
     int send_output() {
-        // Drain if we have buffered past the current window by tbuf amount
-        while (buffer.covers(window.tbegin()) >= tbuf+tspan) {
+        const ptmp::data::data_time_t nslices = window.nslices();
+        const ptmp::data::data_time_t wm = input_watermark();
+
+        // Drain if we have buffered past the current window by tbuf
+        // amount or if the inputs promise nothing more for it.
+        while (!buffer.empty() and (buffer.covers(window.tbegin()) >= tbuf+tspan
+                                    or window.tbegin() + tspan <= wm)) {
+
+            // Gather the slices of the window, each encoded just once
+            // no matter how many windows overlap it.
+            ptmp::internals::msg_header_t hdr{};
+            ptmp::internals::tpset_extra_t extra;
+            out_slices.clear();
+            for (auto islice = window.wind; islice < window.wind+nslices; ++islice) {
+                const tp_slice_t* slice = buffer.encoded(islice);
+                if (!slice) {
+                    continue;
+                }
+                if (out_slices.empty()) {
+                    extra = slice->extra;
+                }
+                else {
+                    extra.chanbeg = std::min(extra.chanbeg, slice->extra.chanbeg);
+                    extra.chanend = std::max(extra.chanend, slice->extra.chanend);
+                    extra.totaladc += slice->extra.totaladc;
+                }
+                hdr.ntps += slice->tps.size();
+                out_slices.push_back(&slice->wire);
+            }
+            if (out_slices.empty()) {
+                zsys_error("window: logic error, empty window, should not happen");
+                assert(!out_slices.empty()); // logic error, should not happen
+            }
+            hdr.tstart = window.tbegin();
+            hdr.tspan = tspan;
+
+            int rc = 0;
+            if (local_output()) {
+                ptmp::data::TPSet tpset;
+                start_tpset(tpset, hdr, extra);
+                for (auto islice = window.wind; islice < window.wind+nslices; ++islice) {
+                    const tp_slice_t* slice = buffer.find(islice);
+                    if (!slice) {
+                        continue;
+                    }
+                    for (const auto& tp : slice->tps) {
+                        add_tp(tpset, tp);
+                    }
+                }
+                rc = this->send(tpset);
+            }
+            else {
+                rc = this->send(hdr, extra, out_slices);
+            }
+            if (rc != 0) {
+                return rc;
+            }
 
-            ptmp::data::TPSet otpset;
-            otpset.set_tstart(window.tbegin());
-            otpset.set_tspan(tspan);
-            otpset.set_totaladc(0);
+            // The first slice is no longer needed.  Move to the next
+            // window, skipping any that would be empty.
+            buffer.retire(window.wind);
+            ++window.wind;
+            if (buffer.empty()) {
+                break;          // only a watermark can get us here
+            }
+            advance(buffer.tmin());
+        } // go around to see if enough left in the buffer.
+
+        return 0;
+    }
+
+    // Hand each shard its staged TPs to add while we go on.
+    void hand_off() {
+        for (size_t ind=0; ind<shards.size(); ++ind) {
+            auto& staged = shards[ind]->staged;
+            if (staged.empty()) {
+                continue;
+            }
+            auto* batch = new std::vector<tp_pod_t>;
+            batch->swap(staged);
+            staged.reserve(batch->size());
+            zsock_send(shard_actors[ind], "sp8", "add", batch, (uint64_t)0);
+        }
+    }
+
+    // Have all shards add what was handed off and encode slices
+    // before until, in parallel, and wait for them.  The buffers are
+    // then ours until the next hand_off().
+    void sync_shards(ptmp::data::data_time_t until) {
+        hand_off();
+        for (auto actor : shard_actors) {
+            zsock_send(actor, "sp8", "encode", nullptr, (uint64_t)until);
+        }
+        for (auto actor : shard_actors) {
+            zsock_wait(actor);
+        }
+    }
+
+    // The sharded version of send_output().  Until a window is due
+    // the shards just take the staged TPs.  Then they encode the
+    // slices of all windows which may be sent, in parallel, and the
+    // per-shard parts of each window are merged in tstart order.
+    int send_sharded() {
+        const ptmp::data::data_time_t nslices = window.nslices();
+        const ptmp::data::data_time_t tlast = window.tbegin() + tbuf + tspan;
+        const ptmp::data::data_time_t wm = input_watermark();
+        // last window which may be sent, by amount buffered or by
+        // input watermark
+        ptmp::data::data_time_t wlast = 0;
+        if (recent >= tlast) {
+            wlast = window.wind + (recent - tlast) / tstride;
+        }
+        if (wm >= window.tbegin() + tspan) {
+            wlast = std::max(wlast, window.wind + (wm - window.tbegin() - tspan) / tstride);
+        }
+        if (!holding() or wlast < window.wind) {
+            hand_off();
+            return 0;
+        }
+        sync_shards(wlast + nslices);
+
+        ptmp::data::data_time_t wsent = 0;
+        while (window.wind <= wlast) {
+            ptmp::internals::msg_header_t hdr{};
+            ptmp::internals::tpset_extra_t extra;
             bool first = true;
+            size_t nbytes = 0;
+            for (size_t ishard=0; ishard<shards.size(); ++ishard) {
+                shard_cursor_t& cur = cursors[ishard];
+                cur = shard_cursor_t{};
+                for (auto islice = window.wind; islice < window.wind+nslices; ++islice) {
+                    const tp_slice_t* slice = shards[ishard]->buffer.find(islice);
+                    if (!slice) {
+                        continue;
+                    }
+                    if (first) {
+                        extra = slice->extra;
+                        first = false;
+                    }
+                    else {
+                        extra.chanbeg = std::min(extra.chanbeg, slice->extra.chanbeg);
+                        extra.chanend = std::max(extra.chanend, slice->extra.chanend);
+                        extra.totaladc += slice->extra.totaladc;
+                    }
+                    hdr.ntps += slice->tps.size();
+                    nbytes += slice->wire.size();
+                    cur.slices.push_back(slice);
+                }
+            }
+            if (!hdr.ntps) {
+                zsys_error("window: logic error, empty window, should not happen");
+                assert(hdr.ntps); // logic error, should not happen
+            }
 
-            // fill outgoing TPSet
-            while (!buffer.empty()) {
-                const ptmp::data::TrigPrim& tp = buffer.top();
-                if (!window.in(tp.tstart())) {
+            // merge shards by tstart
+            const bool local = local_output();
+            ptmp::data::TPSet tpset;
+            if (local) {
+                start_tpset(tpset, hdr, extra);
+            }
+            out_wire.clear();
+            out_wire.reserve(nbytes);
+            while (true) {
+                shard_cursor_t* best = nullptr;
+                for (auto& cur : cursors) {
+                    if (cur.done()) { continue; }
+                    if (!best or cur.tp().tstart < best->tp().tstart) {
+                        best = &cur;
+                    }
+                }
+                if (!best) {
                     break;
                 }
-                ptmp::data::TrigPrim* newtp = otpset.add_tps();
-                *newtp = tp;
-                buffer.pop();
-                otpset.set_totaladc(otpset.totaladc() + newtp->adcsum());
-                const auto chan = newtp->channel();
-                if (first or otpset.chanbeg() > chan) {
-                    otpset.set_chanbeg(chan);
+                if (local) {
+                    add_tp(tpset, best->tp());
                 }
-                if (first or otpset.chanend() < chan) {
-                    otpset.set_chanend(chan);
+                else {
+                    best->copy(out_wire);
                 }
-                first = false;
+                best->next();
             }
-            if (buffer.empty() or otpset.tps_size() == 0) {
-                zsys_error("window: logic error, buffer or tpset empty, should not happen");
-                assert(otpset.tps_size() > 0); // logic error, should not happen
+            int rc = 0;
+            if (local) {
+                rc = this->send(tpset);
+            }
+            else {
+                hdr.tstart = window.tbegin();
+                hdr.tspan = tspan;
+                out_slices.assign(1, &out_wire);
+                rc = this->send(hdr, extra, out_slices);
             }
-            window.set_bytime(buffer.top().tstart());
-            
-            int rc = this->send(otpset);
             if (rc != 0) {
                 return rc;
             }
-        } // go around to see if enough left in the buffer.
+            wsent = window.wind;
+
+            // Move to the next window, skipping any that would be empty.
+            held_tmin = std::numeric_limits<ptmp::data::data_time_t>::max();
+            for (auto shard : shards) {
+                ptmp::data::data_time_t t;
+                if (shard->buffer.tmin_from(wsent+1, t)) {
+                    held_tmin = std::min(held_tmin, t);
+                }
+            }
+            ++window.wind;
+            if (!holding()) {
+                break;          // only a watermark can get us here
+            }
+            advance(held_tmin);
+        }
+
+        // Slices of sent windows are dropped while the shards wait.
+        held_tps = 0;
+        for (auto shard : shards) {
+            shard->buffer.retire(wsent);
+            held_tps += shard->buffer.size();
+        }
+        return 0;
+    }
+
+    // Shed TPs if more than the budget are held.  Enough are shed
+    // to get to 90% of the budget so shedding does not happen on
+    // every input.
+    void shed() {
+        if (!budget_tps) {
+            return;
+        }
+        std::vector<tp_window_buffer_t*> bufs;
+        if (shards.empty()) {
+            bufs.push_back(&buffer);
+        }
+        else {
+            if (held_tps <= budget_tps) {
+                return;         // without waiting on the shards
+            }
+            sync_shards(0);
+        }
+        for (auto shard : shards) {
+            bufs.push_back(&shard->buffer);
+        }
+        auto count = [&]() {
+            size_t n = 0;
+            for (auto buf : bufs) { n += buf->size(); }
+            return n;
+        };
+        const size_t before = count();
+        if (before <= budget_tps) {
+            return;
+        }
+        const size_t target = budget_tps - budget_tps/10;
+        size_t held = before;
+
+        switch (shed_policy) {
+        case shed_policy_t::oldest:
+            while (held > target) {
+                auto tmin = std::numeric_limits<ptmp::data::data_time_t>::max();
+                for (auto buf : bufs) {
+                    if (!buf->empty()) { tmin = std::min(tmin, buf->tmin()); }
+                }
+                const auto islice = window.index(tmin);
+                for (auto buf : bufs) {
+                    buf->retire(islice);
+                }
+                held = count();
+            }
+            break;
+        case shed_policy_t::lowest_adc: {
+            // Exactly held - target TPs go, those of lowest ADC sum
+            // and, of those tied at the threshold, the earliest.
+            const size_t ndrop = held - target;
+            std::vector<uint32_t> adcs;
+            adcs.reserve(held);
+            for (auto buf : bufs) {
+                buf->for_each_tp([&](const tp_pod_t& tp) { adcs.push_back(tp.adcsum); });
+            }
+            auto nth = adcs.begin() + (ndrop - 1);
+            std::nth_element(adcs.begin(), nth, adcs.end());
+            const uint32_t thresh = *nth;
+            const size_t nbelow = std::count_if(adcs.begin(), adcs.end(),
+                                                [&](uint32_t adc) { return adc < thresh; });
+
+            std::vector<ptmp::data::data_time_t> tied;
+            for (auto buf : bufs) {
+                buf->for_each_tp([&](const tp_pod_t& tp) {
+                        if (tp.adcsum == thresh) { tied.push_back(tp.tstart); } });
+            }
+            const size_t ntied = ndrop - nbelow;
+            auto tnth = tied.begin() + (ntied - 1);
+            std::nth_element(tied.begin(), tnth, tied.end());
+            const ptmp::data::data_time_t tcut = *tnth;
+            // those tied on both ADC sum and tstart go in buffer order
+            size_t nat = ntied - std::count_if(tied.begin(), tied.end(),
+                                               [&](ptmp::data::data_time_t t) { return t < tcut; });
+            for (auto buf : bufs) {
+                buf->drop_if([&](const tp_pod_t& tp) {
+                        if (tp.adcsum != thresh) { return tp.adcsum < thresh; }
+                        if (tp.tstart != tcut) { return tp.tstart < tcut; }
+                        if (!nat) { return false; }
+                        --nat;
+                        return true;
+                    });
+            }
+            shed_adc_max = std::max(shed_adc_max, thresh);
+            held = count();
+            break;
+        }
+        case shed_policy_t::detid:
+            while (held > target) {
+                std::unordered_map<uint32_t, size_t> per_detid;
+                for (auto buf : bufs) {
+                    buf->for_each_tp([&](const tp_pod_t& tp) { ++per_detid[tp.detid]; });
+                }
+                auto worst = std::max_element(per_detid.begin(), per_detid.end(),
+                                              [](const std::pair<const uint32_t, size_t>& a,
+                                                 const std::pair<const uint32_t, size_t>& b) {
+                                                  return a.second < b.second; });
+                const uint32_t detid = worst->first;
+                for (auto buf : bufs) {
+                    buf->drop_if([&](const tp_pod_t& tp) { return tp.detid == detid; });
+                }
+                shed_detids[detid] += worst->second;
+                held = count();
+            }
+            break;
+        }
+        ++count_shed_events;
+        count_shed_tps += before - held;
+        if (verbose) {
+            zsys_debug("window: over budget, shed %ld TPs by %s",
+                       before - held, shed_name.c_str());
+        }
 
+        // The window moves to what remains.
+        if (!shards.empty()) {
+            held_tps = held;
+            held_tmin = std::numeric_limits<ptmp::data::data_time_t>::max();
+            for (auto buf : bufs) {
+                if (!buf->empty()) { held_tmin = std::min(held_tmin, buf->tmin()); }
+            }
+        }
+        if (holding()) {
+            advance(held_min());
+        }
+    }
+
+    // Send what windows may be sent and keep within budget.
+    int drain() {
+        int rc = shards.empty() ? this->send_output() : this->send_sharded();
+        if (rc != 0) {
+            return rc;
+        }
+        shed();
         return 0;
     }
 
@@ -223,18 +1018,65 @@ public:
         if (rc != 0) {
             return rc;
         }
+        return this->drain();
+    }
 
-        return this->send_output();
+    // Buffer everything received in one wakeup before draining output.
+    virtual int add_batch(std::vector<ptmp::data::TPSet*>& tpsets) {
+        for (auto tpset : tpsets) {
+            int rc = this->add_input(*tpset);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        return this->drain();
+    }
+
+    virtual int add_watermark(ptmp::data::TPSet& wm) {
+        auto& one = in_watermarks[wm.detid()];
+        one = std::max(one, (ptmp::data::data_time_t)wm.tstart());
+        return this->drain();
+    }
+
+    // Windows still to come start no earlier than the current one.
+    virtual bool output_watermark(ptmp::data::data_time_t& tstart) {
+        if (window.wind == 0) {
+            return false;
+        }
+        tstart = window.tbegin();
+        return true;
     }
 
     virtual void metrics(json& jmet) {
         jmet["rates"]["tardytps"] = count_tardy_tps * stats.iss.data.hz;
         count_tardy_tps = 0;
+        if (budget_tps) {
+            auto& js = jmet["shed"];
+            js["policy"] = shed_name;
+            js["tps"] = count_shed_tps;
+            js["events"] = count_shed_events;
+            if (shed_policy == shed_policy_t::lowest_adc) {
+                js["adc_max"] = shed_adc_max;
+            }
+            for (const auto& one : shed_detids) {
+                js["detids"][std::to_string(one.first)] = one.second;
+            }
+            count_shed_tps = count_shed_events = 0;
+            shed_adc_max = 0;
+            shed_detids.clear();
+        }
     }
 
     virtual ~WindowApp () {
+        for (auto& actor : shard_actors) {
+            zactor_destroy(&actor);
+        }
+        for (auto shard : shards) {
+            delete shard;
+        }
     }
 };
+PTMP_REACTOR_APP(WindowApp, window)
 
 
 // The actor function (reactor pattern)
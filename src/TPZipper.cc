@@ -19,6 +19,14 @@
    may be violated if the tardy policy is "send" instead of the
    default "drop".
 
+   Optionally the sync time may be learned per source.  The arrival
+   delay of each message, its real time of receipt less its data time,
+   is tracked per source with streaming quantile estimates.  A message
+   from a source is then held until the given percentile of the
+   arrival delays of all sources has passed, assuming the message
+   arrived with the median delay of its source.  The configured sync
+   time remains an upper bound.
+
  */
 
 
@@ -26,10 +34,15 @@
 #include "ptmp/internals.h"
 #include "ptmp/factory.h"
 #include "ptmp/actors.h"
+#include "ptmp/metrics.h"
 
 #include <json.hpp>
 #include <vector>
+#include <deque>
+#include <queue>
+#include <algorithm>
 #include <unordered_map>
+#include <memory>
 
 PTMP_AGENT(ptmp::TPZipper, zipper)
 
@@ -37,38 +50,6 @@ PTMP_AGENT(ptmp::TPZipper, zipper)
 using json = nlohmann::json;
 
 
-// little helper to send out messages on a socket while not getting
-// hung and insensitive to shutdown commands from the actor pipe if
-// the output socket would otherwise want to block.
-struct sender_t {
-    zsock_t* output;
-    zsock_t* pipe;
-    sender_t(zsock_t* output, zsock_t* pipe) : output(output), pipe(pipe) {}
-
-    // Send message to all outputs, destroying it.  Return 0 if okay,
-    // -1 if we get shutdown while otherwise hung on a HWM'ed socket.
-    int operator()(zmsg_t** msg) {
-        while (!(zsock_events(output) & ZMQ_POLLOUT)) {
-            // if we would block, sleep for a bit and check if we
-            // have shutdown command so we avoid hang.
-            zclock_sleep(1); // ms
-            if (zsock_events(pipe) & ZMQ_POLLIN) {
-                zmsg_destroy(msg);
-                return -1;
-            }
-            continue;
-        }
-        // safe to send to this socket without wait.
-        zmsg_send(msg, output);
-        return 0;               // okay
-    }
-
-    void destroy() {
-        zsock_destroy(&output);
-    }
-    ~sender_t() { destroy(); }
-};
-
 // and minimizing buffer time.
 struct meta_msg_t {
     // the real time at which this message is considered overdue based
@@ -80,69 +61,296 @@ struct meta_msg_t {
     int detid;
     // The message
     zmsg_t* msg;
+    // Arrival sequence number, used to identify a source queue head.
+    uint64_t seq;
+    // Index of the per-endpoint input socket, -1 if not known.
+    int input;
+    // Size of the message content, counted against any budget.
+    size_t nbytes;
+};
+
+// Arrival delay statistics and the learned sync time of one source.
+struct source_timing_t {
+    ptmp::internals::StreamingQuantile tail, median;
+    ptmp::data::real_time_t sync_us;
+
+    source_timing_t(double percentile, ptmp::data::real_time_t sync_us)
+        : tail(percentile), median(0.5), sync_us(sync_us) {}
+};
+
+// An entry in one of the heaps over the heads of the source queues.
+// The key is either a tstart or a toverdue.  An entry is stale if its
+// seq no longer matches the head of the source queue.
+struct zq_head_t {
+    int64_t key;
+    uint64_t seq;
+    int detid;
 };
 
-// Used to order a vector of meta_msg_t's in increasing tstart.
-struct zq_lesser_t {
-    bool operator()(const meta_msg_t& a, const meta_msg_t& b) {
-        return a.tstart < b.tstart;
+// Used to make a min-heap of zq_head_t's.  Ties go to earlier arrival.
+struct zq_greater_t {
+    bool operator()(const zq_head_t& a, const zq_head_t& b) const {
+        if (a.key == b.key) { return a.seq > b.seq; }
+        return a.key > b.key;
     }
 };
+typedef std::priority_queue<zq_head_t, std::vector<zq_head_t>, zq_greater_t> zq_heap_t;
 
 // A helper which receives and collects messages and can process this
 // collection into ordered vectors of tardy, punctual and leftovers.
+//
+// Each source is assumed to provide messages in tstart order so
+// messages are held in one FIFO per source (detid) and a k-way merge
+// is done over the heads.  One min-heap orders the heads by tstart
+// and another by toverdue so that insert and pop are O(log k) in the
+// number of sources and the next deadline is found at the top of the
+// second heap.  Heap entries are invalidated lazily.
 struct zipper_queue_t {
     int sync_ms;
 
-    // keep track of how many messages are currently held from each
-    // source.  
-    std::unordered_map<int, int> counts;
+    // Per-source FIFOs of held messages.
+    std::unordered_map<int, std::deque<meta_msg_t> > sources;
+
+    // Number of sources with at least one message held.
+    int nnonempty{0};
+
+    // Total content bytes of all held messages.
+    size_t held_bytes{0};
+
+    // Bytes a held message counts for.  The payload frame of a local
+    // message is the TPSet object, whose size does not grow with its
+    // TPs, so count the TPSet as if it were serialized.
+    static size_t held_size(zmsg_t* msg) {
+        const size_t nbytes = zmsg_content_size(msg);
+        const ptmp::data::TPSet* tps = ptmp::internals::local_tpset(msg);
+        if (tps) {
+            return nbytes - sizeof(ptmp::data::TPSet) + tps->ByteSizeLong();
+        }
+        return nbytes;
+    }
 
     // Keep track of last TPSet.count() seen to detect dropped messages
     std::unordered_map<int, int> last_in_count;
 
+    // Highest watermark tstart seen from each source.
+    std::unordered_map<int, ptmp::data::data_time_t> watermarks;
+
+    // Highest watermark tstart passed on for each source and whether
+    // any may now be due.
+    std::unordered_map<int, ptmp::data::data_time_t> forwarded;
+    bool forward_due{false};
+
+    // Adaptive sync time, used if percentile is nonzero.  Delays are
+    // relative to the first one seen to keep them small.
+    double sync_percentile{0};
+    int tickperus{50};
+    uint64_t sync_warmup{100};
+    std::unordered_map<int, source_timing_t> timing;
+    double delay0{0};
+    uint64_t ndelays{0};
+
     // Expected number of sources
     int nsources;
 
-    // A home made priority queue of messages.
-    std::vector<meta_msg_t> messages;
-    bool messages_dirty{true};
+    // Heads of non-empty source FIFOs by tstart and by toverdue.
+    zq_heap_t by_tstart, by_toverdue;
+
+    uint64_t next_seq{0};
 
     // keep track of highest tstart time of returned punctual
     // messages.
     ptmp::data::data_time_t last_tstart{0};
 
-    // A temporary, reuse it for some optimization.
-    ptmp::data::TPSet tpset;
-
     zipper_queue_t(int ninputs, int sync_ms) : nsources(ninputs), sync_ms(sync_ms) {}
 
     ~zipper_queue_t() {
         // clean up any leftovers.
-        for (auto& mm : messages) {
-            zmsg_destroy(&mm.msg); 
+        for (auto& src : sources) {
+            for (auto& mm : src.second) {
+                zmsg_destroy(&mm.msg);
+            }
+        }
+    }
+
+    // Return the sync time to apply to a message from detid given
+    // its times, updating what is learned.
+    ptmp::data::real_time_t sync_for(int detid, ptmp::data::real_time_t trecv,
+                                     ptmp::data::data_time_t tstart) {
+        const ptmp::data::real_time_t sync_us = 1000*(ptmp::data::real_time_t)sync_ms;
+        if (sync_percentile <= 0) {
+            return sync_us;
+        }
+        double delay = trecv - (double)tstart/tickperus;
+        if (ndelays == 0) {
+            delay0 = delay;
+        }
+        delay -= delay0;
+        auto it = timing.find(detid);
+        if (it == timing.end()) {
+            it = timing.emplace(detid, source_timing_t(sync_percentile, sync_us)).first;
+        }
+        it->second.tail.add(delay);
+        it->second.median.add(delay);
+        if (++ndelays % 64 == 0) {
+            learn();
+        }
+        return it->second.sync_us;
+    }
+
+    // Set each source's sync time from the latest delay estimates.
+    // The full sync time is kept until all sources are well sampled.
+    void learn() {
+        const ptmp::data::real_time_t sync_us = 1000*(ptmp::data::real_time_t)sync_ms;
+        bool ready = (int)timing.size() >= nsources;
+        double horizon = 0;
+        for (const auto& one : timing) {
+            ready = ready and one.second.tail.count() >= sync_warmup;
+            horizon = std::max(horizon, one.second.tail.value());
+        }
+        for (auto& one : timing) {
+            if (!ready) {
+                one.second.sync_us = sync_us;
+                continue;
+            }
+            const double want = horizon - one.second.median.value();
+            one.second.sync_us = std::min(sync_us, (ptmp::data::real_time_t)std::max(0.0, want));
+        }
+    }
+
+    // Register the current head of the source's FIFO with the heaps.
+    void push_head(const std::deque<meta_msg_t>& fifo) {
+        const meta_msg_t& head = fifo.front();
+        by_tstart.push(zq_head_t{(int64_t)head.tstart, head.seq, head.detid});
+        by_toverdue.push(zq_head_t{head.toverdue, head.seq, head.detid});
+    }
+
+    // Drop stale entries from the top of a heap.  Return false if
+    // the heap is then empty.
+    bool clean(zq_heap_t& heap) {
+        while (!heap.empty()) {
+            const zq_head_t& top = heap.top();
+            const auto& fifo = sources[top.detid];
+            if (!fifo.empty() and fifo.front().seq == top.seq) {
+                return true;
+            }
+            heap.pop();
+        }
+        return false;
+    }
+
+    // Remove and return the message with the smallest tstart.  The
+    // by_tstart heap must be clean and non-empty.
+    meta_msg_t pop_min() {
+        const int detid = by_tstart.top().detid;
+        by_tstart.pop();
+        auto& fifo = sources[detid];
+        meta_msg_t mm = fifo.front();
+        fifo.pop_front();
+        held_bytes -= mm.nbytes;
+        if (fifo.empty()) {
+            --nnonempty;
+            forward_due = forward_due or watermarks.count(detid);
+        }
+        else {
+            push_head(fifo);
+        }
+        return mm;
+    }
+
+    // Remove and return all messages held from the source with the
+    // most bytes.  Its heap entries go stale.
+    std::deque<meta_msg_t> pop_source() {
+        int detid = 0;
+        size_t most = 0;
+        for (const auto& src : sources) {
+            size_t nbytes = 0;
+            for (const auto& mm : src.second) {
+                nbytes += mm.nbytes;
+            }
+            if (nbytes > most) {
+                most = nbytes;
+                detid = src.first;
+            }
+        }
+        std::deque<meta_msg_t> ret;
+        if (!most) {
+            return ret;
+        }
+        ret.swap(sources[detid]);
+        held_bytes -= most;
+        --nnonempty;
+        forward_due = forward_due or watermarks.count(detid);
+        return ret;
+    }
+
+    // Remove messages until held bytes are below the low mark and
+    // return them.  The oldest goes first or else whole sources.
+    void shed(size_t low_bytes, bool by_source, std::vector<meta_msg_t>& shed) {
+        while (held_bytes > low_bytes and nnonempty) {
+            if (!by_source) {
+                if (!clean(by_tstart)) {
+                    break;
+                }
+                shed.push_back(pop_min());
+                continue;
+            }
+            auto fifo = pop_source();
+            if (fifo.empty()) {
+                break;
+            }
+            shed.insert(shed.end(), fifo.begin(), fifo.end());
+        }
+    }
+
+    // Collect source watermarks which are newer than what was passed
+    // on and which no held message from the source precedes.
+    void due_watermarks(std::vector<std::pair<int, ptmp::data::data_time_t> >& due) {
+        if (!forward_due) {
+            return;
+        }
+        forward_due = false;
+        for (const auto& wm : watermarks) {
+            const auto sit = sources.find(wm.first);
+            if (sit != sources.end() and !sit->second.empty()) {
+                continue;
+            }
+            auto& fwd = forwarded[wm.first];
+            if (wm.second > fwd) {
+                fwd = wm.second;
+                due.emplace_back(wm.first, wm.second);
+            }
         }
     }
 
     // Receive a message from the socket and enqueue it.  We want to
-    // hold onto the msg for sending out so we have to do the
-    // unpacking ourselves instead of relying on stuff in ptmp::internal
-    //void recv(zsock_t* sock) {
-    void recv(zmsg_t* msg) {    
+    // hold onto the msg for sending out so we only peek at its
+    // header.  This is cheap for v2 messages, v0 requires a parse.
+    // Return true if the message is held, and if so its tstart.
+    bool recv(zmsg_t* msg, int input = -1, ptmp::data::data_time_t* ptstart = nullptr) {
         const ptmp::data::real_time_t trecv = ptmp::data::now();
-        const ptmp::data::real_time_t tod = trecv + 1000*sync_ms;
-
-        zframe_t* fid = zmsg_first(msg);        // msg id
-        int version = *(int*)zframe_data(fid);
 
-        assert (version == 0);
-        zframe_t* pay = zmsg_next(msg);
-        tpset.ParseFromArray(zframe_data(pay), zframe_size(pay));
-        const ptmp::data::data_time_t tstart = tpset.tstart();
-        const int detid = tpset.detid();
+        ptmp::internals::msg_header_t hdr;
+        if (!ptmp::internals::msg_header(msg, hdr)) {
+            zsys_warning("zipper: dropping malformed message");
+            zmsg_destroy(&msg);
+            return false;
+        }
+        const ptmp::data::data_time_t tstart = hdr.tstart;
+        const int detid = hdr.detid;
+
+        // A watermark is consumed here and only serves to let held
+        // messages from other sources go out before their deadline.
+        if (ptmp::internals::is_watermark(hdr)) {
+            auto& wm = watermarks[detid];
+            wm = std::max(wm, tstart);
+            forward_due = true;
+            sources[detid];     // the source is now known
+            zmsg_destroy(&msg);
+            return false;
+        }
 
         {
-            const auto this_count = tpset.count();
+            const auto this_count = hdr.count;
             auto& last_count = last_in_count[detid];
             if (last_count == 0) {
                 last_count = this_count;
@@ -156,102 +364,188 @@ struct zipper_queue_t {
             }
         }
 
-        meta_msg_t mm = {trecv+1000*sync_ms, tstart, detid, msg};
-        messages.push_back(mm);
-        messages_dirty = true;
-        ++counts[detid];
+        if (ptstart) {
+            *ptstart = tstart;
+        }
+        meta_msg_t mm = {trecv+sync_for(detid, trecv, tstart), tstart, detid, msg, next_seq++, input,
+                         held_size(msg)};
+        held_bytes += mm.nbytes;
+        auto& fifo = sources[detid];
+        if (fifo.empty()) {
+            ++nnonempty;
+            fifo.push_back(mm);
+            push_head(fifo);
+            return true;
+        }
+        if (fifo.back().tstart <= tstart) { // the expected case
+            // a shrinking sync time must not reorder deadlines
+            mm.toverdue = std::max(mm.toverdue, fifo.back().toverdue);
+            fifo.push_back(mm);
+            return true;
+        }
+        // The source violates its ordering contract.  Keep the FIFO
+        // ordered and refresh the heads if this one lands in front.
+        // The message inherits the earlier deadline of its successor
+        // so deadlines stay non-decreasing along the FIFO.
+        auto it = std::upper_bound(fifo.begin(), fifo.end(), mm,
+                                   [](const meta_msg_t& a, const meta_msg_t& b) {
+                                       return a.tstart < b.tstart; });
+        mm.toverdue = it->toverdue;
+        const bool new_head = it == fifo.begin();
+        fifo.insert(it, mm);
+        if (new_head) {
+            push_head(fifo);
+        }
+        return true;
     }
 
-    // Return true if all other sources have non-zero messages queued.
-    bool have_all_other(size_t given) {
-        int nother = 1; // counting the given
-        for (const auto& cc : counts) {
-            if (cc.first == given) {
+    // Return true if no source can later provide a message with
+    // tstart earlier than the given one.  Each source must either have
+    // messages queued or have sent a watermark at or beyond tstart.
+    bool have_all(ptmp::data::data_time_t tstart) const {
+        if ((int)sources.size() != nsources) {
+            return false;
+        }
+        if (nnonempty == nsources) {
+            return true;
+        }
+        for (const auto& src : sources) {
+            if (!src.second.empty()) {
                 continue;
             }
-            if (cc.second == 0) {
+            auto wit = watermarks.find(src.first);
+            if (wit == watermarks.end() or wit->second < tstart) {
                 return false;
             }
-            ++nother;
         }
-        return nother == nsources;
+        return true;
     }
 
     // Process pending messages, fill punctual and tardy and keep any
     // leftovers.  Return suggested poll timeout.
     int process(std::vector<meta_msg_t>& punctual, std::vector<meta_msg_t>& tardy) {
-        if (messages.empty()) {
+        if (!nnonempty) {
             return -1;
         }
         ptmp::data::real_time_t now = ptmp::data::now();
-        // Order by increasing tstart.
-        if (messages_dirty) {
-            std::sort(messages.begin(), messages.end(), zq_lesser_t());
-            messages_dirty = false;
-        }
-        const size_t nmessages = messages.size();
-
-        // partition the ordered vector of messages
 
         // 1. tardy: any which have tstart < last_tstart
-        std::vector<meta_msg_t>::iterator tardy_end = messages.begin(), mend = messages.end();
-        while (tardy_end != mend and tardy_end->tstart < last_tstart) {
-            --counts[tardy_end->detid];
-            ++tardy_end;
-        }
-
-        // 2. overdue: highest tstart which is overdue
-        std::vector<meta_msg_t>::iterator overdue_end = mend;
-        while (overdue_end > tardy_end) {
-            --overdue_end;
-            if ( overdue_end->toverdue < now) {
-                //zsys_debug("found overdue dt=%ld", now - overdue_end->toverdue);
-                ++overdue_end;
-                break;
-            }
+        while (clean(by_tstart) and (ptmp::data::data_time_t)by_tstart.top().key < last_tstart) {
+            tardy.push_back(pop_min());
         }
-        for (auto it=tardy_end; it!=overdue_end; ++it) {
-            --counts[it->detid];
-            last_tstart = it->tstart;
+
+        // 2. overdue: sweep out all messages up to and including any
+        // overdue message.
+        while (clean(by_toverdue) and by_toverdue.top().key < now) {
+            const meta_msg_t& head = sources[by_toverdue.top().detid].front();
+            const zq_head_t last{(int64_t)head.tstart, head.seq, head.detid};
+            while (clean(by_tstart) and !zq_greater_t()(by_tstart.top(), last)) {
+                punctual.push_back(pop_min());
+                last_tstart = punctual.back().tstart;
+            }
         }
-        //size_t noverdue = std::distance(tardy_end, overdue_end);
-        //zsys_debug("noverdue: %ld", noverdue);
 
         // 3. ready: from the remaining, we can send addtional output
-        // even if they are not yet overdue but only if there are no
-        // empty inputs so that we know for sure fresh future data
-        // won't have yet earlier tstarts.
-        std::vector<meta_msg_t>::iterator ready_end = overdue_end;
-        while (ready_end != mend) {
-            if (!have_all_other(ready_end->detid)) {
-                break;
-            }
-            --counts[ready_end->detid];
-            last_tstart = ready_end->tstart;
-            ++ready_end;
+        // even if they are not yet overdue but only if every empty
+        // input has a watermark past it so that we know for sure
+        // fresh future data won't have yet earlier tstarts.
+        while (clean(by_tstart) and have_all(by_tstart.top().key)) {
+            punctual.push_back(pop_min());
+            last_tstart = punctual.back().tstart;
+        }
+
+        if (!clean(by_toverdue)) {
+            return -1;
         }
-        // size_t nready = std::distance(overdue_end, ready_end);
-        // zsys_debug("nready: %ld", nready);
+        // Round up so the poll does not wake before the deadline and
+        // spin with zero timeouts.
+        const ptmp::data::real_time_t toverdue = by_toverdue.top().key;
+        return std::max(0, (int)((toverdue - now + 999)/1000));
+    }
 
+};
 
-        // pack up
-        tardy.insert(tardy.end(), messages.begin(), tardy_end);
-        punctual.insert(punctual.end(), tardy_end, ready_end);
+// Per-endpoint input sockets read with credit-based fairness.  Each
+// input may have at most "credits" messages held in the queue and is
+// not read while out of credit.  Of the inputs with pending messages
+// the one whose last received tstart is least advanced is read first.
+struct zipper_inputs_t {
+    struct input_t {
+        zsock_t* sock;
+        ptmp::data::data_time_t tlast{0};
+        uint64_t nrecv{0}, held{0}, nstalled{0};
+    };
+    std::vector<input_t> inputs;
+    uint64_t credits{1000};
+
+    std::vector<zmq_pollitem_t> items;
+    std::vector<int> item_input;
+
+    zipper_inputs_t(const std::vector<zsock_t*>& socks) {
+        for (auto sock : socks) {
+            inputs.push_back(input_t{sock});
+        }
+    }
+    ~zipper_inputs_t() {
+        for (auto& in : inputs) {
+            zsock_destroy(&in.sock);
+        }
+    }
 
-        // erase those to be returned, keep leftovers for next time 
-        messages.erase(messages.begin(), ready_end);
-        //zsys_debug("nleftover: %ld", messages.size());
-        if (messages.empty()) {
+    // Wait for the pipe or for an input with credit.  Return -1 if
+    // interrupted, 1 if the pipe is readable, else 0.
+    int poll(zsock_t* pipe, int wait_ms) {
+        items.clear();
+        item_input.clear();
+        items.push_back(zmq_pollitem_t{zsock_resolve(pipe), 0, ZMQ_POLLIN, 0});
+        for (size_t ind=0; ind<inputs.size(); ++ind) {
+            if (inputs[ind].held >= credits) {
+                ++inputs[ind].nstalled;
+                continue;
+            }
+            items.push_back(zmq_pollitem_t{zsock_resolve(inputs[ind].sock), 0, ZMQ_POLLIN, 0});
+            item_input.push_back(ind);
+        }
+        int rc = zmq_poll(items.data(), items.size(), wait_ms);
+        if (rc < 0) {
             return -1;
         }
-        ptmp::data::real_time_t toverdue=-1;
-        for (size_t ind=0; ind<messages.size(); ++ind) {
-            if (toverdue<0) toverdue = messages[ind].toverdue;
-            else toverdue = std::min(toverdue, messages[ind].toverdue);
+        return (items[0].revents & ZMQ_POLLIN) ? 1 : 0;
+    }
+
+    // Receive up to budget messages from the inputs found readable
+    // by poll(), least advanced first, into the queue.
+    void recv(zipper_queue_t& zq, int budget) {
+        std::vector<int> ready;
+        for (size_t ind=1; ind<items.size(); ++ind) {
+            if (items[ind].revents & ZMQ_POLLIN) {
+                ready.push_back(item_input[ind-1]);
+            }
+        }
+        while (budget-- > 0 and !ready.empty()) {
+            auto best = std::min_element(ready.begin(), ready.end(), [&](int a, int b) {
+                    return inputs[a].tlast < inputs[b].tlast; });
+            input_t& in = inputs[*best];
+            zmsg_t* msg = zmsg_recv(in.sock);
+            if (!msg) {
+                return;         // interrupted
+            }
+            ++in.nrecv;
+            if (zq.recv(msg, *best, &in.tlast)) {
+                ++in.held;
+            }
+            if (in.held >= credits or !(zsock_events(in.sock) & ZMQ_POLLIN)) {
+                ready.erase(best);
+            }
         }
-        return std::max(0, (int)((toverdue - now)/1000));
     }
 
+    // A held message from input has been output or dropped.
+    void release(int input) {
+        if (input >= 0) {
+            --inputs[input].held;
+        }
+    }
 };
 
 // The actor function
@@ -298,20 +592,125 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
         zsys_warning("zipper: user wants to send tardy messages, this destroys output ordering contract");
     }
 
-    sender_t sender(ptmp::internals::endpoint(config["output"].dump()), pipe);
+    // - sync percentile :: if nonzero, learn a sync time per source
+    //     so that a message waits for this fraction (eg 0.99) of the
+    //     arrival delays of all sources.  The sync time above is then
+    //     the most a message will wait.  Data time ticks are turned
+    //     into real time with tickperus.
+    double sync_percentile = 0;
+    if (config["sync_percentile"].is_number()) {
+        sync_percentile = config["sync_percentile"];
+    }
+    if (sync_percentile < 0 or sync_percentile >= 1) {
+        zsys_error("sync_percentile must be a fraction in [0,1)");
+        throw std::runtime_error("sync_percentile must be a fraction in [0,1)");
+    }
+    int tickperus = 50;
+    if (config["tickperus"].is_number()) {
+        tickperus = config["tickperus"];
+    }
 
-    auto input = ptmp::internals::endpoint(config["input"].dump());
+    // - forward watermarks :: if true, pass on each input watermark
+    //     once no held message from its source precedes it.  Used
+    //     between stages of a zipper tree.
+    bool forward_watermarks = false;
+    if (config["forward_watermarks"].is_boolean()) {
+        forward_watermarks = config["forward_watermarks"];
+    }
+
+    // - budget bytes :: if nonzero, the most message content bytes to
+    //     hold.  Past it, messages are shed down to 90% of the budget
+    //     by the shed policy, "oldest" (default) to drop the earliest
+    //     tstart first or "detid" to drop all held from the source
+    //     holding the most.  Messages are not unpacked here so there
+    //     is no "lowest_adc" policy as for the window.
+    size_t budget_bytes = 0;
+    if (config["budget_bytes"].is_number()) {
+        budget_bytes = config["budget_bytes"];
+    }
+    bool shed_by_source = false;
+    if (config["shed_policy"].is_string()) {
+        const std::string policy = config["shed_policy"];
+        if (policy == "detid") {
+            shed_by_source = true;
+        }
+        else if (policy != "oldest") {
+            zsys_error("zipper: unknown shed_policy: %s", policy.c_str());
+            throw std::runtime_error("zipper: unknown shed_policy: " + policy);
+        }
+    }
+
+    // - batch :: number of output messages to queue before sending.
+    //     They are always flushed at the end of each zipping pass.
+    int batch = 1;
+    if (config["batch"].is_number()) {
+        batch = config["batch"];
+    }
+
+    // - legacy_wait :: if true, sleep 100 us before each poll and
+    //     check a blocked output every 1 ms as the zipper once did.
+    //     Only meant as a baseline for check-tpzipper-latency.
+    bool legacy_wait = false;
+    if (config["legacy_wait"].is_boolean()) {
+        legacy_wait = config["legacy_wait"];
+    }
+
+    zsock_t* output = ptmp::internals::endpoint(config["output"].dump());
+    ptmp::internals::CarefulSender sender(output, pipe, batch);
+    if (legacy_wait) {
+        sender.set_spin(1);
+    }
+    // Local input messages are passed on as they are if the output
+    // is also local, else they are serialized when sent.
+    sender.set_local(ptmp::internals::local_output(config["output"].dump()));
+    if (config["output"]["socket"]["topic"].is_boolean()) {
+        sender.set_topic(config["output"]["socket"]["topic"]);
+    }
+
+    // - perendpoint :: if true, use one input socket per endpoint,
+    //     read them with credit-based fairness and count per input.
+    //     The credits are the most messages held per input.
+    zsock_t* input = nullptr;
+    std::unique_ptr<zipper_inputs_t> pins;
+    if (config["perendpoint"].is_boolean() and config["perendpoint"].get<bool>()) {
+        pins.reset(new zipper_inputs_t(ptmp::internals::perendpoint(config["input"].dump())));
+        if (config["credits"].is_number()) {
+            pins->credits = std::max(1, config["credits"].get<int>());
+        }
+    }
+    else {
+        input = ptmp::internals::endpoint(config["input"].dump());
+    }
     auto jinsock = config["input"]["socket"];
-    const int ninputs = jinsock["bind"].size() + jinsock["connect"].size();
+    int ninputs = jinsock["bind"].size() + jinsock["connect"].size();
+
+    // - sources :: the number of distinct detids expected on input.
+    //     Default is one per input endpoint.
+    if (config["sources"].is_number()) {
+        ninputs = config["sources"];
+    }
 
     zsock_signal(pipe, 0);      // signal ready
 
     // This will all fall down if sources produce unexpected detids!
     // Should maybe add configuration to explicitly give expected detids.
     zipper_queue_t zq(ninputs, sync_ms);
+    zq.sync_percentile = sync_percentile;
+    zq.tickperus = tickperus;
+
+    ptmp::metrics::Metric* met = nullptr;
+    int met_ms = 10000;
+    ptmp::data::real_time_t next_met = 0;
+    if (config["metrics"].is_object()) {
+        met = new ptmp::metrics::Metric(config["metrics"].dump());
+        if (config["metrics"]["period"].is_number()) {
+            met_ms = config["metrics"]["period"];
+        }
+        next_met = ptmp::data::now() + 1000*(ptmp::data::real_time_t)met_ms;
+    }
 
     struct counters_t {
-        uint64_t total{0}, tardy{0};
+        uint64_t total{0}, tardy{0}, shed{0}, shed_bytes{0};
     };
     std::unordered_map<int, counters_t> counters;
 
@@ -329,9 +728,23 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
 
         t1 = ptmp::data::now();
 
-        ptmp::internals::microsleep(100);
-        //if (wait_ms == 0) { wait_ms = 1; }
-        void *which = zpoller_wait(poller, wait_ms);
+        if (legacy_wait) {
+            ptmp::internals::microsleep(100);
+        }
+        void *which = nullptr;
+        if (pins) {
+            const int rc = pins->poll(pipe, wait_ms);
+            if (rc < 0) {
+                zsys_debug("zipper: poll interrupted");
+                goto cleanup;
+            }
+            if (rc > 0) {
+                which = pipe;
+            }
+        }
+        else {
+            which = zpoller_wait(poller, wait_ms);
+        }
         //zsys_debug("zipper: wait_ms=%d, which=%lx", wait_ms, which);
 
         t2 = ptmp::data::now();
@@ -352,6 +765,10 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
                 } while (zsock_events(input) & ZMQ_POLLIN);
             }
         }
+        else if (pins) {
+            // bound the reading so a flood can not starve output
+            pins->recv(zq, 1000);
+        }
         else {
             // if (zpoller_expired(poller)) {
             //     zsys_debug("zipper: poll expired");
@@ -370,6 +787,10 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
         // do the zipping
         std::vector<meta_msg_t> punctual, tardy;
         wait_ms = zq.process(punctual, tardy);
+        if (met) {
+            const int to_met = std::max(0, (int)((next_met - ptmp::data::now() + 999)/1000));
+            wait_ms = wait_ms < 0 ? to_met : std::min(wait_ms, to_met);
+        }
         if (verbose>1) {
             if (punctual.size() or tardy.size()) {
                 zsys_debug("punctual:%ld, tardy:%ld wait:%d ms",
@@ -377,12 +798,33 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
             }
         }
 
+        if (budget_bytes and zq.held_bytes > budget_bytes) {
+            std::vector<meta_msg_t> shed;
+            zq.shed(budget_bytes - budget_bytes/10, shed_by_source, shed);
+            for (auto& mm : shed) {
+                if (pins) {
+                    pins->release(mm.input);
+                }
+                auto& c = counters[mm.detid];
+                ++c.total;
+                ++c.shed;
+                c.shed_bytes += mm.nbytes;
+                zmsg_destroy(&mm.msg);
+            }
+            if (verbose) {
+                zsys_debug("zipper: shed %ld messages over budget", shed.size());
+            }
+        }
+
         t2 = ptmp::data::now();
         time_zip += t2-t1;
         t1=t2;
 
         // dispatch any tardy messages per policy
         for (auto& mm : tardy) {
+            if (pins) {
+                pins->release(mm.input);
+            }
             auto& c = counters[mm.detid];
             ++c.tardy;
             ++c.total;
@@ -405,6 +847,9 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
 
         // dispatch normal output
         for (auto& mm : punctual) {
+            if (pins) {
+                pins->release(mm.input);
+            }
             ++counters[mm.detid].total;
             int rc = sender(&mm.msg);
             if (rc == -1) {
@@ -414,10 +859,71 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
             }
         }
 
+        if (forward_watermarks) {
+            std::vector<std::pair<int, ptmp::data::data_time_t> > due;
+            zq.due_watermarks(due);
+            for (const auto& one : due) {
+                ptmp::data::TPSet wm;
+                ptmp::internals::make_watermark(wm, one.first, one.second);
+                if (sender(wm) == -1) {
+                    zsys_debug("zipper: got quit on output");
+                    got_quit = true;
+                    goto cleanup;
+                }
+            }
+        }
+
+        if (sender.flush() == -1) {
+            zsys_debug("zipper: got quit on output");
+            got_quit = true;
+            goto cleanup;
+        }
+
         t2 = ptmp::data::now();
         time_send += t2-t1;
         t1=t2;
 
+        if (met and t2 >= next_met) {
+            json j;
+            j["sync"]["time"] = sync_ms;
+            j["sync"]["percentile"] = sync_percentile;
+            uint64_t nshed = 0, nshed_bytes = 0;
+            for (const auto& c : counters) {
+                auto& js = j["sources"][std::to_string(c.first)];
+                js["total"] = c.second.total;
+                js["tardy"] = c.second.tardy;
+                if (budget_bytes) {
+                    js["shed"] = c.second.shed;
+                    js["shed_bytes"] = c.second.shed_bytes;
+                    nshed += c.second.shed;
+                    nshed_bytes += c.second.shed_bytes;
+                }
+                js["sync_time"] = (double)sync_ms;
+                auto it = zq.timing.find(c.first);
+                if (it != zq.timing.end()) {
+                    js["sync_time"] = 1e-3*it->second.sync_us;
+                    js["jitter"] = 1e-3*(it->second.tail.value() - it->second.median.value());
+                }
+            }
+            if (budget_bytes) {
+                j["shed"]["policy"] = shed_by_source ? "detid" : "oldest";
+                j["shed"]["held_bytes"] = zq.held_bytes;
+                j["shed"]["messages"] = nshed;
+                j["shed"]["bytes"] = nshed_bytes;
+            }
+            const auto place = ptmp::internals::thread_placement();
+            j["placement"] = json{{"cpu", place.cpu}, {"node", place.node}, {"ncpus", place.ncpus}};
+            if (pins) {
+                for (auto& in : pins->inputs) {
+                    j["inputs"].push_back(json{{"received", in.nrecv}, {"backlog", in.held},
+                                               {"stalled", in.nstalled}});
+                    in.nstalled = 0;
+                }
+            }
+            (*met)(j);
+            next_met = t2 + 1000*(ptmp::data::real_time_t)met_ms;
+        }
+
         if (loop_count %100000 == 1) {
             double n = loop_count;
             double t = ptmp::data::now() - start_time;
@@ -441,11 +947,25 @@ void ptmp::actor::zipper(zsock_t* pipe, void* vargs)
 
     zsys_debug("zipper: finishing");
     for (const auto& c : counters) {
-        zsys_debug("zipper: source %d: %ld tardy out of %ld recved",
-                   c.first, c.second.tardy, c.second.total);
+        zsys_debug("zipper: source %d: %ld tardy, %ld shed out of %ld recved",
+                   c.first, c.second.tardy, c.second.shed, c.second.total);
+    }
+    {
+        const auto& ss = sender.stats();
+        zsys_debug("zipper: sent %ld, dropped %ld, blocked %ld times for %.3f s",
+                   ss.nsent, ss.ndropped, ss.nblocked, 1e-6*ss.tblocked);
+    }
+    delete met;
+    if (pins) {
+        for (size_t ind=0; ind<pins->inputs.size(); ++ind) {
+            const auto& in = pins->inputs[ind];
+            zsys_debug("zipper: input %ld: received %ld, %ld held",
+                       ind, in.nrecv, in.held);
+        }
+        pins.reset();
     }
     zsock_destroy(&input);
-    sender.destroy();
+    zsock_destroy(&output);
     if (got_quit) {
         zsys_debug("zipper: got quit");
         return;
@@ -0,0 +1,128 @@
+/**
+   A zipper tree spreads the zipping of many inputs over a tree of
+   zipper stages, each running in its own thread.  Each leaf stage
+   zips up to "fanout" of the input endpoints and each higher stage
+   zips up to "fanout" lower stages over inproc sockets until one root
+   stage produces the output.
+
+   Each stage expects as many sources (detids) as there are input
+   endpoints beneath it so a message is released early only when
+   every input below has reported, as with a single zipper.  Stages
+   below the root pass input watermarks up once nothing held precedes
+   them.  Each stage applies the sync time so a message may be
+   delayed by as much as the tree depth times the sync time.
+
+ */
+
+#include "ptmp/api.h"
+#include "ptmp/factory.h"
+#include "ptmp/actors.h"
+
+#include "json.hpp"
+
+#include <cstdio>
+
+PTMP_AGENT(ptmp::TPZipperTree, zipper_tree)
+
+using json = nlohmann::json;
+
+ptmp::TPZipperTree::TPZipperTree(const std::string& config)
+{
+    auto jcfg = json::parse(config);
+
+    std::string name = "zipper_tree";
+    if (jcfg["name"].is_string()) {
+        name = jcfg["name"];
+    }
+    size_t fanout = 16;
+    if (jcfg["fanout"].is_number()) {
+        fanout = jcfg["fanout"];
+    }
+    if (fanout < 2) {
+        zsys_error("zipper_tree: fanout must be at least 2");
+        throw std::runtime_error("zipper_tree fanout must be at least 2");
+    }
+    jcfg.erase("fanout");
+
+    auto jinsock = jcfg["input"]["socket"];
+    int hwm = 1000;
+    if (jinsock["hwm"].is_number()) {
+        hwm = jinsock["hwm"];
+    }
+
+    // The inputs to the stages of one level of the tree.  Each is one
+    // endpoint and the number of sources which feed it.
+    struct feed_t {
+        std::string bc, addr;
+        int nsources;
+    };
+    std::vector<feed_t> feeds;
+    for (const std::string bc : {"bind", "connect"}) {
+        for (const auto& addr : jinsock[bc]) {
+            feeds.push_back(feed_t{bc, addr, 1});
+        }
+    }
+    if (feeds.empty()) {
+        zsys_error("zipper_tree: no input endpoints");
+        throw std::runtime_error("zipper_tree requires input endpoints");
+    }
+
+    // Leaf stages take the input configuration as given, less its
+    // endpoints.  Higher stages pull from the local stages below.
+    json jleaf = jcfg["input"];
+    jleaf["socket"].erase("bind");
+    jleaf["socket"].erase("connect");
+    if (!jleaf["socket"]["type"].is_string()) {
+        jleaf["socket"]["type"] = "PULL";
+    }
+    const json jinner = json{{"socket", {{"type", "PULL"}, {"hwm", hwm}}}};
+
+    for (int ilevel=0; ; ++ilevel) {
+        const bool root = feeds.size() <= fanout;
+        std::vector<feed_t> next;
+        for (size_t beg=0, istage=0; beg < feeds.size(); beg += fanout, ++istage) {
+            json scfg = jcfg;
+            json jin = ilevel ? jinner : jleaf;
+            int nsources = 0;
+            for (size_t ind=beg; ind < std::min(beg+fanout, feeds.size()); ++ind) {
+                jin["socket"][feeds[ind].bc].push_back(feeds[ind].addr);
+                nsources += feeds[ind].nsources;
+            }
+            scfg["input"] = jin;
+            scfg["sources"] = nsources;
+            scfg["name"] = name + "-" + std::to_string(ilevel) + "-" + std::to_string(istage);
+
+            if (!root) {
+                char addr[1024] = {0};
+                snprintf(addr, 1024, "inproc://%s-%p-%d-%d",
+                         name.c_str(), (void*)this, ilevel, (int)istage);
+                scfg["output"] = json{{"socket", {{"type", "PUSH"}, {"hwm", hwm},
+                                                  {"local", true},
+                                                  {"bind", {addr}}}}};
+                scfg["forward_watermarks"] = true;
+                scfg.erase("metrics");
+                next.push_back(feed_t{"connect", addr, nsources});
+            }
+            const std::string sconfig = scfg.dump();
+            m_actors.push_back(zactor_new(ptmp::actor::zipper, (void*)sconfig.c_str()));
+        }
+        if (root) {
+            zsys_debug("zipper_tree: %ld stages in %d levels", m_actors.size(), ilevel+1);
+            break;
+        }
+        feeds = next;
+    }
+}
+
+ptmp::TPZipperTree::~TPZipperTree()
+{
+    zsys_debug("zipper_tree: signaling done");
+    for (auto actor : m_actors) {
+        zsock_signal(zactor_sock(actor), 0); // signal quit
+    }
+    zclock_sleep(1000);
+    zsys_debug("zipper_tree: destroying actors");
+    for (auto& actor : m_actors) {
+        zactor_destroy(&actor);
+    }
+}
@@ -0,0 +1,570 @@
+#include "ptmp/archive.h"
+#include "ptmp/internals.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace ptmp::internals;
+
+// The file starts with a header padded to a page.  Blocks follow, each
+// a header and records padded to a page.  The index follows the last
+// block.  All values are in host (little endian) byte order.
+static const char archive_magic[8] = {'P','T','M','P','A','R','C','H'};
+static const uint32_t archive_version = 1;
+static const size_t page_size = 4096;
+static const uint32_t block_magic = 0x4b425450; // "PTBK"
+static const uint32_t index_magic = 0x58495450; // "PTIX"
+
+struct file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t index_offset;      // 0 until the writer closes
+    uint64_t nblocks;
+    uint64_t nrecords;
+};
+
+struct block_header_t {
+    uint32_t magic;
+    uint32_t nrecords;
+    uint64_t nbytes;            // of records, not counting padding
+    uint64_t tmin, tmax;
+};
+
+// A record is this header, the frame sizes and the frame data padded
+// to 8 bytes.  The size counts all of that.
+struct record_header_t {
+    uint32_t size;
+    uint32_t nframes;
+    uint64_t tstart;
+    uint32_t detid, ntps, chanbeg, chanend;
+};
+
+struct index_header_t {
+    uint32_t magic;
+    uint32_t nentries;
+};
+
+// One per block and detid.
+struct index_entry_t {
+    uint64_t offset, tmin, tmax;
+    uint32_t detid, nrecords;
+};
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+const uint8_t* archive_record_t::frame(uint32_t ind, size_t& size) const
+{
+    const uint8_t* ptr = data;
+    for (uint32_t iframe=0; iframe<ind; ++iframe) {
+        ptr += sizes[iframe];
+    }
+    size = sizes[ind];
+    return ptr;
+}
+
+zmsg_t* archive_record_t::msg() const
+{
+    zmsg_t* msg = zmsg_new();
+    const uint8_t* ptr = data;
+    for (uint32_t ind=0; ind<nframes; ++ind) {
+        zmsg_addmem(msg, ptr, sizes[ind]);
+        ptr += sizes[ind];
+    }
+    return msg;
+}
+
+bool archive_block_t::overlaps(ptmp::data::data_time_t tbeg, ptmp::data::data_time_t tend,
+                               const std::vector<uint32_t>& dets) const
+{
+    if (tmin >= tend or tmax < tbeg) {
+        return false;
+    }
+    if (dets.empty()) {
+        return true;
+    }
+    for (const auto& one : detids) {
+        if (std::find(dets.begin(), dets.end(), one.detid) == dets.end()) {
+            continue;
+        }
+        if (one.tmin < tend and one.tmax >= tbeg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add a record to the running index of a block.
+static void index_record(archive_block_t& blk, uint32_t detid, ptmp::data::data_time_t tstart)
+{
+    if (!blk.nrecords or tstart < blk.tmin) { blk.tmin = tstart; }
+    if (!blk.nrecords or tstart > blk.tmax) { blk.tmax = tstart; }
+    ++blk.nrecords;
+    for (auto& one : blk.detids) {
+        if (one.detid == detid) {
+            one.tmin = std::min(one.tmin, tstart);
+            one.tmax = std::max(one.tmax, tstart);
+            ++one.nrecords;
+            return;
+        }
+    }
+    blk.detids.push_back(archive_block_t::detid_t{detid, 1, tstart, tstart});
+}
+
+
+bool archive_select_t::operator()(uint32_t detid, ptmp::data::data_time_t tstart, uint32_t ntps,
+                                  uint32_t chanbeg, uint32_t chanend) const
+{
+    if (tstart < tbeg or tstart >= tend) {
+        return false;
+    }
+    if (!detids.empty() and std::find(detids.begin(), detids.end(), detid) == detids.end()) {
+        return false;
+    }
+    if (!ntps) {
+        return true;            // watermark
+    }
+    return chanbeg <= chanhi and chanend >= chanlo;
+}
+
+bool archive_select_t::operator()(const archive_record_t& rec) const
+{
+    return (*this)(rec.detid, rec.tstart, rec.ntps, rec.chanbeg, rec.chanend);
+}
+
+bool archive_select_t::operator()(const archive_block_t& blk) const
+{
+    return blk.overlaps(tbeg, tend, detids);
+}
+
+bool archive_select_t::operator()(zmsg_t* msg) const
+{
+    msg_header_t hdr;
+    if (!msg_header(msg, hdr)) {
+        return false;
+    }
+    // The header decides most messages.  Channels need the payload
+    // scalars, still short of the TPs.
+    if (!(*this)(hdr.detid, hdr.tstart, 0, 0, 0)) {
+        return false;
+    }
+    if (!hdr.ntps or (chanlo == 0 and chanhi == 0xffffffff)) {
+        return true;
+    }
+    zframe_t* pay = zmsg_last(msg);
+    tpset_extra_t extra;
+    if (!peek_tpset(zframe_data(pay), zframe_size(pay), hdr, extra)) {
+        return false;
+    }
+    return (*this)(hdr.detid, hdr.tstart, hdr.ntps, extra.chanbeg, extra.chanend);
+}
+
+
+bool ptmp::internals::is_archive(const std::string& filename)
+{
+    FILE* fp = fopen(filename.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+    char magic[8] = {0};
+    const size_t got = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return got == sizeof(magic) and memcmp(magic, archive_magic, sizeof(magic)) == 0;
+}
+
+ArchiveReader* ArchiveReader::open(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;         // caller reports missing input
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 or (size_t)st.st_size < page_size) {
+        ::close(fd);
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        ::close(fd);
+        zsys_error("archive: failed to map %s: %s", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+    const file_header_t* fh = (const file_header_t*)base;
+    if (memcmp(fh->magic, archive_magic, sizeof(archive_magic)) != 0) {
+        munmap(base, size);
+        ::close(fd);
+        return nullptr;
+    }
+    if (fh->version != archive_version) {
+        munmap(base, size);
+        ::close(fd);
+        zsys_error("archive: %s has unknown version %d", filename.c_str(), fh->version);
+        return nullptr;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    return new ArchiveReader(filename, fd, (const uint8_t*)base, size);
+}
+
+ArchiveReader::ArchiveReader(const std::string& filename, int fd, const uint8_t* base, size_t size)
+    : m_filename(filename), m_fd(fd), m_base(base), m_size(size)
+{
+    load_index();
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    munmap((void*)m_base, m_size);
+    ::close(m_fd);
+}
+
+void ArchiveReader::load_index()
+{
+    const file_header_t* fh = (const file_header_t*)m_base;
+    const uint64_t ioff = fh->index_offset;
+    if (!ioff or ioff + sizeof(index_header_t) > m_size) {
+        scan_index();           // writer did not finish
+        return;
+    }
+    const index_header_t* ih = (const index_header_t*)(m_base + ioff);
+    if (ih->magic != index_magic
+        or ioff + sizeof(index_header_t) + ih->nentries*sizeof(index_entry_t) > m_size) {
+        zsys_warning("archive: %s has a bad index, scanning", m_filename.c_str());
+        scan_index();
+        return;
+    }
+    const index_entry_t* ent = (const index_entry_t*)(ih+1);
+    for (uint32_t ind=0; ind<ih->nentries; ++ind, ++ent) {
+        if (!valid_block(ent->offset)) {
+            zsys_warning("archive: %s has a bad index entry, scanning", m_filename.c_str());
+            m_blocks.clear();
+            m_nrecords = 0;
+            scan_index();
+            return;
+        }
+        if (m_blocks.empty() or m_blocks.back().offset != ent->offset) {
+            m_blocks.emplace_back();
+            archive_block_t& blk = m_blocks.back();
+            blk.offset = ent->offset;
+            blk.tmin = ent->tmin;
+            blk.tmax = ent->tmax;
+        }
+        archive_block_t& blk = m_blocks.back();
+        blk.nrecords += ent->nrecords;
+        blk.tmin = std::min(blk.tmin, (ptmp::data::data_time_t)ent->tmin);
+        blk.tmax = std::max(blk.tmax, (ptmp::data::data_time_t)ent->tmax);
+        blk.detids.push_back(archive_block_t::detid_t{ent->detid, ent->nrecords,
+                    ent->tmin, ent->tmax});
+        m_nrecords += ent->nrecords;
+    }
+}
+
+// A block header must lie past the file header and within the file.
+bool ArchiveReader::valid_block(uint64_t offset) const
+{
+    const uint64_t header_size = ((const file_header_t*)m_base)->header_size;
+    if (offset < header_size or offset > m_size
+        or m_size - offset < sizeof(block_header_t)) {
+        return false;
+    }
+    return ((const block_header_t*)(m_base + offset))->magic == block_magic;
+}
+
+void ArchiveReader::scan_index()
+{
+    uint64_t off = ((const file_header_t*)m_base)->header_size;
+    while (valid_block(off)) {
+        const block_header_t* bh = (const block_header_t*)(m_base + off);
+        if (bh->nbytes > m_size - off - sizeof(block_header_t)) {
+            break;              // partly written
+        }
+        archive_block_t blk;
+        blk.offset = off;
+        m_blocks.push_back(blk);
+        each(m_blocks.size()-1, [&](const archive_record_t& rec) {
+                index_record(m_blocks.back(), rec.detid, rec.tstart);
+            });
+        m_nrecords += m_blocks.back().nrecords;
+        off += round_up(sizeof(block_header_t) + bh->nbytes, page_size);
+    }
+}
+
+const uint8_t* ArchiveReader::block_begin(size_t iblock) const
+{
+    return m_base + m_blocks[iblock].offset + sizeof(block_header_t);
+}
+
+const uint8_t* ArchiveReader::block_end(size_t iblock) const
+{
+    const block_header_t* bh = (const block_header_t*)(m_base + m_blocks[iblock].offset);
+    const uint8_t* beg = block_begin(iblock);
+    return beg + std::min((uint64_t)bh->nbytes, (uint64_t)(m_base + m_size - beg));
+}
+
+// A record must fit in what is left of its block and hold its frames.
+// A partly written or corrupt file may have one which does not.
+const uint8_t* ArchiveReader::parse(const uint8_t* pos, const uint8_t* end,
+                                    archive_record_t& rec) const
+{
+    const size_t left = end - pos;
+    if (left < sizeof(record_header_t)) {
+        return nullptr;
+    }
+    const record_header_t* rh = (const record_header_t*)pos;
+    if (rh->size < sizeof(record_header_t) or rh->size > left
+        or rh->nframes > (rh->size - sizeof(record_header_t))/sizeof(uint32_t)) {
+        return nullptr;
+    }
+    const uint32_t* sizes = (const uint32_t*)(rh+1);
+    uint64_t nbytes = sizeof(record_header_t) + rh->nframes*sizeof(uint32_t);
+    for (uint32_t ind=0; ind<rh->nframes; ++ind) {
+        nbytes += sizes[ind];
+    }
+    if (nbytes > rh->size) {
+        return nullptr;
+    }
+    rec.nframes = rh->nframes;
+    rec.tstart = rh->tstart;
+    rec.detid = rh->detid;
+    rec.ntps = rh->ntps;
+    rec.chanbeg = rh->chanbeg;
+    rec.chanend = rh->chanend;
+    rec.sizes = (const uint32_t*)(rh+1);
+    rec.data = (const uint8_t*)(rec.sizes + rh->nframes);
+    return pos + rh->size;
+}
+
+void ArchiveReader::seek(size_t iblock)
+{
+    m_block = iblock;
+    m_pos = m_end = nullptr;
+}
+
+bool ArchiveReader::next(archive_record_t& rec)
+{
+    while (true) {
+        while (m_pos == m_end) {
+            if (m_block >= m_blocks.size()) {
+                return false;
+            }
+            m_pos = block_begin(m_block);
+            m_end = block_end(m_block);
+            ++m_block;
+        }
+        const uint8_t* pos = parse(m_pos, m_end, rec);
+        if (pos) {
+            m_pos = pos;
+            return true;
+        }
+        zsys_warning("archive: %s has a bad record in block %ld, skipping the rest",
+                     m_filename.c_str(), m_block-1);
+        m_pos = m_end;
+    }
+}
+
+zmsg_t* ArchiveReader::read()
+{
+    archive_record_t rec;
+    if (!next(rec)) {
+        return nullptr;
+    }
+    return rec.msg();
+}
+
+
+ArchiveWriter::ArchiveWriter(const std::string& filename, size_t block_kb)
+    : m_filename(filename)
+    , m_block_bytes(std::max((size_t)1, block_kb)*1024)
+{
+    m_fp = fopen(filename.c_str(), "w");
+    if (!m_fp) {
+        zsys_error("archive: failed to create %s: %s", filename.c_str(), strerror(errno));
+        throw std::runtime_error("archive failed to create file");
+    }
+    std::string page(page_size, 0);
+    file_header_t fh{};
+    memcpy(fh.magic, archive_magic, sizeof(archive_magic));
+    fh.version = archive_version;
+    fh.header_size = page_size;
+    memcpy(&page[0], &fh, sizeof(fh));
+    if (fwrite(page.data(), 1, page.size(), m_fp) != page.size() or fflush(m_fp) != 0) {
+        zsys_error("archive: failed to write %s: %s", filename.c_str(), strerror(errno));
+        fclose(m_fp);
+        m_fp = nullptr;
+        throw std::runtime_error("archive failed to write file");
+    }
+    m_offset = page_size;
+    m_buf.reserve(m_block_bytes + page_size);
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+bool ArchiveWriter::write(zmsg_t* msg)
+{
+    if (!m_ok) {
+        return false;
+    }
+    // Never store a local message's pointer.
+    zmsg_t* ser = nullptr;
+    if (const ptmp::data::TPSet* tps = local_tpset(msg)) {
+        ser = make_msg(*tps);
+        msg = ser;
+    }
+
+    archive_record_t rec;
+    msg_header_t hdr;
+    tpset_extra_t extra;
+    if (msg_header(msg, hdr)) {
+        zframe_t* pay = zmsg_last(msg);
+        msg_header_t phdr;
+        peek_tpset(zframe_data(pay), zframe_size(pay), phdr, extra);
+        rec.tstart = hdr.tstart;
+        rec.detid = hdr.detid;
+        rec.ntps = hdr.ntps;
+        rec.chanbeg = extra.chanbeg;
+        rec.chanend = extra.chanend;
+    }
+    else {
+        rec.detid = 0xffffffff; // not a TPSet message, kept anyway
+    }
+
+    std::vector<std::pair<const void*, size_t> > frames;
+    for (zframe_t* frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        if (frames.empty() and zframe_size(frame) == msg_topic_size) {
+            continue;           // topic
+        }
+        frames.push_back(std::make_pair(zframe_data(frame), zframe_size(frame)));
+    }
+    const bool ok = add(rec, frames);
+    if (ser) {
+        zmsg_destroy(&ser);
+    }
+    return ok;
+}
+
+bool ArchiveWriter::write(const archive_record_t& rec)
+{
+    if (!m_ok) {
+        return false;
+    }
+    std::vector<std::pair<const void*, size_t> > frames;
+    for (uint32_t ind=0; ind<rec.nframes; ++ind) {
+        size_t size=0;
+        const uint8_t* data = rec.frame(ind, size);
+        frames.push_back(std::make_pair(data, size));
+    }
+    return add(rec, frames);
+}
+
+bool ArchiveWriter::add(const archive_record_t& rec,
+                        const std::vector<std::pair<const void*, size_t> >& frames)
+{
+    size_t size = sizeof(record_header_t) + frames.size()*sizeof(uint32_t);
+    for (const auto& fr : frames) {
+        size += fr.second;
+    }
+    size = round_up(size, 8);
+
+    record_header_t rh{(uint32_t)size, (uint32_t)frames.size(), rec.tstart,
+            rec.detid, rec.ntps, rec.chanbeg, rec.chanend};
+    const size_t start = m_buf.size();
+    m_buf.append((const char*)&rh, sizeof(rh));
+    for (const auto& fr : frames) {
+        const uint32_t fsize = fr.second;
+        m_buf.append((const char*)&fsize, sizeof(fsize));
+    }
+    for (const auto& fr : frames) {
+        m_buf.append((const char*)fr.first, fr.second);
+    }
+    m_buf.resize(start + size, 0);
+
+    index_record(m_cur, rec.detid, rec.tstart);
+    ++m_nrecords;
+    if (m_buf.size() >= m_block_bytes) {
+        return flush_block();
+    }
+    return true;
+}
+
+bool ArchiveWriter::put(const void* data, size_t size)
+{
+    if (m_ok and size and fwrite(data, 1, size, m_fp) != size) {
+        zsys_error("archive: failed to write %s: %s", m_filename.c_str(), strerror(errno));
+        m_ok = false;
+    }
+    return m_ok;
+}
+
+// Write the block in one go.
+bool ArchiveWriter::flush_block()
+{
+    if (!m_cur.nrecords) {
+        return m_ok;
+    }
+    block_header_t bh{block_magic, m_cur.nrecords, m_buf.size(), m_cur.tmin, m_cur.tmax};
+    m_buf.insert(0, (const char*)&bh, sizeof(bh));
+    m_buf.resize(round_up(m_buf.size(), page_size), 0);
+    if (put(m_buf.data(), m_buf.size()) and fflush(m_fp) != 0) {
+        zsys_error("archive: failed to write %s: %s", m_filename.c_str(), strerror(errno));
+        m_ok = false;
+    }
+
+    m_cur.offset = m_offset;
+    m_index.push_back(m_cur);
+    m_offset += m_buf.size();
+    m_cur = archive_block_t{};
+    m_buf.clear();
+    return m_ok;
+}
+
+bool ArchiveWriter::close()
+{
+    if (!m_fp) {
+        return m_ok;
+    }
+    flush_block();
+
+    std::vector<index_entry_t> ents;
+    for (const auto& blk : m_index) {
+        for (const auto& one : blk.detids) {
+            ents.push_back(index_entry_t{blk.offset, one.tmin, one.tmax, one.detid, one.nrecords});
+        }
+    }
+    index_header_t ih{index_magic, (uint32_t)ents.size()};
+    put(&ih, sizeof(ih));
+    put(ents.data(), ents.size()*sizeof(index_entry_t));
+
+    file_header_t fh{};
+    memcpy(fh.magic, archive_magic, sizeof(archive_magic));
+    fh.version = archive_version;
+    fh.header_size = page_size;
+    fh.index_offset = m_offset;
+    fh.nblocks = m_index.size();
+    fh.nrecords = m_nrecords;
+    // Without an index the file is still readable, so only point
+    // to one which was fully written.
+    if (m_ok) {
+        if (fseek(m_fp, 0, SEEK_SET) != 0) {
+            zsys_error("archive: failed to seek %s: %s", m_filename.c_str(), strerror(errno));
+            m_ok = false;
+        }
+        put(&fh, sizeof(fh));
+    }
+    if (fclose(m_fp) != 0 and m_ok) {
+        zsys_error("archive: failed to close %s: %s", m_filename.c_str(), strerror(errno));
+        m_ok = false;
+    }
+    m_fp = nullptr;
+    return m_ok;
+}
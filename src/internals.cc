@@ -1,29 +1,209 @@
 #include "ptmp/data.h"
 #include "ptmp/internals.h"
+#include "ptmp/shm.h"
 #include "json.hpp"
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
 #include <string> 
 #include <iostream>             // debug
 #include <algorithm>
+#include <random>
 #include <unordered_map>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <ctime>
+#include <cstring>
 
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 void ptmp::internals::set_thread_name(const std::string& name)
 {
     //zsys_debug("set thread name \"%s\"", name.c_str());
     // this is just for Linux API...
     pthread_setname_np(pthread_self(), name.c_str());
 }
+
+bool ptmp::internals::set_thread_cpus(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 and cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (!CPU_COUNT(&set)) {
+        return false;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::vector<int> ptmp::internals::thread_cpus()
+{
+    std::vector<int> ret;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        return ret;
+    }
+    for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            ret.push_back(cpu);
+        }
+    }
+    return ret;
+}
+
+// The set_mempolicy(2) modes, to avoid needing libnuma.
+static const int ptmp_mpol_default = 0;
+static const int ptmp_mpol_preferred = 1;
+static const int ptmp_mpol_bind = 2;
+
+bool ptmp::internals::set_thread_numa(int node, bool strict)
+{
+#ifdef SYS_set_mempolicy
+    if (node < 0) {
+        return syscall(SYS_set_mempolicy, ptmp_mpol_default, NULL, 0) == 0;
+    }
+    const size_t nbits = 8*sizeof(unsigned long);
+    std::vector<unsigned long> mask(node/nbits + 1, 0);
+    mask[node/nbits] |= 1UL << (node%nbits);
+    const int mode = strict ? ptmp_mpol_bind : ptmp_mpol_preferred;
+    return syscall(SYS_set_mempolicy, mode, mask.data(), mask.size()*nbits + 1) == 0;
+#else
+    return false;
+#endif
+}
+
+ptmp::internals::placement_t ptmp::internals::thread_placement()
+{
+    placement_t ret;
+#ifdef SYS_getcpu
+    unsigned cpu=0, node=0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        ret.cpu = cpu;
+        ret.node = node;
+    }
+#endif
+    ret.ncpus = thread_cpus().size();
+    return ret;
+}
+
 #else
 void ptmp::internals::set_thread_name(const std::string& name)
 {
     //zsys_debug("can not set name \"%s\", no pthreads", name.c_str());
 }
+bool ptmp::internals::set_thread_cpus(const std::vector<int>& cpus)
+{
+    return false;
+}
+std::vector<int> ptmp::internals::thread_cpus()
+{
+    return std::vector<int>();
+}
+bool ptmp::internals::set_thread_numa(int node, bool strict)
+{
+    return false;
+}
+ptmp::internals::placement_t ptmp::internals::thread_placement()
+{
+    return placement_t();
+}
 #endif
 
+// Parse a non-negative decimal number which is all of str.
+static bool parse_cpu_number(const std::string& str, int& num)
+{
+    if (str.empty() or str.size() > 6
+        or str.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    num = atoi(str.c_str());
+    return true;
+}
+
+std::vector<int> ptmp::internals::parse_cpulist(const std::string& list)
+{
+    std::vector<int> ret;
+    size_t beg = 0;
+    while (beg < list.size()) {
+        size_t end = list.find(',', beg);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        const std::string one = list.substr(beg, end-beg);
+        beg = end + 1;
+        if (one.empty()) {
+            continue;
+        }
+        // lo, lo-hi or lo-hi:stride
+        const size_t colon = one.find(':');
+        const std::string range = one.substr(0, colon);
+        const size_t dash = range.find('-');
+        int lo=0, hi=0, stride=1;
+        bool ok = parse_cpu_number(range.substr(0, dash), lo);
+        hi = lo;
+        if (dash != std::string::npos) {
+            ok = ok and parse_cpu_number(range.substr(dash+1), hi);
+        }
+        if (colon != std::string::npos) {
+            ok = ok and dash != std::string::npos
+                and parse_cpu_number(one.substr(colon+1), stride) and stride > 0;
+        }
+        if (!ok or hi < lo) {
+            zsys_error("malformed CPU list \"%s\"", list.c_str());
+            return std::vector<int>();
+        }
+        for (int cpu=lo; cpu<=hi; cpu+=stride) {
+            ret.push_back(cpu);
+        }
+    }
+    return ret;
+}
+
+std::vector<int> ptmp::internals::numa_cpus(int node)
+{
+    const std::string fname = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    FILE* fp = fopen(fname.c_str(), "r");
+    if (!fp) {
+        return std::vector<int>();
+    }
+    char buf[4096] = {0};
+    const char* got = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (!got) {
+        return std::vector<int>();
+    }
+    std::string list = buf;
+    while (!list.empty() and isspace(list.back())) {
+        list.pop_back();
+    }
+    return parse_cpulist(list);
+}
+
+void ptmp::internals::set_io_threads(int nthreads, const std::vector<int>& cpus)
+{
+    if (nthreads > 0) {
+        zsys_set_io_threads(nthreads);
+    }
+    if (cpus.empty()) {
+        return;
+    }
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    void* ctx = zsys_init();
+    for (int cpu : cpus) {
+        zmq_ctx_set(ctx, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+    }
+#else
+    zsys_warning("ZeroMQ too old to set I/O thread CPUs");
+#endif
+}
+
 using json = nlohmann::json;
 
 using namespace ptmp::internals;
@@ -63,6 +243,42 @@ int ptmp::internals::socket_type(std::string name)
 }
 
 
+// Subscribe a SUB to each of a "subscriptions" array, all if none.
+// An element may be a detid number, an object with "detid" and
+// optional "channels" range [lo, hi] or a literal prefix string.
+static void subscribe(zsock_t* sock, const json& jsubs)
+{
+    if (!jsubs.is_array() or jsubs.empty()) {
+        zsock_set_subscribe(sock, "");
+        return;
+    }
+    void* handle = zsock_resolve(sock);
+    for (const auto& jsub : jsubs) {
+        std::vector<std::string> prefixes;
+        if (jsub.is_string()) {
+            prefixes.push_back(jsub.get<std::string>());
+        }
+        else if (jsub.is_number()) {
+            prefixes = topic_subscriptions(jsub.get<uint32_t>(), 0, 0xffffffff);
+        }
+        else if (jsub.is_object() and jsub.count("detid")) {
+            uint32_t lo = 0, hi = 0xffffffff;
+            if (jsub.count("channels") and jsub["channels"].size() == 2) {
+                lo = jsub["channels"][0];
+                hi = jsub["channels"][1];
+            }
+            prefixes = topic_subscriptions(jsub["detid"].get<uint32_t>(), lo, hi);
+        }
+        else {
+            zsys_error("bad subscription: %s", jsub.dump().c_str());
+            throw std::runtime_error("bad subscription");
+        }
+        for (const auto& prefix : prefixes) {
+            zmq_setsockopt(handle, ZMQ_SUBSCRIBE, prefix.data(), prefix.size());
+        }
+    }
+}
+
 zsock_t* ptmp::internals::endpoint(const std::string& config)
 {
     auto jcfg = json::parse(config);
@@ -83,12 +299,17 @@ zsock_t* ptmp::internals::endpoint(const std::string& config)
     }
 
     zsock_set_rcvhwm(sock, hwm);
-    if (socktype == 2) {        // fixme: support topics?
-        zsock_set_subscribe(sock, "");
+    if (socktype == 2) {
+        subscribe(sock, jsock["subscriptions"]);
     }
 
     for (auto jaddr : jsock["bind"]) {
         std::string addr = jaddr;
+        if (addr.find("shm://") == 0) {
+            addr = shm_bridge(addr, socktype, true, jsock.dump());
+            zsock_connect(sock, addr.c_str(), NULL);
+            continue;
+        }
         zsys_info("%s %s bind", stype.c_str(), addr.c_str());
         int port = zsock_bind(sock, addr.c_str(), NULL);
         if (port<0) {
@@ -98,6 +319,11 @@ zsock_t* ptmp::internals::endpoint(const std::string& config)
     }
     for (auto jaddr : jsock["connect"]) {
         std::string addr = jaddr;
+        if (addr.find("shm://") == 0) {
+            addr = shm_bridge(addr, socktype, false, jsock.dump());
+            zsock_connect(sock, addr.c_str(), NULL);
+            continue;
+        }
         zsys_info("%s %s connect", stype.c_str(), addr.c_str());
         int rc = zsock_connect(sock, addr.c_str(), NULL);
         if (rc<0) {
@@ -139,6 +365,10 @@ ptmp::internals::Socket::Socket(const std::string& config)
     : m_sock(endpoint(config))
     , m_poller(zpoller_new(m_sock, NULL))
 {
+    auto jcfg = json::parse(config);
+    if (jcfg["socket"]["topic"].is_boolean()) {
+        m_topic = jcfg["socket"]["topic"];
+    }
 }
 
 ptmp::internals::Socket::~Socket()
@@ -158,36 +388,240 @@ zmsg_t* ptmp::internals::Socket::msg(int timeout_msec)
 
 
 // frames:
-// [1] a message type ID (only ID 0 currently supported).
-// [2] the payload as serialized TPSet
-void ptmp::internals::recv(zmsg_t** msg, ptmp::data::TPSet& tps)
+// [1] a message type ID (schema version 0 or 2).
+// [2] v0: the payload as serialized TPSet, v2: a msg_header_t
+// [3] v2: the payload as serialized TPSet
+void ptmp::internals::make_header(const ptmp::data::TPSet& tps, msg_header_t& hdr)
 {
-    recv_keep(*msg, tps);
-    zmsg_destroy(msg);
+    hdr.tstart = tps.tstart();
+    hdr.created = tps.created();
+    hdr.count = tps.count();
+    hdr.detid = tps.detid();
+    hdr.tspan = tps.tspan();
+    hdr.ntps = tps.tps_size();
+    hdr.flags = tps.watermark() ? msg_flag_watermark : 0;
+    hdr.reserved = 0;
 }
-void ptmp::internals::recv_keep(zmsg_t* msg, ptmp::data::TPSet& tps)
+
+void ptmp::internals::make_watermark(ptmp::data::TPSet& tps, uint32_t detid,
+                                     ptmp::data::data_time_t tstart)
 {
-    size_t nframes = zmsg_size(msg);
+    tps.Clear();
+    tps.set_count(0);
+    tps.set_detid(detid);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(tstart);
+    tps.set_tspan(0);
+    tps.set_watermark(true);
+}
 
-    // message schema version 0
-    if (nframes != 2) {
-        zmsg_destroy(&msg);
-        throw std::runtime_error("unknown message size");
+static bool peek_tpset_impl(const void* data, size_t size, msg_header_t& hdr,
+                            tpset_extra_t* extra)
+{
+    using google::protobuf::io::CodedInputStream;
+    using google::protobuf::internal::WireFormatLite;
+
+    // Field numbers from ptmp.proto.  Protobuf serializes known
+    // fields in field number order so the scalars are all found
+    // before the first "tps".  A watermark has no "tps".
+    enum { f_count=1, f_detid=2, f_created=3, f_tstart=4, f_tspan=5,
+           f_chanbeg=6, f_chanend=7, f_totaladc=8, f_tps=9, f_watermark=10 };
+    const int required = (1<<f_count) | (1<<f_detid) | (1<<f_created) | (1<<f_tstart);
+
+    CodedInputStream cis((const uint8_t*)data, size);
+    hdr = msg_header_t{};
+    if (extra) {
+        *extra = tpset_extra_t{};
     }
+    int seen = 0;
+    uint64_t u64=0;
+    uint32_t u32=0;
+    while (true) {
+        const uint32_t tag = cis.ReadTag();
+        if (!tag) {
+            break;
+        }
+        const int field = WireFormatLite::GetTagFieldNumber(tag);
+        const auto wt = WireFormatLite::GetTagWireType(tag);
+        if (field == f_tps and wt == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            // skip, don't parse
+            if (!cis.ReadVarint32(&u32) or !cis.Skip(u32)) {
+                return false;
+            }
+            ++hdr.ntps;
+            continue;
+        }
+        if (field == f_watermark) {
+            if (wt != WireFormatLite::WIRETYPE_VARINT or !cis.ReadVarint64(&u64)) {
+                return false;
+            }
+            hdr.flags = u64 ? msg_flag_watermark : 0;
+            continue;
+        }
+        if (field >= f_count and field <= f_tspan) {
+            if (wt != WireFormatLite::WIRETYPE_VARINT or !cis.ReadVarint64(&u64)) {
+                return false;
+            }
+            seen |= 1<<field;
+            switch (field) {
+            case f_count: hdr.count = u64; break;
+            case f_detid: hdr.detid = u64; break;
+            case f_created: hdr.created = u64; break;
+            case f_tstart: hdr.tstart = u64; break;
+            case f_tspan: hdr.tspan = u64; break;
+            }
+            continue;
+        }
+        if (extra and field >= f_chanbeg and field <= f_totaladc) {
+            if (wt != WireFormatLite::WIRETYPE_VARINT or !cis.ReadVarint64(&u64)) {
+                return false;
+            }
+            switch (field) {
+            case f_chanbeg: extra->chanbeg = u64; break;
+            case f_chanend: extra->chanend = u64; break;
+            case f_totaladc: extra->totaladc = u64; break;
+            }
+            continue;
+        }
+        if (!WireFormatLite::SkipField(&cis, tag)) {
+            return false;
+        }
+    }
+    if (!cis.ConsumedEntireMessage()) {
+        return false;
+    }
+    return (seen & required) == required;
+}
 
+bool ptmp::internals::peek_tpset(const void* data, size_t size, msg_header_t& hdr)
+{
+    return peek_tpset_impl(data, size, hdr, nullptr);
+}
+
+bool ptmp::internals::peek_tpset(const void* data, size_t size, msg_header_t& hdr,
+                                 tpset_extra_t& extra)
+{
+    return peek_tpset_impl(data, size, hdr, &extra);
+}
+
+int ptmp::internals::msg_schema(zmsg_t* msg)
+{
     zframe_t* fid = zmsg_first(msg);
-    if (!fid) {
-        zmsg_destroy(&msg);
-        throw std::runtime_error("null message ID frame");
+    size_t nframes = zmsg_size(msg);
+    if (fid and zframe_size(fid) == msg_topic_size) {
+        fid = zmsg_next(msg);   // skip topic
+        --nframes;
     }
-    int version = *(int*)zframe_data(fid);
-    
-    if (version != 0) {
+    if (!fid or zframe_size(fid) != sizeof(int)) {
+        return -1;
+    }
+    const int version = *(int*)zframe_data(fid);
+    if (version == msg_schema_v0 and nframes == 2) {
+        return version;
+    }
+    if (version == msg_schema_v2 and nframes == 3) {
+        return version;
+    }
+    if (version == msg_schema_local and nframes == 3) {
+        // Only trust a TPSet object made by this process.
+        zframe_t* fhdr = zmsg_next(msg);
+        zframe_t* pay = zmsg_next(msg);
+        bool ok = zframe_size(fhdr) == sizeof(msg_header_t)
+            and zframe_size(pay) == sizeof(ptmp::data::TPSet)
+            and ((const msg_header_t*)zframe_data(fhdr))->reserved == local_token();
+        // leave the cursor on the ID frame as for the other versions
+        zmsg_first(msg);
+        if (nframes != zmsg_size(msg)) {
+            zmsg_next(msg);
+        }
+        return ok ? version : -1;
+    }
+    return -1;
+}
+
+uint32_t ptmp::internals::local_token()
+{
+    static const uint32_t token = []() {
+        std::random_device rd;
+        uint32_t tok = 0;
+        while (!tok) {
+            tok = rd();
+        }
+        return tok;
+    }();
+    return token;
+}
+
+bool ptmp::internals::local_output(const std::string& config)
+{
+    auto jsock = json::parse(config)["socket"];
+    if (!jsock["local"].is_boolean() or !jsock["local"].get<bool>()) {
+        return false;
+    }
+    for (const std::string bc : {"bind", "connect"}) {
+        for (const auto& jaddr : jsock[bc]) {
+            const std::string addr = jaddr;
+            if (addr.compare(0, 9, "inproc://") != 0) {
+                zsys_error("\"local\" refused for output to %s, only inproc:// may be local",
+                           addr.c_str());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ptmp::internals::msg_header(zmsg_t* msg, msg_header_t& hdr)
+{
+    const int version = msg_schema(msg);
+    if (version < 0) {
+        return false;
+    }
+    zframe_t* frame = zmsg_next(msg);
+    if (version == msg_schema_v2 or version == msg_schema_local) {
+        if (zframe_size(frame) != sizeof(msg_header_t)) {
+            return false;
+        }
+        memcpy(&hdr, zframe_data(frame), sizeof(msg_header_t));
+        return true;
+    }
+    // v0, scan the payload without parsing the TPs.
+    return peek_tpset(zframe_data(frame), zframe_size(frame), hdr);
+}
+
+void ptmp::internals::recv(zmsg_t** msg, ptmp::data::TPSet& tps)
+{
+    recv_keep(*msg, tps);
+    zmsg_destroy(msg);
+}
+ptmp::data::TPSet* ptmp::internals::recv(zmsg_t** msg, google::protobuf::Arena* arena)
+{
+    auto tps = google::protobuf::Arena::CreateMessage<ptmp::data::TPSet>(arena);
+    recv(msg, *tps);
+    return tps;
+}
+
+void ptmp::internals::recv_keep(zmsg_t* msg, ptmp::data::TPSet& tps)
+{
+    const int version = msg_schema(msg);
+    if (version < 0) {
         zmsg_destroy(&msg);
         throw std::runtime_error("unknown message schema version");
     }
 
+    if (version == msg_schema_local) {
+        const ptmp::data::TPSet* local = local_tpset(msg);
+        if (!local) {
+            throw std::runtime_error("malformed local message");
+        }
+        tps.CopyFrom(*local);
+        return;
+    }
+
     zframe_t* pay = zmsg_next(msg);
+    if (version == msg_schema_v2) {
+        pay = zmsg_next(msg);   // skip header
+    }
     if (!pay) {
         zsys_error(zmq_strerror (errno));
         throw std::runtime_error("null payload frame");
@@ -199,9 +633,14 @@ void ptmp::internals::recv_keep(zmsg_t* msg, ptmp::data::TPSet& tps)
     }
 }
 
-void ptmp::internals::send(zsock_t* sock, const ptmp::data::TPSet& tpset)
+// Start a schema message with its ID frame and, if v2, header frame.
+static zmsg_t* new_msg(const ptmp::internals::msg_header_t& hdr, int schema)
 {
-    const int version = 0;
+    using namespace ptmp::internals;
+    if (schema != msg_schema_v0 and schema != msg_schema_v2) {
+        zsys_error("unsupported message schema version %d", schema);
+        throw std::runtime_error("unsupported message schema version");
+    }
 
     // the message ID:
     zmsg_t* msg = zmsg_new();
@@ -211,7 +650,7 @@ void ptmp::internals::send(zsock_t* sock, const ptmp::data::TPSet& tpset)
     }
     
     {
-        zframe_t* fid = zframe_new(&version, sizeof(int));
+        zframe_t* fid = zframe_new(&schema, sizeof(int));
         if (!fid) {
             zsys_error(zmq_strerror (errno));
             throw std::runtime_error("new ID frame failed");
@@ -223,17 +662,132 @@ void ptmp::internals::send(zsock_t* sock, const ptmp::data::TPSet& tpset)
         }
     }
 
-    {
-        size_t siz = tpset.ByteSize();
-        zframe_t* pay = zframe_new(NULL, siz);
-        tpset.SerializeToArray(zframe_data(pay), zframe_size(pay));
-        int rc = zmsg_append(msg, &pay);
+    if (schema == msg_schema_v2) {
+        zframe_t* fhdr = zframe_new(&hdr, sizeof(msg_header_t));
+        int rc = zmsg_append(msg, &fhdr);
         if (rc) {
             zsys_error(zmq_strerror (errno));
-            throw std::runtime_error("msg append failed");
+            throw std::runtime_error("msg header append failed");
         }
     }
-    
+    return msg;
+}
+
+static void append_payload(zmsg_t* msg, zframe_t* pay)
+{
+    int rc = zmsg_append(msg, &pay);
+    if (rc) {
+        zsys_error(zmq_strerror (errno));
+        throw std::runtime_error("msg append failed");
+    }
+}
+
+zmsg_t* ptmp::internals::make_msg(const ptmp::data::TPSet& tpset, int schema)
+{
+    msg_header_t hdr{};
+    if (schema == msg_schema_v2) {
+        make_header(tpset, hdr);
+    }
+    zmsg_t* msg = new_msg(hdr, schema);
+
+    size_t siz = tpset.ByteSize();
+    zframe_t* pay = zframe_new(NULL, siz);
+    tpset.SerializeToArray(zframe_data(pay), zframe_size(pay));
+    append_payload(msg, pay);
+    return msg;
+}
+
+void ptmp::internals::encode_tp(std::string& out, uint32_t channel,
+                                ptmp::data::data_time_t tstart, uint32_t tspan,
+                                uint32_t adcsum, uint32_t adcpeak, uint32_t flags)
+{
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+
+    // Field numbers from ptmp.proto
+    enum { f_channel=1, f_tstart=2, f_tspan=3, f_adcsum=4, f_adcpeak=5, f_flags=6 };
+    enum { f_tps=9 };
+
+    // enough for 5 tagged uint32 and a tagged uint64
+    uint8_t body[64];
+    uint8_t* end = body;
+    end = WireFormatLite::WriteUInt32ToArray(f_channel, channel, end);
+    end = WireFormatLite::WriteUInt64ToArray(f_tstart, tstart, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_tspan, tspan, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_adcsum, adcsum, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_adcpeak, adcpeak, end);
+    if (flags) {
+        end = WireFormatLite::WriteUInt32ToArray(f_flags, flags, end);
+    }
+    const uint32_t blen = end - body;
+
+    uint8_t head[8];
+    uint8_t* hend = WireFormatLite::WriteTagToArray(
+        f_tps, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, head);
+    hend = CodedOutputStream::WriteVarint32ToArray(blen, hend);
+
+    out.append((const char*)head, hend-head);
+    out.append((const char*)body, blen);
+}
+
+zmsg_t* ptmp::internals::make_msg(const msg_header_t& hdr, const tpset_extra_t& extra,
+                                  const std::vector<const std::string*>& tps,
+                                  int schema)
+{
+    using google::protobuf::internal::WireFormatLite;
+
+    // Field numbers from ptmp.proto, written in order as protobuf does.
+    enum { f_count=1, f_detid=2, f_created=3, f_tstart=4, f_tspan=5,
+           f_chanbeg=6, f_chanend=7, f_totaladc=8, f_watermark=10 };
+
+    uint8_t scalars[64];
+    uint8_t* end = scalars;
+    end = WireFormatLite::WriteUInt32ToArray(f_count, hdr.count, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_detid, hdr.detid, end);
+    end = WireFormatLite::WriteInt64ToArray(f_created, hdr.created, end);
+    end = WireFormatLite::WriteUInt64ToArray(f_tstart, hdr.tstart, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_tspan, hdr.tspan, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_chanbeg, extra.chanbeg, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_chanend, extra.chanend, end);
+    end = WireFormatLite::WriteUInt32ToArray(f_totaladc, extra.totaladc, end);
+    const size_t nscalars = end - scalars;
+
+    // A watermark has no TPs so its field follows the scalars.
+    uint8_t wmark[8];
+    uint8_t* wend = wmark;
+    if (is_watermark(hdr)) {
+        wend = WireFormatLite::WriteBoolToArray(f_watermark, true, wend);
+    }
+    const size_t nwmark = wend - wmark;
+
+    size_t siz = nscalars + nwmark;
+    for (const auto* one : tps) {
+        siz += one->size();
+    }
+
+    zmsg_t* msg = new_msg(hdr, schema);
+    zframe_t* pay = zframe_new(NULL, siz);
+    uint8_t* dst = zframe_data(pay);
+    memcpy(dst, scalars, nscalars);
+    dst += nscalars;
+    for (const auto* one : tps) {
+        memcpy(dst, one->data(), one->size());
+        dst += one->size();
+    }
+    memcpy(dst, wmark, nwmark);
+    append_payload(msg, pay);
+    return msg;
+}
+
+void ptmp::internals::send(zsock_t* sock, const ptmp::data::TPSet& tpset, int schema,
+                          bool topic)
+{
+    zmsg_t* msg = make_msg(tpset, schema);
+    if (topic) {
+        const uint32_t chanbeg = is_watermark(tpset) ? topic_watermark : tpset.chanbeg();
+        const std::string top = msg_topic(tpset.detid(), chanbeg);
+        zmsg_pushmem(msg, top.data(), top.size());
+    }
     int rc = zmsg_send(&msg, sock);
     if (rc) {
         zsys_error(zmq_strerror (errno));
@@ -242,6 +796,324 @@ void ptmp::internals::send(zsock_t* sock, const ptmp::data::TPSet& tpset)
     
 }
 
+std::string ptmp::internals::msg_topic(uint32_t detid, uint32_t chanbeg)
+{
+    const uint32_t be[2] = { htonl(detid), htonl(chanbeg) };
+    return std::string((const char*)be, sizeof(be));
+}
+
+bool ptmp::internals::add_topic(zmsg_t* msg)
+{
+    const int version = msg_schema(msg);
+    if (version < 0) {
+        return false;
+    }
+    if (zframe_size(zmsg_first(msg)) == msg_topic_size) {
+        return true;            // already has one
+    }
+    uint32_t detid=0, chanbeg=0;
+    if (const auto* tps = local_tpset(msg)) {
+        detid = tps->detid();
+        chanbeg = is_watermark(*tps) ? topic_watermark : tps->chanbeg();
+    }
+    else {
+        msg_header_t hdr;
+        tpset_extra_t extra;
+        zframe_t* pay = zmsg_last(msg);
+        if (!peek_tpset(zframe_data(pay), zframe_size(pay), hdr, extra)) {
+            return false;
+        }
+        detid = hdr.detid;
+        chanbeg = is_watermark(hdr) ? topic_watermark : extra.chanbeg;
+    }
+    const std::string top = msg_topic(detid, chanbeg);
+    zmsg_pushmem(msg, top.data(), top.size());
+    return true;
+}
+
+void ptmp::internals::strip_topic(zmsg_t* msg)
+{
+    zframe_t* first = zmsg_first(msg);
+    if (first and zframe_size(first) == msg_topic_size) {
+        zframe_t* top = zmsg_pop(msg);
+        zframe_destroy(&top);
+    }
+}
+
+// Add to out the prefixes covering [lo,hi] within the block of
+// chanbeg values starting at base of size 2^shift which has the
+// given prefix.  Prefixes are whole bytes so a block splits in 256.
+static void cover_channels(const std::string& prefix, uint64_t base, int shift,
+                           uint64_t lo, uint64_t hi, std::vector<std::string>& out)
+{
+    const uint64_t last = base + (1ULL<<shift) - 1;
+    if (last < lo or base > hi) {
+        return;
+    }
+    if (lo <= base and last <= hi) {
+        out.push_back(prefix);
+        return;
+    }
+    shift -= 8;
+    for (uint64_t byte=0; byte<256; ++byte) {
+        cover_channels(prefix + (char)byte, base + (byte << shift), shift, lo, hi, out);
+    }
+}
+
+std::vector<std::string> ptmp::internals::topic_subscriptions(uint32_t detid, uint32_t chanlo,
+                                                              uint32_t chanhi)
+{
+    std::vector<std::string> ret;
+    const std::string det = msg_topic(detid, 0).substr(0, 4);
+    cover_channels(det, 0, 32, chanlo, chanhi, ret);
+    if (ret.size() != 1 or ret[0] != det) { // all covers watermarks too
+        ret.push_back(msg_topic(detid, topic_watermark));
+    }
+    return ret;
+}
+
+const ptmp::data::TPSet* ptmp::internals::local_tpset(zmsg_t* msg)
+{
+    if (msg_schema(msg) != msg_schema_local) {
+        return nullptr;
+    }
+    return (const ptmp::data::TPSet*)zframe_data(zmsg_last(msg));
+}
+
+void ptmp::internals::materialize(zmsg_t** msg, int schema)
+{
+    const ptmp::data::TPSet* tps = local_tpset(*msg);
+    if (!tps) {
+        return;
+    }
+    zmsg_t* ser = make_msg(*tps, schema);
+    zmsg_destroy(msg);
+    *msg = ser;
+}
+
+zmsg_t* ptmp::internals::dup_msg(zmsg_t* msg)
+{
+    if (const ptmp::data::TPSet* tps = local_tpset(msg)) {
+        return make_msg(*tps);
+    }
+    return zmsg_dup(msg);
+}
+
+
+ptmp::internals::ReusableArena::ReusableArena(size_t initial_bytes)
+    : m_block(initial_bytes)
+{
+    google::protobuf::ArenaOptions opts;
+    if (!m_block.empty()) {
+        opts.initial_block = m_block.data();
+        opts.initial_block_size = m_block.size();
+    }
+    m_arena = new google::protobuf::Arena(opts);
+}
+
+ptmp::internals::ReusableArena::~ReusableArena()
+{
+    delete m_arena;
+    m_arena = nullptr;
+}
+
+ptmp::data::TPSet* ptmp::internals::ReusableArena::make_tpset()
+{
+    return google::protobuf::Arena::CreateMessage<ptmp::data::TPSet>(m_arena);
+}
+
+uint64_t ptmp::internals::ReusableArena::reset()
+{
+    return m_arena->Reset();
+}
+
+
+ptmp::internals::CarefulSender::CarefulSender(zsock_t* output, zsock_t* pipe, size_t batch)
+    : m_output(output), m_pipe(pipe), m_batch(std::max((size_t)1, batch))
+{
+    m_queue.reserve(m_batch);
+}
+
+ptmp::internals::CarefulSender::~CarefulSender()
+{
+    clear();
+}
+
+void ptmp::internals::CarefulSender::clear()
+{
+    for (auto& one : m_queue) {
+        zmsg_destroy(&one.msg);
+        delete one.tps;
+    }
+    m_queue.clear();
+}
+
+int ptmp::internals::CarefulSender::wait_writable()
+{
+    if (zsock_events(m_output) & ZMQ_POLLOUT) {
+        return 0;
+    }
+    if (!m_blocking) {
+        ++m_stats.nblocked;
+        return 1;
+    }
+    const ptmp::data::real_time_t then = ptmp::data::now();
+    if (m_spin_ms) {
+        int ret = 0;
+        while (!(zsock_events(m_output) & ZMQ_POLLOUT)) {
+            zclock_sleep(m_spin_ms);
+            if (m_pipe and (zsock_events(m_pipe) & ZMQ_POLLIN)) {
+                ret = -1;
+                break;
+            }
+        }
+        ++m_stats.nblocked;
+        m_stats.tblocked += ptmp::data::now() - then;
+        return ret;
+    }
+    zmq_pollitem_t items[2] = {
+        { m_pipe ? zsock_resolve(m_pipe) : NULL, 0, ZMQ_POLLIN, 0 },
+        { zsock_resolve(m_output), 0, ZMQ_POLLOUT, 0 } };
+    const int nitems = m_pipe ? 2 : 1;
+    zmq_pollitem_t* pitems = m_pipe ? items : items+1;
+    int ret = 0;
+    while (true) {
+        int rc = zmq_poll(pitems, nitems, -1);
+        if (rc < 0 or (m_pipe and (items[0].revents & ZMQ_POLLIN))) {
+            ret = -1;
+            break;
+        }
+        if (items[1].revents & ZMQ_POLLOUT) {
+            break;
+        }
+    }
+    ++m_stats.nblocked;
+    m_stats.tblocked += ptmp::data::now() - then;
+    return ret;
+}
+
+int ptmp::internals::CarefulSender::flush()
+{
+    size_t nsent = 0;
+    for (; nsent<m_queue.size(); ++nsent) {
+        const int rc = wait_writable();
+        if (rc > 0) {
+            break;              // not blocking, hold the rest
+        }
+        if (rc < 0 or send_one(m_queue[nsent]) < 0) {
+            clear();
+            return -1;
+        }
+    }
+    m_queue.erase(m_queue.begin(), m_queue.begin() + nsent);
+    return 0;
+}
+
+int ptmp::internals::CarefulSender::send_one(pending_t& one)
+{
+    if (one.tps) {
+        ptmp::data::TPSet* tps = one.tps;
+        one.tps = nullptr;
+        return send_local(tps);
+    }
+    if (!m_local) {
+        materialize(&one.msg);
+    }
+    if (m_topic) {
+        add_topic(one.msg);
+    }
+    else {
+        strip_topic(one.msg);
+    }
+    // CZMQ 4 destroys the message whether or not it was sent.
+    if (zmsg_send(&one.msg, m_output) != 0) {
+        const int err = errno;
+        ++m_stats.ndropped;
+        zsys_warning("send failed: %s", zmq_strerror(err));
+        return err == ETERM ? -1 : 0;
+    }
+    ++m_stats.nsent;
+    return 0;
+}
+
+int ptmp::internals::CarefulSender::operator()(zmsg_t** msg)
+{
+    m_queue.push_back(pending_t{*msg, nullptr});
+    *msg = NULL;
+    if (m_queue.size() < m_batch) {
+        return 0;
+    }
+    return flush();
+}
+
+int ptmp::internals::CarefulSender::operator()(const ptmp::data::TPSet& tps, int schema)
+{
+    zmsg_t* msg = make_msg(tps, schema);
+    return (*this)(&msg);
+}
+
+int ptmp::internals::CarefulSender::operator()(ptmp::data::TPSet* tps)
+{
+    if (!m_local) {
+        zmsg_t* msg = make_msg(*tps);
+        delete tps;
+        return (*this)(&msg);
+    }
+    m_queue.push_back(pending_t{nullptr, tps});
+    return flush();
+}
+
+// The frame of a local message owns its TPSet.
+static void free_local_tpset(void* data, void* hint)
+{
+    delete (ptmp::data::TPSet*)data;
+}
+
+int ptmp::internals::CarefulSender::send_local(ptmp::data::TPSet* tps)
+{
+    // CZMQ can not make a frame which owns its data so the frames
+    // go out directly.  Receivers see an ordinary zmsg_t.  Once the
+    // first frame is queued the rest can not block.
+    msg_header_t hdr;
+    make_header(*tps, hdr);
+    hdr.reserved = local_token();
+    void* handle = zsock_resolve(m_output);
+    int rc = 0;
+    if (m_topic) {
+        const std::string top = msg_topic(tps->detid(),
+                                          is_watermark(*tps) ? topic_watermark : tps->chanbeg());
+        rc = zmq_send(handle, top.data(), top.size(), ZMQ_SNDMORE);
+    }
+    const int id = msg_schema_local;
+    if (rc >= 0) {
+        rc = zmq_send(handle, &id, sizeof(int), ZMQ_SNDMORE);
+    }
+    if (rc >= 0) {
+        rc = zmq_send(handle, &hdr, sizeof(msg_header_t), ZMQ_SNDMORE);
+    }
+    int err = 0;
+    if (rc >= 0) {
+        zmq_msg_t pay;
+        zmq_msg_init_data(&pay, tps, sizeof(ptmp::data::TPSet), free_local_tpset, NULL);
+        rc = zmq_msg_send(&pay, handle, 0);
+        if (rc < 0) {
+            err = errno;
+            zmq_msg_close(&pay);    // frees the TPSet
+        }
+    }
+    else {
+        err = errno;
+        delete tps;
+    }
+    if (rc < 0) {
+        ++m_stats.ndropped;
+        zsys_warning("local send failed: %s", zmq_strerror(err));
+        return err == ETERM ? -1 : 0;
+    }
+    ++m_stats.nsent;
+    return 0;
+}
+
 zmsg_t* ptmp::internals::read(FILE* fp)
 {
     size_t size=0;
@@ -268,3 +1140,74 @@ int ptmp::internals::write(FILE* fp, zmsg_t* msg)
     zchunk_destroy(&chunk);
     return rc;
 }
+
+ptmp::internals::StreamingQuantile::StreamingQuantile(double p)
+    : m_p(p)
+{
+    const double dn[5] = {0, p/2, p, (1+p)/2, 1};
+    for (int ind=0; ind<5; ++ind) {
+        m_q[ind] = 0;
+        m_n[ind] = ind;
+        m_dn[ind] = dn[ind];
+        m_np[ind] = 4*dn[ind];
+    }
+}
+
+void ptmp::internals::StreamingQuantile::add(double x)
+{
+    if (m_count < 5) {
+        m_q[m_count++] = x;
+        std::sort(m_q, m_q+m_count);
+        return;
+    }
+    ++m_count;
+
+    // find the cell holding x, stretching the extremes if needed
+    int k = 0;
+    if (x < m_q[0]) {
+        m_q[0] = x;
+    }
+    else if (x >= m_q[4]) {
+        m_q[4] = x;
+        k = 3;
+    }
+    else {
+        while (x >= m_q[k+1]) {
+            ++k;
+        }
+    }
+    for (int ind=k+1; ind<5; ++ind) {
+        m_n[ind] += 1;
+    }
+    for (int ind=0; ind<5; ++ind) {
+        m_np[ind] += m_dn[ind];
+    }
+
+    // move the middle markers toward their desired positions
+    for (int ind=1; ind<4; ++ind) {
+        const double d = m_np[ind] - m_n[ind];
+        if ((d >= 1 and m_n[ind+1] - m_n[ind] > 1) or
+            (d <= -1 and m_n[ind-1] - m_n[ind] < -1)) {
+            const int s = d > 0 ? 1 : -1;
+            const double np = m_n[ind+1], n = m_n[ind], nm = m_n[ind-1];
+            const double qp = m_q[ind+1], q = m_q[ind], qm = m_q[ind-1];
+            double qnew = q + s/(np-nm) * ((n-nm+s)*(qp-q)/(np-n) + (np-n-s)*(q-qm)/(n-nm));
+            if (qnew <= qm or qnew >= qp) { // parabolic fails, go linear
+                qnew = q + s*(m_q[ind+s]-q)/(m_n[ind+s]-n);
+            }
+            m_q[ind] = qnew;
+            m_n[ind] += s;
+        }
+    }
+}
+
+double ptmp::internals::StreamingQuantile::value() const
+{
+    if (m_count == 0) {
+        return 0;
+    }
+    if (m_count <= 5) {
+        return m_q[(size_t)(m_p*(m_count-1) + 0.5)];
+    }
+    return m_q[2];
+}
@@ -0,0 +1,338 @@
+#include "ptmp/recorder.h"
+#include "ptmp/archive.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace ptmp::internals;
+using json = nlohmann::json;
+
+// Writes are whole pages at page aligned file offsets, except when a
+// file is closed.
+static const size_t page_size = 4096;
+
+ptmp::internals::Recorder::Recorder(const json& config)
+{
+    if (!(config.count("ofile") and config["ofile"].is_string())) {
+        zsys_error("recorder: no ofile given");
+        throw std::runtime_error("recorder: no ofile given");
+    }
+    m_filename = config["ofile"];
+    m_format = "legacy";
+    if (config.count("format") and config["format"].is_string()) {
+        m_format = config["format"];
+    }
+    if (m_format != "legacy" and m_format != "archive") {
+        zsys_error("recorder: unknown format: %s", m_format.c_str());
+        throw std::runtime_error("recorder: unknown format");
+    }
+    if (config.count("block_kb") and config["block_kb"].is_number()) {
+        m_block_kb = config["block_kb"];
+    }
+    if (config.count("buffer_kb") and config["buffer_kb"].is_number()) {
+        const size_t kb = config["buffer_kb"];
+        m_buffer_bytes = std::max(page_size, kb*1024/page_size*page_size);
+    }
+    if (config.count("flush_ms") and config["flush_ms"].is_number()) {
+        m_flush_ms = config["flush_ms"];
+    }
+    if (config.count("rotate_mb") and config["rotate_mb"].is_number()) {
+        m_rotate_bytes = config["rotate_mb"].get<uint64_t>()*1024*1024;
+    }
+    if (config.count("rotate_s") and config["rotate_s"].is_number()) {
+        m_rotate_ms = config["rotate_s"].get<int64_t>()*1000;
+    }
+    size_t nslots = 65536;
+    if (config.count("queue") and config["queue"].is_number()) {
+        nslots = std::max(2, config["queue"].get<int>());
+    }
+    size_t pow2 = 1;
+    while (pow2 < nslots) {
+        pow2 <<= 1;
+    }
+    m_slots.resize(pow2, nullptr);
+    m_mask = pow2 - 1;
+
+    if (m_format == "legacy") {
+        if (posix_memalign((void**)&m_buf, page_size, m_buffer_bytes)) {
+            zsys_error("recorder: failed to allocate %ld bytes", m_buffer_bytes);
+            throw std::runtime_error("recorder: failed to allocate buffer");
+        }
+    }
+    open_file();                // in caller so errors throw here
+    m_thread = std::thread(&Recorder::run, this);
+}
+
+ptmp::internals::Recorder::~Recorder()
+{
+    m_stop = true;
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    close_file();
+    free(m_buf);
+    if (m_dropped) {
+        zsys_warning("recorder: dropped %ld messages for %s",
+                     (uint64_t)m_dropped, m_filename.c_str());
+    }
+}
+
+bool ptmp::internals::Recorder::push(zmsg_t** msg)
+{
+    const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    const uint64_t head = m_head.load(std::memory_order_acquire);
+    const uint64_t depth = tail - head;
+    if (depth > m_mask) {
+        ++m_dropped;
+        return false;
+    }
+    if (depth >= m_depth_max) {
+        m_depth_max = depth + 1;
+    }
+    m_slots[tail & m_mask] = *msg;
+    *msg = NULL;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+json ptmp::internals::Recorder::metrics()
+{
+    const uint64_t depth = m_tail.load() - m_head.load();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    json j{
+        {"file", m_current},
+        {"messages", m_stats.nmsgs},
+        {"bytes", m_stats.nbytes},
+        {"files", m_stats.nfiles},
+        {"queue", {
+                {"depth", depth},
+                {"max", m_depth_max.exchange(depth)},
+                {"dropped", (uint64_t)m_dropped}}},
+        {"write", {
+                {"count", m_stats.nwrites},
+                {"failed", m_stats.nfailed},
+                {"p50_us", m_stats.write_us_50.value()},
+                {"p99_us", m_stats.write_us_99.value()},
+                {"max_us", m_stats.write_us_max}}}
+    };
+    m_stats = stats_t();
+    return j;
+}
+
+std::string ptmp::internals::Recorder::file_name() const
+{
+    if (!m_rotate_bytes and !m_rotate_ms) {
+        return m_filename;
+    }
+    char seq[16];
+    snprintf(seq, sizeof(seq), "-%04d", m_ifile);
+    size_t dot = m_filename.rfind('.');
+    const size_t slash = m_filename.rfind('/');
+    if (dot == std::string::npos or (slash != std::string::npos and dot < slash)) {
+        dot = m_filename.size();
+    }
+    return m_filename.substr(0, dot) + seq + m_filename.substr(dot);
+}
+
+void ptmp::internals::Recorder::open_file()
+{
+    const std::string fname = file_name();
+    if (m_format == "archive") {
+        m_archive = new ArchiveWriter(fname, m_block_kb);
+    }
+    else {
+        m_fd = ::open(fname.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (m_fd < 0) {
+            zsys_error("recorder: failed to open %s: %s", fname.c_str(), strerror(errno));
+            throw std::runtime_error("recorder: failed to open file");
+        }
+    }
+    ++m_ifile;
+    m_file_bytes = 0;
+    m_written = 0;
+    m_ends.clear();
+    m_opened = zclock_mono();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_current = fname;
+    ++m_stats.nfiles;
+}
+
+void ptmp::internals::Recorder::close_file()
+{
+    if (m_archive) {
+        m_archive->close();     // writes the index, logs any error
+        delete m_archive;
+        m_archive = nullptr;
+    }
+    if (m_fd >= 0) {
+        write_out(m_fill);
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// Write the first size bytes of the buffer and keep the rest.
+// Messages are counted as written once their last byte is.  If the
+// write fails the file is given up and all messages in the buffer
+// are dropped.
+void ptmp::internals::Recorder::write_out(size_t size)
+{
+    if (!size) {
+        return;
+    }
+    if (m_fd < 0) {             // failed part way through a message
+        memmove(m_buf, m_buf + size, m_fill - size);
+        m_fill -= size;
+        return;
+    }
+    const int64_t t0 = zclock_usecs();
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = ::write(m_fd, m_buf + done, size - done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            zsys_error("recorder: write to %s failed, dropping %ld messages: %s",
+                       m_current.c_str(), m_ends.size(), strerror(errno));
+            m_dropped += m_ends.size();
+            m_ends.clear();
+            m_fill = 0;
+            ::close(m_fd);
+            m_fd = -1;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_stats.nfailed;
+            return;
+        }
+        done += rc;
+    }
+    add_write(zclock_usecs() - t0);
+    memmove(m_buf, m_buf + size, m_fill - size);
+    m_fill -= size;
+    m_written += size;
+    m_last_write = zclock_mono();
+    uint64_t nmsgs = 0;
+    while (!m_ends.empty() and m_ends.front() <= m_written) {
+        m_ends.pop_front();
+        ++nmsgs;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.nmsgs += nmsgs;
+    m_stats.nbytes += size;
+}
+
+void ptmp::internals::Recorder::add_write(double dt_us)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_stats.nwrites;
+    m_stats.write_us_50.add(dt_us);
+    m_stats.write_us_99.add(dt_us);
+    m_stats.write_us_max = std::max(m_stats.write_us_max, dt_us);
+}
+
+void ptmp::internals::Recorder::append(const void* data, size_t size)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+    while (size) {
+        const size_t n = std::min(size, m_buffer_bytes - m_fill);
+        memcpy(m_buf + m_fill, ptr, n);
+        m_fill += n;
+        ptr += n;
+        size -= n;
+        if (m_fill == m_buffer_bytes) {
+            write_out(m_fill);
+        }
+    }
+}
+
+void ptmp::internals::Recorder::rotate()
+{
+    close_file();
+    try {
+        open_file();
+    }
+    catch (const std::runtime_error& err) {
+        zsys_error("recorder: no more output: %s", err.what());
+    }
+}
+
+void ptmp::internals::Recorder::write_msg(zmsg_t* msg)
+{
+    if (m_fd < 0 and !m_archive) {
+        ++m_dropped;            // failed to open a new file
+        zmsg_destroy(&msg);
+        return;
+    }
+    materialize(&msg);
+    if (m_archive) {
+        const uint64_t before = m_archive->nbytes();
+        const int64_t t0 = zclock_usecs();
+        const bool ok = m_archive->write(msg);
+        if (m_archive->nbytes() != before) { // a block was written
+            add_write(zclock_usecs() - t0);
+        }
+        const size_t nbytes = zmsg_content_size(msg);
+        zmsg_destroy(&msg);
+        if (!ok) {
+            ++m_dropped;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_stats.nfailed;
+            return;
+        }
+        m_file_bytes += nbytes;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_stats.nmsgs;
+        m_stats.nbytes += nbytes;
+        return;
+    }
+
+    // Same as ptmp::internals::write().  Counted by write_out().
+    zframe_t* frame = zmsg_encode(msg);
+    zmsg_destroy(&msg);
+    const size_t size = zframe_size(frame);
+    append(&size, sizeof(size_t));
+    append(zframe_data(frame), size);
+    zframe_destroy(&frame);
+    if (m_fd < 0) {
+        ++m_dropped;            // the file failed while appending
+        return;
+    }
+    m_file_bytes += sizeof(size_t) + size;
+    m_ends.push_back(m_file_bytes);
+}
+
+void ptmp::internals::Recorder::run()
+{
+    set_thread_name("recorder");
+    m_last_write = zclock_mono();
+    while (true) {
+        const uint64_t head = m_head.load(std::memory_order_relaxed);
+        const uint64_t tail = m_tail.load(std::memory_order_acquire);
+        for (uint64_t ind = head; ind != tail; ++ind) {
+            write_msg(m_slots[ind & m_mask]);
+            m_head.store(ind + 1, std::memory_order_release);
+            if (m_rotate_bytes and m_file_bytes >= m_rotate_bytes) {
+                rotate();
+            }
+        }
+        const int64_t now = zclock_mono();
+        if (m_rotate_ms and m_file_bytes and now - m_opened >= m_rotate_ms) {
+            rotate();
+        }
+        if (head != tail) {
+            continue;
+        }
+        if (m_stop) {
+            break;
+        }
+        // Idle.  Flush whole pages so readers see recent data.
+        if (m_fd >= 0 and now - m_last_write >= m_flush_ms) {
+            write_out(m_fill / page_size * page_size);
+            m_last_write = now;
+        }
+        microsleep(1000);
+    }
+}
@@ -0,0 +1,602 @@
+// Shared memory message ring and the bridge between it and ZeroMQ
+// sockets which gives the "shm://" socket address.  See docs/shm.org.
+
+#include "ptmp/shm.h"
+#include "ptmp/internals.h"
+#include "json.hpp"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+using ptmp::internals::ShmRing;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 and ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory ring needs address-free atomics");
+
+static const uint64_t shm_magic = 0x676e697270746d70; // "ptmpring"
+static const uint32_t shm_version = 1;
+
+// The segment starts with this header.  The ring of records follows.
+// Each of the cursors counts bytes since the start and only grows.
+struct ShmRing::header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t mode;
+    uint64_t capacity;
+    // Set by the creator once the header is filled.
+    std::atomic<uint32_t> ready;
+    // The pid of the producer, 0 if none.
+    std::atomic<int32_t> producer;
+    // End of the space the producer is writing, for broadcast
+    // consumers to detect being overwritten.
+    alignas(64) std::atomic<uint64_t> reserve;
+    // End of the records published by the producer.
+    alignas(64) std::atomic<uint64_t> head;
+    // Start of the next record for a queue consumer to claim.
+    alignas(64) std::atomic<uint64_t> claim;
+    // Start of the oldest record not yet freed by the producer.
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+// A record is this header followed by a frame count and each frame
+// as a length and its bytes, padded to a multiple of 8 bytes.  A
+// record which would run past the end of the ring is instead
+// preceded by a padding record which fills to the end.
+namespace {
+    struct record_t {
+        uint32_t size;
+        std::atomic<uint32_t> state;
+    };
+    const uint32_t record_pad = 0x80000000;
+    const uint32_t record_done = 1;
+}
+
+ShmRing::header_t* ShmRing::hdr() const
+{
+    return (header_t*)m_base;
+}
+
+uint8_t* ShmRing::at(uint64_t pos) const
+{
+    return (uint8_t*)m_base + sizeof(header_t) + (pos & (m_capacity-1));
+}
+
+ShmRing::ShmRing(const std::string& name, int fd, void* base, size_t size, bool owner)
+    : m_name(name), m_fd(fd), m_base(base), m_size(size)
+    , m_capacity(size - sizeof(header_t)), m_owner(owner)
+{
+}
+
+ShmRing* ShmRing::create(const std::string& name, ring_mode_t mode, size_t capacity)
+{
+    size_t cap = 4096;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    const std::string path = "/" + name;
+    shm_unlink(path.c_str());   // replace any left by a dead process
+    int fd = shm_open(path.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600);
+    if (fd < 0) {
+        zsys_error("shm: failed to create %s: %s", path.c_str(), strerror(errno));
+        throw std::runtime_error("shm: failed to create " + path);
+    }
+    const size_t size = sizeof(header_t) + cap;
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        base = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        zsys_error("shm: failed to map %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(path.c_str());
+        throw std::runtime_error("shm: failed to map " + path);
+    }
+
+    // The new segment is zero filled so the cursors start at zero.
+    header_t* h = (header_t*)base;
+    h->magic = shm_magic;
+    h->version = shm_version;
+    h->mode = mode;
+    h->capacity = cap;
+    h->ready.store(1, std::memory_order_release);
+    return new ShmRing(name, fd, base, size, true);
+}
+
+ShmRing* ShmRing::open(const std::string& name, ring_mode_t mode)
+{
+    const std::string path = "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return nullptr;
+        }
+        zsys_error("shm: failed to open %s: %s", path.c_str(), strerror(errno));
+        throw std::runtime_error("shm: failed to open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 or (size_t)st.st_size < sizeof(header_t)) {
+        close(fd);              // not yet sized by its creator
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    void* base = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        zsys_error("shm: failed to map %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        throw std::runtime_error("shm: failed to map " + path);
+    }
+    header_t* h = (header_t*)base;
+    if (h->ready.load(std::memory_order_acquire) != 1) {
+        munmap(base, size);
+        close(fd);
+        return nullptr;
+    }
+    if (h->magic != shm_magic or h->version != shm_version
+        or sizeof(header_t) + h->capacity != size) {
+        munmap(base, size);
+        close(fd);
+        zsys_error("shm: %s is not a ptmp ring", path.c_str());
+        throw std::runtime_error("shm: not a ptmp ring: " + path);
+    }
+    if (h->mode != (uint32_t)mode) {
+        munmap(base, size);
+        close(fd);
+        zsys_error("shm: %s mixes PUSH/PULL and PUB/SUB", path.c_str());
+        throw std::runtime_error("shm: socket types do not match for " + path);
+    }
+    ShmRing* ring = new ShmRing(name, fd, base, size, false);
+    // A broadcast consumer sees only what is produced after it
+    // joins, as for SUB.
+    ring->m_cursor = h->head.load(std::memory_order_acquire);
+    return ring;
+}
+
+ShmRing::~ShmRing()
+{
+    if (m_producer) {
+        hdr()->producer.store(0, std::memory_order_release);
+    }
+    const bool unlink = m_owner and !stale();
+    munmap(m_base, m_size);
+    close(m_fd);
+    if (unlink) {
+        shm_unlink(("/" + m_name).c_str());
+    }
+}
+
+bool ShmRing::attach_producer()
+{
+    header_t* h = hdr();
+    const int32_t pid = getpid();
+    int32_t cur = 0;
+    while (!h->producer.compare_exchange_strong(cur, pid)) {
+        if (cur == pid or kill(cur, 0) == 0 or errno != ESRCH) {
+            return false;
+        }
+        // The previous producer died.  Its unpublished record, if
+        // any, is simply overwritten.
+    }
+    m_producer = true;
+    return true;
+}
+
+int ShmRing::write(zmsg_t* msg)
+{
+    header_t* h = hdr();
+
+    size_t need = sizeof(record_t) + sizeof(uint32_t);
+    for (zframe_t* frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        need += sizeof(uint32_t) + zframe_size(frame);
+    }
+    need = (need + 7) & ~(size_t)7;
+    if (need > m_capacity/2) {
+        return -1;
+    }
+
+    uint64_t pos = h->head.load(std::memory_order_relaxed);
+    const uint64_t to_end = m_capacity - (pos & (m_capacity-1));
+    const uint64_t pad = to_end < need ? to_end : 0;
+    const uint64_t end = pos + pad + need;
+
+    if (h->mode == queue) {
+        // Free records which consumers are done with until there
+        // is room.
+        uint64_t tail = h->tail.load(std::memory_order_relaxed);
+        while (end - tail > m_capacity) {
+            record_t* rec = (record_t*)at(tail);
+            if (rec->state.load(std::memory_order_acquire) != record_done) {
+                h->tail.store(tail, std::memory_order_relaxed);
+                return 0;
+            }
+            tail += rec->size & ~record_pad;
+        }
+        h->tail.store(tail, std::memory_order_relaxed);
+    }
+    else {
+        // Announce what is about to be overwritten.
+        h->reserve.store(end, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    if (pad) {
+        record_t* rec = (record_t*)at(pos);
+        rec->size = pad | record_pad;
+        rec->state.store(0, std::memory_order_relaxed);
+        pos += pad;
+    }
+    record_t* rec = (record_t*)at(pos);
+    rec->size = need;
+    rec->state.store(0, std::memory_order_relaxed);
+    uint8_t* ptr = (uint8_t*)(rec+1);
+    const uint32_t nframes = zmsg_size(msg);
+    memcpy(ptr, &nframes, sizeof(uint32_t));
+    ptr += sizeof(uint32_t);
+    for (zframe_t* frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+        const uint32_t len = zframe_size(frame);
+        memcpy(ptr, &len, sizeof(uint32_t));
+        ptr += sizeof(uint32_t);
+        memcpy(ptr, zframe_data(frame), len);
+        ptr += len;
+    }
+    h->head.store(end, std::memory_order_release);
+    return 1;
+}
+
+// Copy a record's frames into a new message.  Return nullptr if the
+// record is malformed, which a broadcast consumer may see if it was
+// overwritten while being read.
+static zmsg_t* unpack(const uint8_t* rec, uint32_t size)
+{
+    const uint8_t* ptr = rec + sizeof(record_t);
+    const uint8_t* end = rec + size;
+    if (ptr + sizeof(uint32_t) > end) {
+        return nullptr;
+    }
+    uint32_t nframes = 0;
+    memcpy(&nframes, ptr, sizeof(uint32_t));
+    ptr += sizeof(uint32_t);
+    zmsg_t* msg = zmsg_new();
+    for (uint32_t ind=0; ind<nframes; ++ind) {
+        uint32_t len = 0;
+        if (ptr + sizeof(uint32_t) > end) {
+            zmsg_destroy(&msg);
+            return nullptr;
+        }
+        memcpy(&len, ptr, sizeof(uint32_t));
+        ptr += sizeof(uint32_t);
+        if (len > (size_t)(end - ptr)) {
+            zmsg_destroy(&msg);
+            return nullptr;
+        }
+        zmsg_addmem(msg, ptr, len);
+        ptr += len;
+    }
+    return msg;
+}
+
+zmsg_t* ShmRing::read()
+{
+    header_t* h = hdr();
+
+    if (h->mode == queue) {
+        while (true) {
+            uint64_t pos = h->claim.load(std::memory_order_acquire);
+            const uint64_t head = h->head.load(std::memory_order_acquire);
+            if (pos >= head) {
+                return nullptr;
+            }
+            // The size is only trusted if the claim succeeds, which
+            // means no other consumer took and freed this record.
+            record_t* rec = (record_t*)at(pos);
+            const uint32_t size = rec->size;
+            if (!h->claim.compare_exchange_weak(pos, pos + (size & ~record_pad),
+                                                std::memory_order_acq_rel)) {
+                continue;
+            }
+            zmsg_t* msg = nullptr;
+            if (!(size & record_pad)) {
+                msg = unpack((const uint8_t*)rec, size);
+            }
+            rec->state.store(record_done, std::memory_order_release);
+            if (msg) {
+                return msg;
+            }
+        }
+    }
+
+    while (true) {
+        const uint64_t head = h->head.load(std::memory_order_acquire);
+        if (m_cursor >= head) {
+            return nullptr;
+        }
+        if (head - m_cursor > m_capacity) {
+            m_cursor = head;    // lapped, skip to the newest
+            ++m_lost;
+            return nullptr;
+        }
+        record_t* rec = (record_t*)at(m_cursor);
+        const uint32_t size = rec->size;
+        const uint32_t len = size & ~record_pad;
+        zmsg_t* msg = nullptr;
+        const bool sane = len >= sizeof(record_t) and len % 8 == 0
+            and len <= m_capacity - (m_cursor & (m_capacity-1));
+        if (sane and !(size & record_pad)) {
+            msg = unpack((const uint8_t*)rec, size);
+        }
+        // Discard what was read if the producer has since reached it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!sane or h->reserve.load(std::memory_order_relaxed) > m_cursor + m_capacity) {
+            zmsg_destroy(&msg);
+            m_cursor = h->head.load(std::memory_order_acquire);
+            ++m_lost;
+            return nullptr;
+        }
+        m_cursor += len;
+        if (msg) {
+            return msg;
+        }
+    }
+}
+
+bool ShmRing::stale() const
+{
+    struct stat mine, now;
+    if (fstat(m_fd, &mine) != 0) {
+        return true;
+    }
+    int fd = shm_open(("/" + m_name).c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return true;
+    }
+    const bool same = fstat(fd, &now) == 0
+        and now.st_dev == mine.st_dev and now.st_ino == mine.st_ino;
+    close(fd);
+    return !same;
+}
+
+
+// The bridge runs one thread per shm address and direction in a
+// process.  It moves messages between the ring and an inproc socket
+// to which the agent's own sockets connect.  Thus agents keep using
+// plain zsock_t's and the ZeroMQ socket semantics apply within the
+// process while between processes the ring avoids the kernel.
+namespace {
+
+    struct shm_bridge_t {
+        std::string name, inproc;
+        ShmRing::ring_mode_t mode;
+        bool writer{false}, bind{false};
+        zsock_t* sock{nullptr};
+        std::unique_ptr<ShmRing> ring;
+        std::thread thread;
+        std::atomic<bool> stop{false};
+    };
+
+    std::mutex g_bridges_mutex;
+    std::unordered_map<std::string, std::unique_ptr<shm_bridge_t> > g_bridges;
+
+    // Busy poll briefly as more data usually follows soon, then
+    // sleep for increasing times up to 1 ms.
+    struct backoff_t {
+        int count{0};
+        void reset() { count = 0; }
+        void operator()() {
+            if (++count < 64) {
+                return;
+            }
+            ptmp::internals::microsleep(1 << std::min(10, count-64));
+        }
+    };
+
+    // Open the ring if not bound here and reopen it if its creator
+    // restarted.  Return true if there is a ring.
+    bool attach(shm_bridge_t* br) {
+        if (br->ring and !br->bind and br->ring->stale()) {
+            zsys_info("shm %s: segment was replaced, reopening", br->name.c_str());
+            br->ring.reset();
+        }
+        if (br->ring) {
+            return true;
+        }
+        br->ring.reset(ShmRing::open(br->name, br->mode));
+        if (br->ring and br->writer and !br->ring->attach_producer()) {
+            zsys_warning("shm %s: another process is producing", br->name.c_str());
+            br->ring.reset();
+        }
+        return (bool)br->ring;
+    }
+
+    void bridge_writer(shm_bridge_t* br) {
+        ptmp::internals::set_thread_name("shm-writer");
+        zpoller_t* poller = zpoller_new(br->sock, NULL);
+        zmsg_t* pending = nullptr;
+        backoff_t backoff;
+        int64_t next_check = 0;
+        while (!br->stop) {
+            const int64_t now = zclock_mono();
+            if (!br->ring or now >= next_check) {
+                next_check = now + 1000;
+                if (!attach(br)) {
+                    zclock_sleep(10);
+                    continue;
+                }
+            }
+            if (!pending) {
+                if (!zpoller_wait(poller, 100)) {
+                    if (zpoller_terminated(poller)) {
+                        break;
+                    }
+                    continue;
+                }
+                pending = zmsg_recv(br->sock);
+                if (!pending) {
+                    break;
+                }
+                backoff.reset();
+            }
+            const int rc = br->ring->write(pending);
+            if (rc > 0) {
+                zmsg_destroy(&pending);
+                continue;
+            }
+            if (rc < 0) {
+                zsys_warning("shm %s: dropping message of %ld bytes, too large for ring of %ld",
+                             br->name.c_str(), zmsg_content_size(pending), br->ring->capacity());
+                zmsg_destroy(&pending);
+                continue;
+            }
+            backoff();          // full, wait for consumers
+        }
+        zmsg_destroy(&pending);
+        zpoller_destroy(&poller);
+        zsock_destroy(&br->sock);
+        br->ring.reset();
+    }
+
+    void bridge_reader(shm_bridge_t* br) {
+        ptmp::internals::set_thread_name("shm-reader");
+        zmsg_t* pending = nullptr;
+        backoff_t backoff;
+        int64_t next_check = 0;
+        uint64_t lost = 0;
+        while (!br->stop) {
+            if (!br->ring) {
+                if (!attach(br)) {
+                    zclock_sleep(10);
+                    continue;
+                }
+                lost = 0;
+            }
+            if (!pending) {
+                pending = br->ring->read();
+                if (br->ring->lost() != lost) {
+                    lost = br->ring->lost();
+                    zsys_warning("shm %s: fell behind the producer %ld times",
+                                 br->name.c_str(), lost);
+                }
+                if (!pending) {
+                    const int64_t now = zclock_mono();
+                    if (now >= next_check) { // only when idle
+                        next_check = now + 1000;
+                        attach(br);
+                    }
+                    backoff();
+                    continue;
+                }
+                backoff.reset();
+            }
+            if (zsock_events(br->sock) & ZMQ_POLLOUT) {
+                zmsg_send(&pending, br->sock);
+            }
+            else {
+                backoff();      // no peer or peers are full
+            }
+        }
+        zmsg_destroy(&pending);
+        zsock_destroy(&br->sock);
+        br->ring.reset();
+    }
+
+    // Bridges live as long as the process.  This runs at exit ahead
+    // of CZMQ's own shutdown as it is registered after it.
+    void stop_bridges() {
+        std::lock_guard<std::mutex> lock(g_bridges_mutex);
+        for (auto& one : g_bridges) {
+            one.second->stop = true;
+        }
+        for (auto& one : g_bridges) {
+            one.second->thread.join();
+        }
+        g_bridges.clear();
+    }
+}
+
+std::string ptmp::internals::shm_bridge(const std::string& addr, int socktype, bool bind,
+                                        const std::string& jsockstr)
+{
+    const std::string name = addr.substr(std::string("shm://").size());
+    if (name.empty() or name.find('/') != std::string::npos) {
+        zsys_error("shm: bad address: %s", addr.c_str());
+        throw std::runtime_error("shm: bad address: " + addr);
+    }
+
+    bool writer = false;
+    ShmRing::ring_mode_t mode = ShmRing::queue;
+    int btype = 0;
+    switch (socktype) {
+    case ZMQ_PUSH: writer = true;  mode = ShmRing::queue;     btype = ZMQ_PULL; break;
+    case ZMQ_PUB:  writer = true;  mode = ShmRing::broadcast; btype = ZMQ_SUB;  break;
+    case ZMQ_PULL: writer = false; mode = ShmRing::queue;     btype = ZMQ_PUSH; break;
+    case ZMQ_SUB:  writer = false; mode = ShmRing::broadcast; btype = ZMQ_PUB;  break;
+    default:
+        zsys_error("shm: %s needs a PUSH, PULL, PUB or SUB socket", addr.c_str());
+        throw std::runtime_error("shm: unsupported socket type for " + addr);
+    }
+    const std::string inproc = "inproc://ptmp-shm-" + name + (writer ? "-producer" : "-consumer");
+
+    std::lock_guard<std::mutex> lock(g_bridges_mutex);
+    if (g_bridges.count(inproc)) {
+        return inproc;          // another socket in this process shares it
+    }
+
+    auto jsock = json::parse(jsockstr);
+    int hwm = 1000;
+    if (jsock["hwm"].is_number()) {
+        hwm = jsock["hwm"];
+    }
+    size_t shm_kb = 16384;
+    if (jsock["shm_kb"].is_number()) {
+        shm_kb = jsock["shm_kb"];
+    }
+
+    std::unique_ptr<shm_bridge_t> br(new shm_bridge_t);
+    br->name = name;
+    br->inproc = inproc;
+    br->mode = mode;
+    br->writer = writer;
+    br->bind = bind;
+    if (bind) {
+        br->ring.reset(ShmRing::create(name, mode, 1024*shm_kb));
+        if (writer and !br->ring->attach_producer()) {
+            zsys_error("shm %s: another process is producing", name.c_str());
+            br->ring.reset();
+            throw std::runtime_error("shm: another process is producing to " + addr);
+        }
+    }
+    br->sock = zsock_new(btype);
+    zsock_set_sndhwm(br->sock, hwm);
+    zsock_set_rcvhwm(br->sock, hwm);
+    if (btype == ZMQ_SUB) {
+        zsock_set_subscribe(br->sock, "");
+    }
+    if (zsock_bind(br->sock, inproc.c_str(), NULL) < 0) {
+        zsys_error("shm: failed to bind %s: %s", inproc.c_str(), zmq_strerror(errno));
+        zsock_destroy(&br->sock);
+        throw std::runtime_error("shm: failed to bind " + inproc);
+    }
+
+    static bool registered = false;
+    if (!registered) {
+        std::atexit(stop_bridges);
+        registered = true;
+    }
+    br->thread = std::thread(writer ? bridge_writer : bridge_reader, br.get());
+    zsys_info("shm %s: %s %s via %s", name.c_str(), writer ? "producer" : "consumer",
+              bind ? "bind" : "connect", inproc.c_str());
+    g_bridges[inproc] = std::move(br);
+    return inproc;
+}
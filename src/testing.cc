@@ -36,6 +36,14 @@ void ptmp::testing::set_count_clock(ptmp::data::TPSet& tps)
     tps.set_created(now);
 }
 
+json ptmp::testing::socket(const std::string& type, const std::string& bc,
+                           const std::string& addr)
+{
+    json cfg;
+    cfg["socket"]["type"] = type;
+    cfg["socket"][bc].push_back(addr);
+    return cfg;
+}
 
 ptmp::testing::make_tps_t::make_tps_t(int ntps, int vartps)
     : normal_dist(ntps, vartps)
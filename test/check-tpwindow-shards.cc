@@ -0,0 +1,163 @@
+// Measure the throughput of a TPWindow with one shard and with more.
+// The input TPSets are made and serialized before timing starts and
+// sent as fast as the window takes them.  The output is counted from
+// its message headers, without parsing, so that the window and not
+// either end is what limits the rate.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "json.hpp"
+
+#include "CLI11.hpp"
+
+#include <cstdio>
+#include <thread>
+#include <random>
+#include <vector>
+
+struct result_t {
+    int nshards;
+    size_t ntps;
+    double seconds;
+};
+
+// TPSets which each cover dt ticks, in order, with TPs on random
+// channels at random times within their TPSet.
+std::vector<zmsg_t*> make_input(int nsets, int ntps, int nchans,
+                                ptmp::data::data_time_t dt,
+                                ptmp::data::data_time_t& tend)
+{
+    std::default_random_engine rng(1234);
+    std::uniform_int_distribution<int> chan(0, nchans-1);
+    std::uniform_int_distribution<int> tick(0, dt-1);
+
+    std::vector<zmsg_t*> msgs;
+    ptmp::data::data_time_t tbeg = 1000000;
+    for (int count=0; count<nsets; ++count) {
+        ptmp::data::TPSet tps;
+        tps.set_count(count);
+        tps.set_detid(1);
+        tps.set_created(ptmp::data::now());
+        tps.set_tstart(tbeg);
+        tps.set_tspan(dt);
+        for (int ind=0; ind<ntps; ++ind) {
+            auto* tp = tps.add_tps();
+            tp->set_channel(chan(rng));
+            tp->set_tstart(tbeg + tick(rng));
+            tp->set_tspan(10);
+            tp->set_adcsum(100 + ind);
+        }
+        msgs.push_back(ptmp::internals::make_msg(tps));
+        tbeg += dt;
+    }
+    tend = tbeg;
+    return msgs;
+}
+
+result_t run_one(int nshards, const std::vector<zmsg_t*>& msgs, size_t ntps,
+                 ptmp::data::data_time_t tend, const nlohmann::json& base)
+{
+    const std::string iaddr = "inproc://check-tpwindow-shards-in-" + std::to_string(nshards);
+    const std::string oaddr = "inproc://check-tpwindow-shards-out-" + std::to_string(nshards);
+
+    nlohmann::json window_config = base;
+    window_config["input"]["socket"]["type"]="PULL";
+    window_config["input"]["socket"]["connect"].push_back(iaddr);
+    window_config["output"]["socket"]["type"]="PUSH";
+    window_config["output"]["socket"]["bind"].push_back(oaddr);
+    window_config["shards"] = nshards;
+    window_config["schema"] = ptmp::internals::msg_schema_v2;
+
+    zsock_t* push = zsock_new_push(("@" + iaddr).c_str());
+    result_t res{nshards, 0, 0};
+    {
+        ptmp::TPWindow window(window_config.dump());
+        zsock_t* pull = zsock_new_pull((">" + oaddr).c_str());
+        zsock_set_rcvtimeo(pull, 5000);
+        zclock_sleep(300);
+
+        const int64_t start = zclock_usecs();
+        std::thread sender([&]() {
+                for (auto one : msgs) {
+                    zmsg_t* msg = zmsg_dup(one);
+                    zmsg_send(&msg, push);
+                }
+                // let the window send everything it holds
+                ptmp::data::TPSet wm;
+                ptmp::internals::make_watermark(wm, 1, tend + 1000*window_config["tspan"].get<int>());
+                zmsg_t* msg = ptmp::internals::make_msg(wm);
+                zmsg_send(&msg, push);
+            });
+
+        while (res.ntps < ntps) {
+            zmsg_t* msg = zmsg_recv(pull);
+            if (!msg) {
+                zsys_warning("%d shards: timeout after %ld of %ld TPs",
+                             nshards, res.ntps, ntps);
+                break;
+            }
+            ptmp::internals::msg_header_t hdr;
+            if (ptmp::internals::msg_header(msg, hdr)) {
+                res.ntps += hdr.ntps;
+            }
+            zmsg_destroy(&msg);
+        }
+        res.seconds = (zclock_usecs() - start)*1e-6;
+        sender.join();
+        zsock_destroy(&pull);
+    }
+    zsock_destroy(&push);
+    return res;
+}
+
+int main(int argc, char* argv[])
+{
+    zsys_init();
+
+    CLI::App app{"Measure TPWindow throughput vs number of shards"};
+
+    int nsets=20000;
+    app.add_option("-n", nsets, "number of input TPSets", true);
+    int ntps=200;
+    app.add_option("-p", ntps, "number of TPs per input TPSet", true);
+    int nchans=2560;
+    app.add_option("-c", nchans, "number of channels", true);
+    int tspan=2500;
+    app.add_option("-w", tspan, "window span in 50MHz ticks", true);
+    int tbuf=25000;
+    app.add_option("-b", tbuf, "window buffer in 50MHz ticks", true);
+    int dt=500;
+    app.add_option("-d", dt, "ticks covered by each input TPSet", true);
+    std::vector<int> shards{2, 4};
+    app.add_option("-S", shards, "shard counts to compare against 1", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    nlohmann::json base;
+    base["tspan"] = tspan;
+    base["tbuf"] = tbuf;
+
+    ptmp::data::data_time_t tend = 0;
+    auto msgs = make_input(nsets, ntps, nchans, dt, tend);
+    const size_t total = (size_t)nsets * ntps;
+
+    std::vector<result_t> results;
+    results.push_back(run_one(1, msgs, total, tend, base));
+    for (int n : shards) {
+        results.push_back(run_one(n, msgs, total, tend, base));
+    }
+    for (auto& msg : msgs) {
+        zmsg_destroy(&msg);
+    }
+
+    printf("# %d TPSets of %d TPs on %d channels, tspan %d, tbuf %d\n",
+           nsets, ntps, nchans, tspan, tbuf);
+    printf("%8s %10s %10s %12s %8s\n", "shards", "ntps", "seconds", "tps_per_s", "speedup");
+    const double base_rate = results[0].ntps / results[0].seconds;
+    for (const auto& r : results) {
+        const double rate = r.ntps / r.seconds;
+        printf("%8d %10ld %10.3f %12.0f %8.2f\n",
+               r.nshards, r.ntps, r.seconds, rate, rate / base_rate);
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Measure the real time latency through a TPZipper for a range of
+// input rates.  Each input sends at the same rate with tstart derived
+// from a common clock so the zipper can release messages as soon as
+// all inputs report and the latency measures the zipper's own
+// overhead rather than its sync time.  Each rate is also run with
+// the zipper's legacy_wait as a baseline of the former polling.
+
+#include "ptmp/api.h"
+#include "json.hpp"
+
+#include "CLI11.hpp"
+
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+
+std::atomic<bool> goFlag{false};
+
+void send_loop(int index, int n_messages, double rate_hz, std::string addr)
+{
+    nlohmann::json sender_config;
+    sender_config["socket"]["type"]="PUSH";
+    sender_config["socket"]["bind"].push_back(addr);
+    ptmp::TPSender sender(sender_config.dump());
+
+    while(!goFlag.load()) ; // spin until told to start
+
+    const auto period = std::chrono::nanoseconds((int64_t)(1e9/rate_hz));
+    auto next = std::chrono::steady_clock::now();
+    ptmp::data::TPSet tpset;
+    tpset.set_detid(100*(1+index));
+    for (int count=0; count<n_messages; ++count) {
+        std::this_thread::sleep_until(next);
+        next += period;
+        const ptmp::data::real_time_t now = ptmp::data::now();
+        tpset.set_count(count);
+        tpset.set_created(now);
+        tpset.set_tstart(now*50);
+        sender(tpset);
+    }
+}
+
+struct result_t {
+    double rate, mean, p50, p99, max;
+    size_t n;
+};
+
+result_t recv_loop(int n_messages, std::string addr)
+{
+    nlohmann::json recver_config;
+    recver_config["socket"]["type"]="PULL";
+    recver_config["socket"]["connect"].push_back(addr);
+    ptmp::TPReceiver recver(recver_config.dump());
+
+    std::vector<ptmp::data::real_time_t> lats;
+    lats.reserve(n_messages);
+    for (int ind=0; ind<n_messages; ++ind) {
+        ptmp::data::TPSet tpset;
+        bool ok = recver(tpset, 5000);
+        if (!ok) {
+            zsys_warning("timeout after %d of %d", ind, n_messages);
+            break;
+        }
+        lats.push_back(ptmp::data::now() - tpset.created());
+    }
+    result_t res{0,0,0,0,0,lats.size()};
+    if (lats.empty()) {
+        return res;
+    }
+    std::sort(lats.begin(), lats.end());
+    double sum = 0;
+    for (auto l : lats) { sum += l; }
+    res.mean = sum/lats.size();
+    res.p50 = lats[lats.size()/2];
+    res.p99 = lats[(lats.size()*99)/100];
+    res.max = lats.back();
+    return res;
+}
+
+result_t run_one(int ninputs, int n_messages, double rate_hz, int sync_ms,
+                 double percentile, bool legacy, int run)
+{
+    std::vector<std::string> input_addrs;
+    for (int ind=0; ind<ninputs; ++ind) {
+        char addr[1024]={0};
+        snprintf(addr, 1024, "inproc://zlat-input-%d-%d", run, ind);
+        input_addrs.push_back(addr);
+    }
+    char oaddr[1024]={0};
+    snprintf(oaddr, 1024, "inproc://zlat-output-%d", run);
+
+    nlohmann::json zipper_config;
+    zipper_config["input"]["socket"]["type"]="PULL";
+    for (auto& a : input_addrs) {
+        zipper_config["input"]["socket"]["connect"].push_back(a);
+    }
+    zipper_config["output"]["socket"]["type"]="PUSH";
+    zipper_config["output"]["socket"]["bind"].push_back(oaddr);
+    zipper_config["sync_time"]=sync_ms;
+    zipper_config["sync_percentile"]=percentile;
+    zipper_config["legacy_wait"]=legacy;
+
+    goFlag.store(false);
+    std::vector<std::thread> threads;
+    for (int ind=0; ind<ninputs; ++ind) {
+        threads.emplace_back(send_loop, ind, n_messages, rate_hz, input_addrs[ind]);
+    }
+    result_t res;
+    {
+        ptmp::TPZipper zipper(zipper_config.dump());
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        goFlag.store(true);
+        res = recv_loop(ninputs*n_messages, oaddr);
+        for (auto& th : threads) { th.join(); }
+    }
+    res.rate = rate_hz;
+    return res;
+}
+
+int main(int argc, char* argv[])
+{
+    zsys_init();
+
+    CLI::App app{"Measure TPZipper latency vs input rate"};
+
+    int ninputs=4;
+    app.add_option("-N", ninputs, "number of input streams", true);
+    double seconds=2.0;
+    app.add_option("-t", seconds, "seconds to run each rate", true);
+    int sync_ms=10;
+    app.add_option("-s", sync_ms, "zipper sync time (in ms)", true);
+    double percentile=0;
+    app.add_option("-p", percentile, "learn per-input sync times at this percentile of arrival delay (0 is off)", true);
+    std::vector<double> rates{100, 1000, 10000};
+    app.add_option("-r", rates, "per-input message rates (Hz) to try", true);
+    bool no_baseline=false;
+    app.add_flag("-B", no_baseline, "skip the legacy_wait baseline runs");
+
+    CLI11_PARSE(app, argc, argv);
+
+    std::vector<result_t> results, baselines;
+    int run = 0;
+    for (double rate : rates) {
+        const int n_messages = std::max(10, (int)(rate*seconds));
+        results.push_back(run_one(ninputs, n_messages, rate, sync_ms, percentile, false, run++));
+        if (!no_baseline) {
+            baselines.push_back(run_one(ninputs, n_messages, rate, sync_ms, percentile, true, run++));
+        }
+    }
+
+    printf("# %d inputs, sync time %d ms, latency in us\n", ninputs, sync_ms);
+    printf("%10s %8s %10s %10s %10s %10s", "rate_hz", "n", "mean", "p50", "p99", "max");
+    if (!no_baseline) {
+        printf(" | %10s %10s %10s %10s", "base_mean", "base_p50", "base_p99", "base_max");
+    }
+    printf("\n");
+    for (size_t ind=0; ind<results.size(); ++ind) {
+        const auto& r = results[ind];
+        printf("%10.0f %8ld %10.1f %10.0f %10.0f %10.0f",
+               r.rate, r.n, r.mean, r.p50, r.p99, r.max);
+        if (!no_baseline) {
+            const auto& b = baselines[ind];
+            printf(" | %10.1f %10.0f %10.0f %10.0f", b.mean, b.p50, b.p99, b.max);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+// Test writing and reading archive files.
+
+#include "ptmp/archive.h"
+#include "ptmp/internals.h"
+
+#include <czmq.h>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+using namespace ptmp::internals;
+
+const int ndetids = 3, nsets = 1000;
+const ptmp::data::data_time_t tspan = 1000;
+
+static zmsg_t* make_one(int count)
+{
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(count % ndetids);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(count*tspan);
+    tps.set_tspan(tspan);
+    tps.set_chanbeg(count % 100);
+    tps.set_chanend(count % 100 + 9);
+    for (int itp=0; itp<10; ++itp) {
+        auto* tp = tps.add_tps();
+        tp->set_channel(count % 100 + itp);
+        tp->set_tstart(count*tspan + 10*itp);
+        tp->set_tspan(10);
+        tp->set_adcsum(100);
+    }
+    zmsg_t* msg = make_msg(tps, count%2 ? msg_schema_v2 : msg_schema_v0);
+    if (count % 10 == 0) {
+        add_topic(msg);         // not archived
+    }
+    return msg;
+}
+
+static void check_one(int count, const archive_record_t& rec)
+{
+    assert(rec.detid == (uint32_t)(count % ndetids));
+    assert(rec.tstart == count*tspan);
+    assert(rec.chanbeg == (uint32_t)(count % 100));
+    assert(rec.ntps == 10);
+    zmsg_t* msg = rec.msg();
+    assert(msg_schema(msg) == (count%2 ? msg_schema_v2 : msg_schema_v0));
+    ptmp::data::TPSet got;
+    recv_keep(msg, got);
+    assert(got.count() == (uint32_t)count);
+    zmsg_destroy(&msg);
+}
+
+// Read every record of every block.
+static void check_all(ArchiveReader* ar)
+{
+    assert(ar->nrecords() == nsets);
+    assert(ar->blocks().size() > 1);
+    int count = 0;
+    archive_record_t rec;
+    while (ar->next(rec)) {
+        check_one(count, rec);
+        ++count;
+    }
+    assert(count == nsets);
+}
+
+// A local message is stored serialized and reads back as v0.
+static void test_local(const std::string& fname)
+{
+    zsock_t* push = zsock_new_push("@inproc://test-archive-local");
+    zsock_t* pull = zsock_new_pull(">inproc://test-archive-local");
+    CarefulSender sender(push, nullptr);
+    sender.set_local(true);
+    zmsg_t* one = make_one(1);
+    ptmp::data::TPSet* tps = new ptmp::data::TPSet;
+    recv(&one, *tps);
+    assert(sender(tps) == 0);
+    zmsg_t* msg = zmsg_recv(pull);
+    assert(msg_schema(msg) == msg_schema_local);
+
+    ArchiveWriter aw(fname);
+    assert(aw.write(msg));
+    zmsg_destroy(&msg);
+    assert(aw.close());
+    zsock_destroy(&pull);
+    zsock_destroy(&push);
+
+    ArchiveReader* ar = ArchiveReader::open(fname);
+    assert(ar and ar->nrecords() == 1);
+    archive_record_t rec;
+    assert(ar->next(rec));
+    msg = rec.msg();
+    assert(msg_schema(msg) == msg_schema_v0);
+    ptmp::data::TPSet got;
+    recv(&msg, got);
+    assert(got.count() == 1 and got.tps_size() == 10);
+    delete ar;
+    remove(fname.c_str());
+}
+
+int main()
+{
+    zsys_init();
+    const std::string fname = "test_archive.ptmp";
+    const std::string lname = "test_archive.dump";
+
+    ArchiveWriter aw(fname, 16);
+    FILE* lfp = fopen(lname.c_str(), "w");
+    for (int count=0; count<nsets; ++count) {
+        zmsg_t* msg = make_one(count);
+        assert(aw.write(msg));
+        write(lfp, msg);
+        zmsg_destroy(&msg);
+    }
+    fclose(lfp);
+    assert(!is_archive(lname));
+    assert(!ArchiveReader::open(lname));
+
+    // Before closing, the blocks so far are found by a scan.
+    {
+        ArchiveReader* ar = ArchiveReader::open(fname);
+        assert(ar);
+        assert(ar->nrecords() > 0 and ar->nrecords() < nsets);
+        delete ar;
+    }
+
+    assert(aw.close());
+    assert(is_archive(fname));
+    ArchiveReader* ar = ArchiveReader::open(fname);
+    assert(ar);
+    zsys_info("%ld messages in %ld blocks, %ld bytes",
+              ar->nrecords(), ar->blocks().size(), aw.nbytes());
+    check_all(ar);
+
+    // Find the blocks of one detid and time range from the index.
+    const ptmp::data::data_time_t tbeg = 400*tspan, tend = 500*tspan;
+    const std::vector<uint32_t> dets{1};
+    int nfound = 0;
+    for (size_t iblock=0; iblock<ar->blocks().size(); ++iblock) {
+        if (!ar->blocks()[iblock].overlaps(tbeg, tend, dets)) {
+            continue;
+        }
+        ar->each(iblock, [&](const archive_record_t& rec) {
+                if (rec.detid == 1 and rec.tstart >= tbeg and rec.tstart < tend) {
+                    ++nfound;
+                }
+            });
+    }
+    assert(nfound == 34);
+
+    // Same from the message headers, and narrowed by channel.
+    archive_select_t sel;
+    sel.tbeg = tbeg;
+    sel.tend = tend;
+    sel.detids = dets;
+    int nrecs = 0, nmsgs = 0;
+    ar->seek(0);
+    archive_record_t rec;
+    while (ar->next(rec)) {
+        nrecs += sel(rec);
+        zmsg_t* msg = rec.msg();
+        nmsgs += sel(msg);
+        zmsg_destroy(&msg);
+    }
+    assert(nrecs == nfound and nmsgs == nfound);
+    sel.chanlo = 95;            // TPSets span chanbeg to chanbeg+9
+    sel.chanhi = 200;
+    nrecs = 0;
+    for (size_t iblock=0; iblock<ar->blocks().size(); ++iblock) {
+        if (sel(ar->blocks()[iblock])) {
+            ar->each(iblock, [&](const archive_record_t& rec) { nrecs += sel(rec); });
+        }
+    }
+    assert(nrecs == 5);
+
+    // Copy by record.
+    const std::string cname = "test_archive_copy.ptmp";
+    {
+        ArchiveWriter cw(cname);
+        ar->seek(0);
+        archive_record_t rec;
+        while (ar->next(rec)) {
+            cw.write(rec);
+        }
+    }
+    delete ar;
+    ar = ArchiveReader::open(cname);
+    assert(ar and ar->blocks().size() == 1);
+    assert(ar->nrecords() == nsets);
+    delete ar;
+
+    // An index entry pointing past the file or at other than a block
+    // is not trusted and the blocks are found by a scan.  The index
+    // offset follows the 8 byte magic and two 4 byte values of the
+    // file header and the first entry offset follows the 8 byte index
+    // header, see docs/archive.org.
+    for (uint64_t bad : {(uint64_t)1<<40, (uint64_t)4096 + 8}) {
+        FILE* fp = fopen(cname.c_str(), "r+");
+        uint64_t ioff = 0;
+        fseek(fp, 16, SEEK_SET);
+        assert(fread(&ioff, sizeof(ioff), 1, fp) == 1);
+        fseek(fp, ioff + 8, SEEK_SET);
+        fwrite(&bad, sizeof(bad), 1, fp);
+        fclose(fp);
+        ar = ArchiveReader::open(cname);
+        assert(ar and ar->blocks().size() == 1);
+        assert(ar->nrecords() == nsets);
+        delete ar;
+    }
+
+    // A missing file is not an error here, the caller decides.
+    assert(!ArchiveReader::open("test_archive_missing.ptmp"));
+
+    // A record with a bad size ends its block, the rest are still read.
+    // The first record follows the file header page and 32 byte block
+    // header, see docs/archive.org.
+    {
+        FILE* fp = fopen(fname.c_str(), "r+");
+        fseek(fp, 4096 + 32, SEEK_SET);
+        const uint32_t zero = 0;
+        fwrite(&zero, sizeof(zero), 1, fp);
+        fclose(fp);
+    }
+    ar = ArchiveReader::open(fname);
+    assert(ar);
+    const uint32_t nfirst = ar->blocks()[0].nrecords;
+    int nvisit = 0;
+    ar->each(0, [&](const archive_record_t& rec) { ++nvisit; });
+    assert(nvisit == 0);
+    int nread = 0;
+    while (ar->next(rec)) {
+        ++nread;
+    }
+    assert(nread == nsets - (int)nfirst);
+    delete ar;
+
+    // A file which can not be written is reported.
+    bool threw = false;
+    try {
+        ArchiveWriter full("/dev/full");
+    }
+    catch (const std::runtime_error& err) {
+        threw = true;
+    }
+    assert(threw);
+
+    test_local("test_archive_local.ptmp");
+
+    remove(fname.c_str());
+    remove(lname.c_str());
+    remove(cname.c_str());
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Check that a TPWindow over its TP budget sheds exactly enough of
+// the lowest ADC TPs and keeps the rest, also when ADCs are tied.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <functional>
+#include <string>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+
+// Send TPs with ADC sums given by adc(index) and check what comes out.
+static void test_lowest_adc(const std::string& name, std::function<uint32_t(int)> adc)
+{
+    const ptmp::data::data_time_t tspan = 1000;
+    const int nsets = 10, ntps = 100, budget = 500;
+    const std::string prefix = "inproc://test-budget-" + name + "-";
+    json wcfg;
+    wcfg["input"] = socket("PULL", "connect", prefix + "in");
+    wcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    wcfg["tspan"] = tspan;
+    wcfg["tbuf"] = 1000*tspan;  // hold everything until the watermark
+    wcfg["budget_tps"] = budget;
+    wcfg["shed_policy"] = "lowest_adc";
+
+    ptmp::TPSender sender(socket("PUSH", "bind", prefix + "in").dump());
+    ptmp::TPWindow window(wcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", prefix + "out").dump());
+
+    zclock_sleep(100);
+
+    // One window's worth per TPSet.
+    for (int count=0; count<nsets; ++count) {
+        const ptmp::data::data_time_t tbeg = (10+count)*tspan;
+        ptmp::data::TPSet tps;
+        tps.set_count(count);
+        tps.set_detid(1);
+        tps.set_created(ptmp::data::now());
+        tps.set_tstart(tbeg);
+        tps.set_tspan(tspan);
+        for (int ind=0; ind<ntps; ++ind) {
+            auto* tp = tps.add_tps();
+            tp->set_channel(ind);
+            tp->set_tstart(tbeg + ind);
+            tp->set_tspan(10);
+            tp->set_adcsum(adc(ind));
+            tp->set_adcpeak(10);
+        }
+        sender(tps);
+    }
+    ptmp::data::TPSet wm;
+    ptmp::internals::make_watermark(wm, 1, (10+nsets)*tspan);
+    sender(wm);
+
+    int nrecv = 0, nwindows = 0;
+    while (true) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, 1000)) {
+            break;
+        }
+        ++nwindows;
+        uint32_t adcmax = 0;
+        for (const auto& tp : got.tps()) {
+            adcmax = std::max(adcmax, tp.adcsum());
+        }
+        assert(adcmax == adc(ntps-1)); // the highest ADC TP is never shed
+        nrecv += got.tps_size();
+    }
+    zsys_info("%s: sent %d TPs, received %d in %d windows with a budget of %d",
+              name.c_str(), nsets*ntps, nrecv, nwindows, budget);
+    assert(nwindows == nsets);
+    assert(nrecv == budget - budget/10); // shed down to 90%
+}
+
+int main()
+{
+    zsys_init();
+    test_lowest_adc("distinct", [](int ind) { return ind; });
+    test_lowest_adc("tied", [](int ind) { return ind/10; });
+    return 0;
+}
@@ -0,0 +1,52 @@
+// Test parsing of CPU lists as given in configuration and by
+// /sys/devices/system/node/node*/cpulist.
+
+#include "ptmp/internals.h"
+
+#include <czmq.h>
+#include <cassert>
+#include <string>
+#include <vector>
+
+static void check(const std::string& list, const std::vector<int>& want)
+{
+    const auto got = ptmp::internals::parse_cpulist(list);
+    zsys_info("\"%s\": %ld CPUs", list.c_str(), got.size());
+    assert(got == want);
+}
+
+int main()
+{
+    zsys_init();
+
+    // lists and ranges
+    check("", {});
+    check("3", {3});
+    check("0,2,5", {0,2,5});
+    check("0-3", {0,1,2,3});
+    check("0-3,8", {0,1,2,3,8});
+    check("8,0-1", {8,0,1});
+    check("4-4", {4});
+    check("0,,1,", {0,1});
+
+    // strides
+    check("0-7:2", {0,2,4,6});
+    check("1-8:3", {1,4,7});
+    check("0-3:1,10-12:5", {0,1,2,3,10});
+
+    // malformed gives none at all
+    check("a", {});
+    check("0,x", {});
+    check("-1", {});
+    check("1-", {});
+    check("3-1", {});
+    check("1-2-3", {});
+    check(" 1", {});
+    check("1:2", {});
+    check("0-7:0", {});
+    check("0-7:", {});
+    check("0-7:2:4", {});
+    check("9999999", {});
+
+    return 0;
+}
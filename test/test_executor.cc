@@ -0,0 +1,121 @@
+// Run a chain of windows as tasks of a composer's executor, on fewer
+// threads than windows, and check every TP comes out the end.  Quiet
+// windows send watermarks on a timer which flushes the chain.  Then
+// do the same on one thread with tiny high-water marks and a stalled
+// reader so that outputs fill and tasks must not block their thread.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <thread>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+
+static ptmp::data::TPSet make_tpset(int count, int ntps, ptmp::data::data_time_t tspan)
+{
+    const ptmp::data::data_time_t tbeg = (10+count)*tspan;
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(1);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(tbeg);
+    tps.set_tspan(tspan);
+    for (int itp=0; itp<ntps; ++itp) {
+        auto* tp = tps.add_tps();
+        tp->set_channel(itp);
+        tp->set_tstart(tbeg + 10*itp);
+        tp->set_tspan(10);
+        tp->set_adcsum(100);
+    }
+    return tps;
+}
+
+// Compose a chain of nwindows windows, send nsets TPSets into it from
+// another thread, wait stall_ms before reading and return the number
+// of TPs which come out.
+static int run_chain(const std::string& prefix, int nwindows, int nthreads, int hwm,
+                     int nsets, int ntps, int stall_ms)
+{
+    const ptmp::data::data_time_t tspan = 1000;
+
+    auto sock = [&](const std::string& type, const std::string& bc, int ind) {
+        json cfg = socket(type, bc, prefix + std::to_string(ind));
+        if (hwm) {
+            cfg["socket"]["hwm"] = hwm;
+        }
+        return cfg;
+    };
+
+    json ccfg;
+    ccfg["name"] = "test-executor";
+    ccfg["executor"]["threads"] = nthreads;
+    for (int ind=0; ind<nwindows; ++ind) {
+        json wcfg;
+        wcfg["input"] = sock("PULL", "connect", ind);
+        wcfg["output"] = sock("PUSH", "bind", ind+1);
+        wcfg["tspan"] = tspan;
+        wcfg["tbuf"] = 100*tspan;
+        wcfg["watermark"] = 20;
+        json jprox;
+        jprox["name"] = "window" + std::to_string(ind);
+        jprox["type"] = "window";
+        jprox["data"] = wcfg;
+        ccfg["proxies"].push_back(jprox);
+    }
+
+    ptmp::TPSender sender(sock("PUSH", "bind", 0).dump());
+    ptmp::TPComposer composer(ccfg.dump());
+    ptmp::TPReceiver receiver(sock("PULL", "connect", nwindows).dump());
+    zclock_sleep(100);
+
+    // The sender may block on a full chain so it gets its own thread.
+    std::thread feeder([&]() {
+            for (int count=0; count<nsets; ++count) {
+                auto tps = make_tpset(count, ntps, tspan);
+                sender(tps);
+            }
+            ptmp::data::TPSet wm;
+            ptmp::internals::make_watermark(wm, 1, (10+nsets)*tspan);
+            sender(wm);
+        });
+    zclock_sleep(stall_ms);
+
+    int nrecv = 0, nwindows_out = 0;
+    ptmp::data::data_time_t last = 0;
+    while (nrecv < nsets*ntps) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, 2000)) {
+            break;
+        }
+        if (ptmp::internals::is_watermark(got)) {
+            continue;
+        }
+        assert(got.tstart() >= last);
+        last = got.tstart();
+        ++nwindows_out;
+        nrecv += got.tps_size();
+    }
+    feeder.join();
+    zsys_info("%d windows on %d threads passed %d of %d TPs in %d TPSets",
+              nwindows, nthreads, nrecv, nsets*ntps, nwindows_out);
+    return nrecv;
+}
+
+int main()
+{
+    zsys_init();
+
+    const int nsets = 100, ntps = 10;
+    int nrecv = run_chain("inproc://test-executor-", 10, 2, 0, nsets, ntps, 0);
+    assert(nrecv == nsets*ntps);
+
+    // Each window waits on the next with one thread for them all.
+    nrecv = run_chain("inproc://test-executor-full-", 4, 1, 2, 4*nsets, ntps, 500);
+    assert(nrecv == 4*nsets*ntps);
+    return 0;
+}
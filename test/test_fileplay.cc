@@ -0,0 +1,253 @@
+// Play several capture files, one an archive, through one TPFilePlay
+// to per-detid and default outputs and check each output is complete
+// and in order.  Then clone one file into several links, check
+// watermarks, early destruction and bad configuration.
+
+#include "ptmp/api.h"
+#include "ptmp/archive.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+using namespace ptmp::internals;
+
+const int nfiles = 4, nsets = 1000;
+
+static zmsg_t* make_one(uint32_t detid, int count, ptmp::data::data_time_t tspan=1000)
+{
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(detid);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(tspan*count + 7*detid); // interleaved
+    tps.set_tspan(tspan);
+    auto* tp = tps.add_tps();
+    tp->set_channel(detid);
+    tp->set_tstart(tps.tstart());
+    tp->set_tspan(10);
+    tp->set_adcsum(100);
+    return make_msg(tps, msg_schema_v2);
+}
+
+// Receive n TPSets of the detids in order.
+static void check_output(ptmp::TPReceiver& recv, int n, const std::vector<uint32_t>& detids)
+{
+    ptmp::data::data_time_t last = 0;
+    std::vector<int> counts(nfiles, 0);
+    for (int ind=0; ind<n; ++ind) {
+        ptmp::data::TPSet tps;
+        assert(recv(tps, 2000));
+        assert(tps.tstart() >= last);
+        last = tps.tstart();
+        bool found = false;
+        for (auto detid : detids) {
+            found = found or tps.detid() == detid;
+        }
+        assert(found);
+        assert((int)tps.count() == counts[tps.detid()]++);
+    }
+}
+
+static void test_merge()
+{
+    json cfg;
+    cfg["name"] = "test-fileplay";
+    cfg["speed"] = 0;
+    cfg["rewrite_created"] = false;
+    for (int ind=0; ind<nfiles; ++ind) {
+        const std::string fname = "test_fileplay_" + std::to_string(ind) + ".dump";
+        cfg["files"].push_back(fname);
+        if (ind == 0) {
+            ArchiveWriter aw(fname, 16);
+            for (int count=0; count<nsets; ++count) {
+                zmsg_t* msg = make_one(ind, count);
+                aw.write(msg);
+                zmsg_destroy(&msg);
+            }
+            continue;
+        }
+        FILE* fp = fopen(fname.c_str(), "w");
+        for (int count=0; count<nsets; ++count) {
+            zmsg_t* msg = make_one(ind, count);
+            write(fp, msg);
+            zmsg_destroy(&msg);
+        }
+        fclose(fp);
+    }
+    cfg["output"] = socket("PUSH", "bind", "inproc://test-fileplay-all");
+    for (int detid : {0, 1}) {
+        json jo = socket("PUSH", "bind", "inproc://test-fileplay-" + std::to_string(detid));
+        jo["detid"] = detid;
+        cfg["outputs"].push_back(jo);
+    }
+
+    ptmp::TPFilePlay play(cfg.dump());
+    ptmp::TPReceiver all(socket("PULL", "connect", "inproc://test-fileplay-all").dump());
+    ptmp::TPReceiver det0(socket("PULL", "connect", "inproc://test-fileplay-0").dump());
+    ptmp::TPReceiver det1(socket("PULL", "connect", "inproc://test-fileplay-1").dump());
+
+    check_output(det0, nsets, {0});
+    check_output(det1, nsets, {1});
+    check_output(all, 2*nsets, {2, 3});
+
+    for (auto& jf : cfg["files"]) {
+        remove(jf.get<std::string>().c_str());
+    }
+}
+
+static void test_clone()
+{
+    const std::string fname = "test_fileplay_clone.dump";
+    const uint32_t detid = 2;
+    const int nclones = 3, toffset = 500;
+    FILE* fp = fopen(fname.c_str(), "w");
+    for (int count=0; count<nsets; ++count) {
+        zmsg_t* msg = make_one(detid, count);
+        write(fp, msg);
+        zmsg_destroy(&msg);
+    }
+    fclose(fp);
+
+    json cfg;
+    cfg["name"] = "test-fileplay-clone";
+    cfg["speed"] = 0;
+    cfg["files"].push_back(fname);
+    cfg["clone"] = json{{"count", nclones}, {"detid_offset", 10}, {"toffset", toffset}};
+    const std::string prefix = "inproc://test-fileplay-clone-";
+    for (int ind=0; ind<nclones; ++ind) {
+        json jo = socket("PUSH", "bind", prefix + std::to_string(ind));
+        jo["detid"] = detid + 10 + ind;
+        cfg["outputs"].push_back(jo);
+    }
+    ptmp::TPFilePlay play(cfg.dump());
+
+    std::vector<ptmp::TPReceiver*> recvs;
+    for (int ind=0; ind<nclones; ++ind) {
+        recvs.push_back(new ptmp::TPReceiver(socket("PULL", "connect",
+                                                    prefix + std::to_string(ind)).dump()));
+    }
+    for (int count=0; count<nsets; ++count) {
+        for (int ind=0; ind<nclones; ++ind) {
+            ptmp::data::TPSet tps;
+            assert((*recvs[ind])(tps, 2000));
+            assert(tps.detid() == detid + 10 + ind);
+            assert(tps.count() == (uint32_t)count);
+            const ptmp::data::data_time_t tstart = 1000*count + 7*detid + ind*toffset;
+            assert(tps.tstart() == tstart);
+            assert(tps.tps(0).tstart() == tstart);
+        }
+    }
+    for (auto r : recvs) {
+        delete r;
+    }
+    remove(fname.c_str());
+}
+
+static void write_file(const std::string& fname, uint32_t detid, int n,
+                       ptmp::data::data_time_t tspan=1000)
+{
+    FILE* fp = fopen(fname.c_str(), "w");
+    for (int count=0; count<n; ++count) {
+        zmsg_t* msg = make_one(detid, count, tspan);
+        write(fp, msg);
+        zmsg_destroy(&msg);
+    }
+    fclose(fp);
+}
+
+// The default output gets watermarks for every detid sent to it.
+static void test_watermark()
+{
+    const int n = 5;
+    json cfg;
+    cfg["name"] = "test-fileplay-wm";
+    cfg["speed"] = 50;
+    cfg["watermark"] = 5;
+    for (uint32_t detid : {2, 3}) {
+        const std::string fname = "test_fileplay_wm_" + std::to_string(detid) + ".dump";
+        write_file(fname, detid, n, 50*30000); // 30 ms apart
+        cfg["files"].push_back(fname);
+    }
+    cfg["output"] = socket("PUSH", "bind", "inproc://test-fileplay-wm");
+    ptmp::TPFilePlay play(cfg.dump());
+    ptmp::TPReceiver recv(socket("PULL", "connect", "inproc://test-fileplay-wm").dump());
+
+    int ndata = 0;
+    std::vector<int> nwm(4, 0);
+    while (ndata < 2*n) {
+        ptmp::data::TPSet tps;
+        assert(recv(tps, 2000));
+        if (is_watermark(tps)) {
+            assert(tps.detid() == 2 or tps.detid() == 3);
+            ++nwm[tps.detid()];
+        }
+        else {
+            ++ndata;
+        }
+    }
+    zsys_info("fileplay: watermarks for detid 2: %d, 3: %d", nwm[2], nwm[3]);
+    assert(nwm[2] > 0 and nwm[3] > 0);
+    for (auto& jf : cfg["files"]) {
+        remove(jf.get<std::string>().c_str());
+    }
+}
+
+// Destroying the player stops it even when it never waits to send.
+static void test_quit()
+{
+    const std::string fname = "test_fileplay_quit.dump";
+    write_file(fname, 1, 100000);
+    json cfg;
+    cfg["name"] = "test-fileplay-quit";
+    cfg["speed"] = 0;
+    cfg["files"].push_back(fname);
+    cfg["output"] = socket("PUB", "bind", "inproc://test-fileplay-quit");
+    auto* play = new ptmp::TPFilePlay(cfg.dump());
+    zclock_sleep(10);
+    const int64_t t0 = zclock_usecs();
+    delete play;
+    const int64_t dt = zclock_usecs() - t0;
+    zsys_info("fileplay: quit in %ld us", dt);
+    assert(dt < 100000);
+    remove(fname.c_str());
+}
+
+// Bad configuration is logged and the player can still be destroyed.
+static void test_bad()
+{
+    const std::string fname = "test_fileplay_bad.dump";
+    write_file(fname, 1, 10);
+    json cfg;
+    cfg["speed"] = 0;
+    cfg["files"].push_back(fname);
+    cfg["output"] = socket("PUSH", "bind", "inproc://test-fileplay-bad");
+    json neg = cfg;
+    neg["clone"] = json{{"count", 2}, {"toffset", -1}};
+    json nodet = cfg;
+    nodet["outputs"].push_back(socket("PUSH", "bind", "inproc://test-fileplay-bad-1"));
+    json nosock = cfg;
+    nosock["output"] = socket("PUSH", "bind", "nosuch://test-fileplay-bad");
+    for (const auto& one : {neg, nodet, nosock}) {
+        ptmp::TPFilePlay play(one.dump());
+    }
+    remove(fname.c_str());
+}
+
+int main()
+{
+    zsys_init();
+    test_merge();
+    test_clone();
+    test_watermark();
+    test_quit();
+    test_bad();
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Check local messages, TPSet objects passed between agents in one
+// process: a composed window, zipper and filter chain, one TPSet
+// shared by two SUBs, a zipper serializing local input for a
+// non-local output, a TPReceiver taking a local message, a copy
+// outliving a local message and refusing "local" for other than
+// inproc://.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <memory>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+using namespace ptmp::internals;
+
+static ptmp::data::TPSet* make_tpset(int count, int ntps, ptmp::data::data_time_t tspan)
+{
+    const ptmp::data::data_time_t tbeg = (10+count)*tspan;
+    auto* tps = new ptmp::data::TPSet;
+    tps->set_count(count);
+    tps->set_detid(1);
+    tps->set_created(ptmp::data::now());
+    tps->set_tstart(tbeg);
+    tps->set_tspan(tspan);
+    for (int itp=0; itp<ntps; ++itp) {
+        auto* tp = tps->add_tps();
+        tp->set_channel(itp);
+        tp->set_tstart(tbeg + 10*itp);
+        tp->set_tspan(10);
+        tp->set_adcsum(100);
+    }
+    return tps;
+}
+
+// The composer makes the window and zipper outputs local.
+static void test_chain()
+{
+    const std::string prefix = "inproc://test-local-chain-";
+    const ptmp::data::data_time_t tspan = 1000;
+    const int nsets = 100, ntps = 20;
+
+    json wcfg;
+    wcfg["input"] = socket("PULL", "connect", prefix + "in");
+    wcfg["output"] = socket("PUSH", "bind", prefix + "window");
+    wcfg["tspan"] = tspan;
+    wcfg["tbuf"] = 10*tspan;
+    json zcfg;
+    zcfg["input"] = socket("PULL", "connect", prefix + "window");
+    zcfg["output"] = socket("PUSH", "bind", prefix + "zipper");
+    zcfg["sync_time"] = 10;
+    json fcfg;
+    fcfg["input"] = socket("PULL", "connect", prefix + "zipper");
+    fcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    fcfg["engine"] = "dummy_filter";
+
+    json ccfg;
+    ccfg["name"] = "test-local";
+    for (auto one : {std::make_pair("window", wcfg), std::make_pair("zipper", zcfg),
+                     std::make_pair("filter", fcfg)}) {
+        json jprox;
+        jprox["name"] = one.first;
+        jprox["type"] = one.first;
+        jprox["data"] = one.second;
+        ccfg["proxies"].push_back(jprox);
+    }
+
+    ptmp::TPSender sender(socket("PUSH", "bind", prefix + "in").dump());
+    ptmp::TPComposer composer(ccfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", prefix + "out").dump());
+    zclock_sleep(100);
+
+    for (int count=0; count<nsets; ++count) {
+        std::unique_ptr<ptmp::data::TPSet> tps(make_tpset(count, ntps, tspan));
+        sender(*tps);
+    }
+    ptmp::data::TPSet wm;
+    make_watermark(wm, 1, (10+nsets)*tspan);
+    sender(wm);
+
+    int nrecv = 0;
+    ptmp::data::data_time_t last = 0;
+    while (nrecv < nsets*ntps) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, 2000)) {
+            break;
+        }
+        for (const auto& tp : got.tps()) {
+            assert(tp.tstart() >= last);
+            last = tp.tstart();
+            ++nrecv;
+        }
+    }
+    zsys_info("chain: %d of %d TPs", nrecv, nsets*ntps);
+    assert(nrecv == nsets*ntps);
+}
+
+// Both SUBs see the one TPSet, freed once both are done with it.
+static void test_pubsub()
+{
+    const std::string addr = "inproc://test-local-pubsub";
+    zsock_t* pub = zsock_new_pub(("@" + addr).c_str());
+    zsock_t* sub1 = zsock_new_sub((">" + addr).c_str(), "");
+    zsock_t* sub2 = zsock_new_sub((">" + addr).c_str(), "");
+    zclock_sleep(100);
+
+    CarefulSender sender(pub, nullptr);
+    sender.set_local(true);
+    const int nsets = 10;
+    for (int count=0; count<nsets; ++count) {
+        assert(sender(make_tpset(count, 10, 1000)) == 0);
+    }
+    for (int count=0; count<nsets; ++count) {
+        zmsg_t* msg1 = zmsg_recv(sub1);
+        zmsg_t* msg2 = zmsg_recv(sub2);
+        const auto* tps1 = local_tpset(msg1);
+        const auto* tps2 = local_tpset(msg2);
+        assert(tps1 and tps1 == tps2);
+        assert((int)tps1->count() == count and tps1->tps_size() == 10);
+        zmsg_destroy(&msg1);
+        assert(tps2->tps_size() == 10); // still held by the other
+        zmsg_destroy(&msg2);
+    }
+    assert(sender.stats().nsent == (uint64_t)nsets);
+    zsock_destroy(&sub2);
+    zsock_destroy(&sub1);
+    zsock_destroy(&pub);
+}
+
+// Local input leaves a zipper with a non-local output serialized.
+static void test_zipper_serializes()
+{
+    const std::string prefix = "inproc://test-local-zipper-";
+    json zcfg;
+    zcfg["input"] = socket("PULL", "connect", prefix + "in");
+    zcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    zcfg["sync_time"] = 10;
+
+    zsock_t* push = zsock_new_push(("@" + prefix + "in").c_str());
+    ptmp::TPZipper zipper(zcfg.dump());
+    zsock_t* pull = zsock_new_pull((">" + prefix + "out").c_str());
+    zclock_sleep(100);
+
+    CarefulSender sender(push, nullptr);
+    sender.set_local(true);
+    const int nsets = 10;
+    for (int count=0; count<nsets; ++count) {
+        assert(sender(make_tpset(count+1, 10, 1000)) == 0);
+    }
+    for (int count=0; count<nsets; ++count) {
+        zmsg_t* msg = zmsg_recv(pull);
+        assert(msg);
+        assert(msg_schema(msg) == msg_schema_v0);
+        ptmp::data::TPSet got;
+        recv(&msg, got);
+        assert((int)got.count() == count+1 and got.tps_size() == 10);
+    }
+    zsock_destroy(&pull);
+    zsock_destroy(&push);
+}
+
+// A TPReceiver copies the local TPSet.
+static void test_receiver()
+{
+    const std::string addr = "inproc://test-local-receiver";
+    zsock_t* push = zsock_new_push(("@" + addr).c_str());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", addr).dump());
+
+    CarefulSender sender(push, nullptr);
+    sender.set_local(true);
+    assert(sender(make_tpset(42, 10, 1000)) == 0);
+    ptmp::data::TPSet got;
+    assert(receiver(got, 1000));
+    assert(got.count() == 42 and got.tps_size() == 10);
+    zsock_destroy(&push);
+}
+
+// A copy of a local message outlives it.
+static void test_dup()
+{
+    const std::string addr = "inproc://test-local-dup";
+    zsock_t* push = zsock_new_push(("@" + addr).c_str());
+    zsock_t* pull = zsock_new_pull((">" + addr).c_str());
+    CarefulSender sender(push, nullptr);
+    sender.set_local(true);
+    assert(sender(make_tpset(7, 10, 1000)) == 0);
+    zmsg_t* msg = zmsg_recv(pull);
+    zmsg_t* copy = dup_msg(msg);
+    zmsg_destroy(&msg);         // frees the TPSet
+    assert(msg_schema(copy) == msg_schema_v0);
+    ptmp::data::TPSet got;
+    recv(&copy, got);
+    assert(got.count() == 7 and got.tps_size() == 10);
+    zsock_destroy(&pull);
+    zsock_destroy(&push);
+}
+
+static void test_refused()
+{
+    json cfg = socket("PUSH", "bind", "inproc://test-local-refused");
+    assert(!local_output(cfg.dump()));
+    cfg["socket"]["local"] = true;
+    assert(local_output(cfg.dump()));
+    cfg["socket"]["connect"].push_back("tcp://127.0.0.1:5678");
+    assert(!local_output(cfg.dump()));
+}
+
+int main()
+{
+    zsys_init();
+    test_refused();
+    test_receiver();
+    test_dup();
+    test_pubsub();
+    test_zipper_serializes();
+    test_chain();
+    return 0;
+}
@@ -0,0 +1,202 @@
+// Test message schema v0 and v2 header access and round trip.
+
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+
+#include <czmq.h>
+#include <cassert>
+#include <vector>
+
+// Build a message like ptmp::internals::send() would but without a socket.
+static zmsg_t* make_msg(const ptmp::data::TPSet& tps, int schema)
+{
+    zmsg_t* msg = zmsg_new();
+    zmsg_addmem(msg, &schema, sizeof(int));
+    if (schema == ptmp::internals::msg_schema_v2) {
+        ptmp::internals::msg_header_t hdr;
+        ptmp::internals::make_header(tps, hdr);
+        zmsg_addmem(msg, &hdr, sizeof(hdr));
+    }
+    std::string dat;
+    tps.SerializeToString(&dat);
+    zmsg_addmem(msg, dat.data(), dat.size());
+    return msg;
+}
+
+int main()
+{
+    zsys_init();
+
+    ptmp::data::TPSet tps;
+    ptmp::testing::init(tps);
+    ptmp::testing::make_tps_t make_tps(10, 1);
+    make_tps(tps);
+    tps.set_count(42);
+    tps.set_detid(0x1234);
+    tps.set_tstart(0x123456789ab);
+    tps.set_tspan(2500);
+
+    for (int schema : {ptmp::internals::msg_schema_v0, ptmp::internals::msg_schema_v2}) {
+        zmsg_t* msg = make_msg(tps, schema);
+        assert(ptmp::internals::msg_schema(msg) == schema);
+
+        ptmp::internals::msg_header_t hdr;
+        bool ok = ptmp::internals::msg_header(msg, hdr);
+        assert(ok);
+        assert(hdr.count == tps.count());
+        assert(hdr.detid == tps.detid());
+        assert(hdr.tstart == tps.tstart());
+        assert(hdr.created == tps.created());
+        assert(hdr.tspan == tps.tspan());
+        assert(hdr.ntps == (uint32_t)tps.tps_size());
+
+        ptmp::data::TPSet got;
+        ptmp::internals::recv(&msg, got);
+        assert(!msg);
+        assert(got.tps_size() == tps.tps_size());
+        assert(got.tstart() == tps.tstart());
+        zsys_info("schema %d: ok", schema);
+    }
+
+    // parse onto an arena, reset and reuse it
+    {
+        ptmp::internals::ReusableArena arena(4096);
+        for (int round=0; round<3; ++round) {
+            zmsg_t* msg = make_msg(tps, ptmp::internals::msg_schema_v2);
+            ptmp::data::TPSet* got = ptmp::internals::recv(&msg, arena.get());
+            assert(!msg);
+            assert(got->GetArena() == arena.get());
+            assert(got->tps_size() == tps.tps_size());
+            assert(got->tps(0).tstart() == tps.tps(0).tstart());
+            uint64_t used = arena.reset();
+            assert(used > 0);
+        }
+    }
+
+    // assemble from encoded TPs, same bytes as serializing a TPSet
+    // with the same fields present
+    {
+        ptmp::data::TPSet full = tps;
+        full.set_chanbeg(1);
+        full.set_chanend(2);
+        full.set_totaladc(3);
+        for (auto& tp : *full.mutable_tps()) {
+            tp.set_tspan(tp.tspan());
+            tp.set_adcsum(tp.adcsum());
+            tp.set_adcpeak(tp.adcpeak());
+            tp.clear_flags();
+        }
+        ptmp::internals::msg_header_t hdr;
+        ptmp::internals::make_header(full, hdr);
+        ptmp::internals::tpset_extra_t extra;
+        extra.chanbeg = full.chanbeg();
+        extra.chanend = full.chanend();
+        extra.totaladc = full.totaladc();
+        std::string first, second;
+        for (int ind=0; ind<full.tps_size(); ++ind) {
+            const auto& tp = full.tps(ind);
+            std::string& out = ind < 3 ? first : second;
+            ptmp::internals::encode_tp(out, tp.channel(), tp.tstart(), tp.tspan(),
+                                       tp.adcsum(), tp.adcpeak(), tp.flags());
+        }
+        zmsg_t* msg = ptmp::internals::make_msg(hdr, extra, {&first, &second},
+                                                ptmp::internals::msg_schema_v2);
+        zmsg_t* want = make_msg(full, ptmp::internals::msg_schema_v2);
+        zframe_t* got_pay = zmsg_last(msg);
+        zframe_t* want_pay = zmsg_last(want);
+        assert(zframe_eq(got_pay, want_pay));
+        zmsg_destroy(&msg);
+        zmsg_destroy(&want);
+    }
+
+    // peek directly at the wire format
+    {
+        std::string dat;
+        tps.SerializeToString(&dat);
+        ptmp::internals::msg_header_t hdr;
+        bool ok = ptmp::internals::peek_tpset(dat.data(), dat.size(), hdr);
+        assert(ok);
+        assert(hdr.count == tps.count());
+        assert(hdr.detid == tps.detid());
+        assert(hdr.tstart == tps.tstart());
+        assert(hdr.created == tps.created());
+        assert(hdr.tspan == tps.tspan());
+        assert(hdr.ntps == (uint32_t)tps.tps_size());
+
+        // truncated inside the TPs
+        ok = ptmp::internals::peek_tpset(dat.data(), dat.size()-3, hdr);
+        assert(!ok);
+
+        // missing required fields
+        ptmp::data::TPSet partial;
+        partial.set_count(1);
+        partial.SerializePartialToString(&dat);
+        ok = ptmp::internals::peek_tpset(dat.data(), dat.size(), hdr);
+        assert(!ok);
+    }
+
+    // only a marked TPSet is a watermark, an empty one is not
+    {
+        ptmp::data::TPSet wm, empty;
+        ptmp::internals::make_watermark(wm, 0x1234, 1000);
+        empty.set_count(1);
+        empty.set_detid(0x1234);
+        empty.set_created(ptmp::data::now());
+        empty.set_tstart(1000);
+        assert(ptmp::internals::is_watermark(wm));
+        assert(!ptmp::internals::is_watermark(empty));
+        for (int schema : {ptmp::internals::msg_schema_v0, ptmp::internals::msg_schema_v2}) {
+            for (const auto* one : {&wm, &empty}) {
+                zmsg_t* msg = make_msg(*one, schema);
+                ptmp::internals::msg_header_t hdr;
+                bool ok = ptmp::internals::msg_header(msg, hdr);
+                assert(ok);
+                assert(hdr.ntps == 0);
+                assert(ptmp::internals::is_watermark(hdr) == (one == &wm));
+                zmsg_destroy(&msg);
+            }
+        }
+
+        // and so when assembled from a header
+        ptmp::internals::msg_header_t hdr;
+        ptmp::internals::make_header(wm, hdr);
+        zmsg_t* msg = ptmp::internals::make_msg(hdr, ptmp::internals::tpset_extra_t{}, {},
+                                                ptmp::internals::msg_schema_v0);
+        ptmp::data::TPSet got;
+        ptmp::internals::recv(&msg, got);
+        assert(ptmp::internals::is_watermark(got));
+    }
+
+    // malformed: unknown schema
+    {
+        const int bogus = 7;
+        zmsg_t* msg = zmsg_new();
+        zmsg_addmem(msg, &bogus, sizeof(int));
+        zmsg_addmem(msg, "", 0);
+        assert(ptmp::internals::msg_schema(msg) < 0);
+        ptmp::internals::msg_header_t hdr;
+        assert(!ptmp::internals::msg_header(msg, hdr));
+        zmsg_destroy(&msg);
+    }
+
+    // malformed: a local message not made by this process
+    {
+        const int id = ptmp::internals::msg_schema_local;
+        for (uint32_t token : {0u, ptmp::internals::local_token() + 1}) {
+            ptmp::internals::msg_header_t hdr{};
+            ptmp::internals::make_header(tps, hdr);
+            hdr.reserved = token;
+            std::vector<char> junk(sizeof(ptmp::data::TPSet), 0x5a);
+            zmsg_t* msg = zmsg_new();
+            zmsg_addmem(msg, &id, sizeof(int));
+            zmsg_addmem(msg, &hdr, sizeof(hdr));
+            zmsg_addmem(msg, junk.data(), junk.size());
+            assert(ptmp::internals::msg_schema(msg) < 0);
+            assert(!ptmp::internals::local_tpset(msg));
+            assert(!ptmp::internals::msg_header(msg, hdr));
+            zmsg_destroy(&msg);
+        }
+    }
+
+    return 0;
+}
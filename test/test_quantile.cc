@@ -0,0 +1,52 @@
+// Check the streaming quantile estimate against exact quantiles.
+
+#include "ptmp/internals.h"
+
+#include <czmq.h>
+#include <cassert>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+template<typename Dist>
+static void check(const char* name, Dist dist, double p, double tol)
+{
+    std::default_random_engine rng(42);
+    ptmp::internals::StreamingQuantile sq(p);
+    std::vector<double> all;
+    for (int ind=0; ind<100000; ++ind) {
+        const double x = dist(rng);
+        sq.add(x);
+        all.push_back(x);
+    }
+    std::sort(all.begin(), all.end());
+    const double want = all[(size_t)(p*(all.size()-1))];
+    const double spread = all[(size_t)(0.99*(all.size()-1))] - all[(size_t)(0.01*(all.size()-1))];
+    const double got = sq.value();
+    zsys_info("%s p=%.3f: exact %.3f estimate %.3f", name, p, want, got);
+    assert(sq.count() == all.size());
+    assert(std::abs(got - want) < tol*spread);
+}
+
+int main()
+{
+    zsys_init();
+
+    // exact for few values
+    {
+        ptmp::internals::StreamingQuantile sq(0.5);
+        assert(sq.value() == 0);
+        for (double x : {5.0, 1.0, 3.0}) {
+            sq.add(x);
+        }
+        assert(sq.value() == 3.0);
+    }
+
+    for (double p : {0.5, 0.9, 0.99}) {
+        check("uniform", std::uniform_real_distribution<double>(0, 1000), p, 0.02);
+        check("normal", std::normal_distribution<double>(1e6, 100), p, 0.02);
+        check("exponential", std::exponential_distribution<double>(0.01), p, 0.02);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+// Test writing messages through a recorder, with rotation, and
+// reading them back, and losing them to a failed write.
+
+#include "ptmp/api.h"
+#include "ptmp/recorder.h"
+#include "ptmp/archive.h"
+#include "ptmp/internals.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+using json = nlohmann::json;
+using namespace ptmp::internals;
+
+const int nsets = 10000, ntps = 20;
+
+static zmsg_t* make_one(int count)
+{
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(1);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(1000*count);
+    tps.set_tspan(1000);
+    for (int itp=0; itp<ntps; ++itp) {
+        auto* tp = tps.add_tps();
+        tp->set_channel(itp);
+        tp->set_tstart(1000*count + 10*itp);
+        tp->set_tspan(10);
+        tp->set_adcsum(100+itp);
+    }
+    return make_msg(tps, msg_schema_v2);
+}
+
+// Read back files name-0000.ext, name-0001.ext, ... and check every
+// message is found once and in order.  Return number of files.
+static int check_files(const std::string& name, const std::string& ext)
+{
+    int count = 0, nfiles = 0;
+    while (true) {
+        char fname[256];
+        snprintf(fname, sizeof(fname), "%s-%04d%s", name.c_str(), nfiles, ext.c_str());
+        FILE* fp = fopen(fname, "r");
+        if (!fp) {
+            break;
+        }
+        ArchiveReader* ar = ArchiveReader::open(fname);
+        while (true) {
+            zmsg_t* msg = ar ? ar->read() : read(fp);
+            if (!msg) {
+                break;
+            }
+            ptmp::data::TPSet tps;
+            recv(&msg, tps);
+            assert(tps.count() == (uint32_t)count);
+            assert(tps.tps_size() == ntps);
+            ++count;
+        }
+        delete ar;
+        if (fp) {
+            fclose(fp);
+        }
+        remove(fname);
+        ++nfiles;
+    }
+    assert(count == nsets);
+    return nfiles;
+}
+
+static void test_format(const std::string& format)
+{
+    const std::string name = "test_recorder_" + format;
+    json cfg{{"ofile", name + ".dump"}, {"format", format},
+             {"rotate_mb", 1}, {"buffer_kb", 64}, {"block_kb", 64}};
+    json met;
+    {
+        Recorder rec(cfg);
+        for (int count=0; count<nsets; ++count) {
+            zmsg_t* msg = make_one(count);
+            while (!rec.push(&msg)) {
+                zclock_sleep(1); // full, for a test we wait
+            }
+        }
+        zclock_sleep(100);
+        met = rec.metrics();
+    }
+    zsys_info("%s: %s", format.c_str(), met.dump().c_str());
+    assert(met["queue"]["max"].get<int>() > 0);
+    const int nfiles = check_files(name, ".dump");
+    zsys_info("%s: %d files", format.c_str(), nfiles);
+    assert(nfiles > 1);
+}
+
+// Messages lost to a failed write are dropped and not counted as
+// written.
+static void test_write_failure()
+{
+    const int nmsgs = 1000;     // more than fills the buffer
+    json cfg{{"ofile", "/dev/full"}, {"buffer_kb", 64}};
+    Recorder rec(cfg);
+    for (int count=0; count<nmsgs; ++count) {
+        zmsg_t* msg = make_one(count);
+        while (!rec.push(&msg)) {
+            zclock_sleep(1);
+        }
+    }
+    zclock_sleep(100);
+    json met = rec.metrics();
+    zsys_info("failure: %s", met.dump().c_str());
+    assert(met["write"]["failed"].get<int>() == 1);
+    assert(met["messages"].get<int>() == 0);
+    assert(rec.dropped() == (uint64_t)nmsgs);
+}
+
+// A file which can not be read or written is logged, not fatal.
+static void test_bad_files()
+{
+    json cfg{{"ifile", "test_recorder_missing.dump"},
+             {"ofile", "no/such/dir/test_recorder.dump"}};
+    ptmp::TPCat cat(cfg.dump());
+    zclock_sleep(100);
+}
+
+int main()
+{
+    zsys_init();
+    test_format("legacy");
+    test_format("archive");
+    test_write_failure();
+    test_bad_files();
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Test CarefulSender batching and that failed sends are counted.
+
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+
+#include <czmq.h>
+#include <cassert>
+
+using namespace ptmp::internals;
+
+static void send_some(CarefulSender& sender, int count)
+{
+    ptmp::data::TPSet tps;
+    ptmp::testing::init(tps);
+    ptmp::testing::make_tps_t make_tps(10, 1);
+    for (int ind=0; ind<count; ++ind) {
+        make_tps(tps);
+        assert(sender(tps) == 0);
+    }
+}
+
+// Messages go out in batches and are received in order.
+static void test_batch()
+{
+    zsock_t* pull = zsock_new_pull("@inproc://test-sender-batch");
+    zsock_t* push = zsock_new_push(">inproc://test-sender-batch");
+    CarefulSender sender(push, NULL, 4);
+    send_some(sender, 3);
+    assert(sender.pending() == 3);
+    send_some(sender, 1);
+    assert(sender.pending() == 0);
+    send_some(sender, 1);
+    assert(sender.flush() == 0);
+    assert(sender.stats().nsent == 5);
+    assert(sender.stats().ndropped == 0);
+    for (int ind=0; ind<5; ++ind) {
+        zmsg_t* msg = zmsg_recv(pull);
+        assert(msg);
+        zmsg_destroy(&msg);
+    }
+    zsock_destroy(&push);
+    zsock_destroy(&pull);
+}
+
+// A STREAM refuses messages for peers it does not know.
+static void test_failed()
+{
+    zsock_t* stream = zsock_new(ZMQ_STREAM);
+    assert(zsock_bind(stream, "tcp://127.0.0.1:*") > 0);
+    CarefulSender sender(stream, NULL);
+    send_some(sender, 3);
+    assert(sender.stats().nsent == 0);
+    assert(sender.stats().ndropped == 3);
+    zsock_destroy(&stream);
+}
+
+int main()
+{
+    zsys_init();
+    test_batch();
+    test_failed();
+    return 0;
+}
@@ -0,0 +1,225 @@
+// Test the shared memory ring directly and through "shm://" sockets.
+
+#include "ptmp/shm.h"
+#include "ptmp/api.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+using json = nlohmann::json;
+using ptmp::internals::ShmRing;
+
+static std::string unique(const std::string& what)
+{
+    return "ptmp-test-shm-" + what + "-" + std::to_string(getpid());
+}
+
+// A message with a counter frame and a payload frame of varying size.
+static zmsg_t* make_msg(uint32_t count)
+{
+    zmsg_t* msg = zmsg_new();
+    zmsg_addmem(msg, &count, sizeof(count));
+    std::string payload(count % 1000, (char)count);
+    zmsg_addmem(msg, payload.data(), payload.size());
+    return msg;
+}
+
+static uint32_t check_msg(zmsg_t* msg)
+{
+    assert(zmsg_size(msg) == 2);
+    zframe_t* frame = zmsg_first(msg);
+    assert(zframe_size(frame) == sizeof(uint32_t));
+    uint32_t count = 0;
+    memcpy(&count, zframe_data(frame), sizeof(count));
+    frame = zmsg_next(msg);
+    assert(zframe_size(frame) == count % 1000);
+    for (size_t ind=0; ind<zframe_size(frame); ++ind) {
+        assert(zframe_data(frame)[ind] == (uint8_t)count);
+    }
+    return count;
+}
+
+// Many messages through a small ring, shared by several consumer
+// threads.  Each message is received exactly once.
+static void test_queue()
+{
+    const std::string name = unique("queue");
+    const uint32_t nmsgs = 100000;
+    const int nconsumers = 3;
+
+    ShmRing* ring = ShmRing::create(name, ShmRing::queue, 64*1024);
+    assert(ring->attach_producer());
+
+    // A huge message never fits.
+    {
+        zmsg_t* big = zmsg_new();
+        std::string payload(ring->capacity(), 'x');
+        zmsg_addmem(big, payload.data(), payload.size());
+        assert(ring->write(big) == -1);
+        zmsg_destroy(&big);
+    }
+
+    std::vector<int> seen(nmsgs, 0);
+    std::atomic<uint32_t> nrecv{0};
+    std::vector<std::thread> threads;
+    for (int ind=0; ind<nconsumers; ++ind) {
+        threads.emplace_back([&]() {
+            ShmRing* mine = ShmRing::open(name, ShmRing::queue);
+            assert(mine);
+            uint32_t last = 0;
+            while (nrecv < nmsgs) {
+                zmsg_t* msg = mine->read();
+                if (!msg) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                const uint32_t count = check_msg(msg);
+                assert(!last or count > last); // each consumer sees order
+                last = count;
+                ++seen[count];
+                ++nrecv;
+                zmsg_destroy(&msg);
+            }
+            delete mine;
+        });
+    }
+
+    int nfull = 0;
+    for (uint32_t count=0; count<nmsgs; ++count) {
+        zmsg_t* msg = make_msg(count);
+        while (ring->write(msg) == 0) {
+            ++nfull;
+            std::this_thread::yield();
+        }
+        zmsg_destroy(&msg);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    for (uint32_t count=0; count<nmsgs; ++count) {
+        assert(seen[count] == 1);
+    }
+    zsys_info("queue: %d messages to %d consumers, producer waited %d times",
+              nmsgs, nconsumers, nfull);
+
+    // a second producer is refused while the first lives
+    ShmRing* other = ShmRing::open(name, ShmRing::queue);
+    assert(!other->attach_producer());
+    delete other;
+
+    // the wrong mode is refused
+    bool threw = false;
+    try {
+        ShmRing::open(name, ShmRing::broadcast);
+    }
+    catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    delete ring;
+    assert(ShmRing::open(name, ShmRing::queue) == nullptr); // removed
+}
+
+// Each consumer gets every message.  One which does not keep up is
+// lapped and skips ahead without ever returning a damaged message.
+static void test_broadcast()
+{
+    const std::string name = unique("broadcast");
+    const uint32_t nmsgs = 10000;
+
+    ShmRing* ring = ShmRing::create(name, ShmRing::broadcast, 64*1024);
+    assert(ring->attach_producer());
+    ShmRing* one = ShmRing::open(name, ShmRing::broadcast);
+    ShmRing* two = ShmRing::open(name, ShmRing::broadcast);
+    ShmRing* slow = ShmRing::open(name, ShmRing::broadcast);
+
+    for (uint32_t count=0; count<nmsgs; ++count) {
+        zmsg_t* msg = make_msg(count);
+        assert(ring->write(msg) == 1); // never waits
+        zmsg_destroy(&msg);
+        for (auto sub : {one, two}) {
+            zmsg_t* got = sub->read();
+            assert(got);
+            assert(check_msg(got) == count);
+            zmsg_destroy(&got);
+        }
+    }
+    assert(!one->read());
+    assert(one->lost() == 0);
+
+    // lapped, it skips to the newest and then keeps up
+    assert(!slow->read());
+    assert(slow->lost() == 1);
+    for (uint32_t count=nmsgs; count<nmsgs+10; ++count) {
+        zmsg_t* msg = make_msg(count);
+        ring->write(msg);
+        zmsg_destroy(&msg);
+    }
+    uint32_t nslow = 0;
+    while (zmsg_t* got = slow->read()) {
+        assert(check_msg(got) == nmsgs + nslow);
+        ++nslow;
+        zmsg_destroy(&got);
+    }
+    assert(nslow == 10);
+    zsys_info("broadcast: %d messages, slow consumer lapped %ld times",
+              nmsgs, slow->lost());
+
+    delete slow;
+    delete two;
+    delete one;
+    delete ring;
+}
+
+// TPSets between a sender and receiver using shm:// addresses.
+static void test_sockets()
+{
+    const std::string addr = "shm://" + unique("sockets");
+    json scfg, rcfg;
+    scfg["socket"]["type"] = "PUSH";
+    scfg["socket"]["bind"].push_back(addr);
+    scfg["socket"]["shm_kb"] = 1024;
+    rcfg["socket"]["type"] = "PULL";
+    rcfg["socket"]["connect"].push_back(addr);
+
+    ptmp::TPSender sender(scfg.dump());
+    ptmp::TPReceiver receiver(rcfg.dump());
+
+    const int nsets = 1000;
+    for (int count=0; count<nsets; ++count) {
+        ptmp::data::TPSet tps;
+        tps.set_count(count);
+        tps.set_detid(1);
+        tps.set_created(ptmp::data::now());
+        tps.set_tstart(1000*count);
+        auto* tp = tps.add_tps();
+        tp->set_channel(count);
+        tp->set_tstart(1000*count);
+        sender(tps);
+    }
+    for (int count=0; count<nsets; ++count) {
+        ptmp::data::TPSet tps;
+        bool ok = receiver(tps, 1000);
+        assert(ok);
+        assert(tps.count() == (uint32_t)count);
+        assert(tps.tps(0).channel() == (uint32_t)count);
+    }
+    zsys_info("sockets: %d TPSets over %s", nsets, addr.c_str());
+}
+
+int main()
+{
+    zsys_init();
+    test_queue();
+    test_broadcast();
+    test_sockets();
+    return 0;
+}
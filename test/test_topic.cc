@@ -0,0 +1,139 @@
+// Test topic frames and detid/channel subscriptions.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+using namespace ptmp::internals;
+
+// True if any subscription is a prefix of the topic, as ZeroMQ does.
+static bool matches(const std::vector<std::string>& subs, uint32_t detid, uint32_t chanbeg)
+{
+    const std::string top = msg_topic(detid, chanbeg);
+    for (const auto& sub : subs) {
+        if (top.compare(0, sub.size(), sub) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_subscriptions()
+{
+    auto all = topic_subscriptions(7, 0, 0xffffffff);
+    assert(all.size() == 1);
+    assert(matches(all, 7, 0));
+    assert(matches(all, 7, topic_watermark));
+    assert(!matches(all, 8, 0));
+
+    const uint32_t lo = 300, hi = 1100;
+    auto some = topic_subscriptions(7, lo, hi);
+    for (uint32_t chan = 0; chan < 2000; ++chan) {
+        assert(matches(some, 7, chan) == (chan >= lo and chan <= hi));
+        assert(!matches(some, 6, chan));
+    }
+    assert(matches(some, 7, topic_watermark));
+    zsys_info("channels [%d,%d] need %ld prefixes", lo, hi, some.size());
+}
+
+static void test_frames()
+{
+    ptmp::data::TPSet tps;
+    ptmp::testing::init(tps);
+    ptmp::testing::make_tps_t make_tps(10, 1);
+    make_tps(tps);
+    tps.set_detid(0x1234);
+    tps.set_chanbeg(456);
+
+    for (int schema : {msg_schema_v0, msg_schema_v2}) {
+        zmsg_t* msg = make_msg(tps, schema);
+        assert(add_topic(msg));
+        assert(zmsg_size(msg) == (schema ? 4u : 3u));
+        assert(zframe_size(zmsg_first(msg)) == msg_topic_size);
+        assert(msg_topic(0x1234, 456) ==
+               std::string((const char*)zframe_data(zmsg_first(msg)), msg_topic_size));
+        assert(add_topic(msg)); // only once
+        assert(zmsg_size(msg) == (schema ? 4u : 3u));
+
+        // readers skip the topic
+        assert(msg_schema(msg) == schema);
+        msg_header_t hdr;
+        assert(msg_header(msg, hdr));
+        assert(hdr.detid == 0x1234);
+        ptmp::data::TPSet got;
+        recv_keep(msg, got);
+        assert(got.chanbeg() == 456);
+        assert(got.tps_size() == tps.tps_size());
+
+        strip_topic(msg);
+        assert(zmsg_size(msg) == (schema ? 3u : 2u));
+        assert(msg_schema(msg) == schema);
+        zmsg_destroy(&msg);
+    }
+}
+
+// A SUB only receives the detid and channels it subscribes to.
+static void test_sockets()
+{
+    const std::string addr = "inproc://test-topic";
+    json pcfg = socket("PUB", "bind", addr);
+    pcfg["socket"]["topic"] = true;
+    json dcfg = socket("SUB", "connect", addr);
+    dcfg["socket"]["subscriptions"].push_back(2);
+    json ccfg = socket("SUB", "connect", addr);
+    ccfg["socket"]["subscriptions"].push_back(json{{"detid", 1}, {"channels", {100, 199}}});
+
+    ptmp::TPSender sender(pcfg.dump());
+    ptmp::TPReceiver bydet(dcfg.dump());
+    ptmp::TPReceiver bychan(ccfg.dump());
+    zclock_sleep(100);
+
+    for (uint32_t detid : {1, 2}) {
+        for (uint32_t chanbeg : {0, 100, 150, 200}) {
+            ptmp::data::TPSet tps;
+            ptmp::testing::init(tps);
+            tps.set_detid(detid);
+            tps.set_chanbeg(chanbeg);
+            tps.set_tstart(1000);
+            auto* tp = tps.add_tps();
+            tp->set_channel(chanbeg);
+            tp->set_tstart(1000);
+            sender(tps);
+        }
+        ptmp::data::TPSet wm;
+        make_watermark(wm, detid, 1000);
+        sender(wm);
+    }
+
+    ptmp::data::TPSet got;
+    for (uint32_t chanbeg : {0, 100, 150, 200}) {
+        assert(bydet(got, 1000));
+        assert(got.detid() == 2 and got.chanbeg() == chanbeg);
+    }
+    assert(bydet(got, 1000) and is_watermark(got) and got.detid() == 2);
+    assert(!bydet(got, 100));
+
+    for (uint32_t chanbeg : {100, 150}) {
+        assert(bychan(got, 1000));
+        assert(got.detid() == 1 and got.chanbeg() == chanbeg);
+    }
+    assert(bychan(got, 1000) and is_watermark(got) and got.detid() == 1);
+    assert(!bychan(got, 100));
+}
+
+int main()
+{
+    zsys_init();
+    test_subscriptions();
+    test_frames();
+    test_sockets();
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Send TPs with known times through a TPWindow and check the windows
+// which come out, both tumbling and sliding and with and without
+// sharding.
+
+#include "ptmp/api.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <random>
+
+using json = nlohmann::json;
+
+static void run(ptmp::data::data_time_t tstride, int nshards)
+{
+    const ptmp::data::data_time_t tspan = 1000, toff = 123, tbuf = 5000;
+    const int nslices = tspan/tstride;
+
+    const std::string suffix = std::to_string(tstride) + "-" + std::to_string(nshards);
+    const std::string iaddr = "inproc://test-tpwindow-in-" + suffix;
+    const std::string oaddr = "inproc://test-tpwindow-out-" + suffix;
+
+    json jcfg;
+    jcfg["input"]["socket"]["type"] = "PULL";
+    jcfg["input"]["socket"]["connect"].push_back(iaddr);
+    jcfg["output"]["socket"]["type"] = "PUSH";
+    jcfg["output"]["socket"]["bind"].push_back(oaddr);
+    jcfg["tspan"] = tspan;
+    jcfg["tstride"] = tstride;
+    jcfg["toffset"] = toff;
+    jcfg["tbuf"] = tbuf;
+    jcfg["shards"] = nshards;
+    jcfg["shard_chans"] = 3;
+
+    json scfg, rcfg;
+    scfg["socket"]["type"] = "PUSH";
+    scfg["socket"]["bind"].push_back(iaddr);
+    rcfg["socket"]["type"] = "PULL";
+    rcfg["socket"]["connect"].push_back(oaddr);
+
+    ptmp::TPSender sender(scfg.dump());
+    ptmp::TPWindow window(jcfg.dump());
+    ptmp::TPReceiver receiver(rcfg.dump());
+
+    std::default_random_engine rng(1234);
+    std::uniform_int_distribution<int> jitter(0, 3*tspan);
+
+    // TPs in each TPSet spread over a few windows, with some out of
+    // order between TPSets, and a gap which leaves empty windows.
+    const int nsets = 200;
+    int nsent = 0;
+    ptmp::data::data_time_t tbeg = 1000000;
+    for (int count=0; count<nsets; ++count) {
+        ptmp::data::TPSet tps;
+        tps.set_count(count);
+        tps.set_detid(1);
+        tps.set_created(ptmp::data::now());
+        tps.set_tstart(tbeg);
+        for (int ind=0; ind<10; ++ind) {
+            auto* tp = tps.add_tps();
+            tp->set_channel(ind);
+            tp->set_tstart(tbeg + tspan + jitter(rng));
+            tp->set_tspan(10);
+            tp->set_adcsum(100+ind);
+            tp->set_adcpeak(10);
+            ++nsent;
+        }
+        sender(tps);
+        tbeg += tspan/2;
+        if (count == nsets/2) {
+            tbeg += 20*tspan;
+        }
+    }
+
+    int nrecv = 0, nwindows = 0;
+    ptmp::data::data_time_t last_tstart = 0;
+    while (true) {
+        ptmp::data::TPSet tps;
+        if (!receiver(tps, 1000)) {
+            break;
+        }
+        ++nwindows;
+        assert(tps.tspan() == tspan);
+        assert((tps.tstart() - toff) % tstride == 0);
+        assert(tps.tstart() > last_tstart);
+        last_tstart = tps.tstart();
+        assert(tps.tps_size() > 0);
+
+        uint32_t totaladc = 0;
+        ptmp::data::data_time_t last_tp = 0;
+        for (const auto& tp : tps.tps()) {
+            assert(tp.tstart() >= tps.tstart());
+            assert(tp.tstart() < tps.tstart() + tspan);
+            assert(tp.tstart() >= last_tp);
+            last_tp = tp.tstart();
+            assert(tps.chanbeg() <= tp.channel());
+            assert(tp.channel() <= tps.chanend());
+            assert(tp.tspan() == 10);
+            assert(tp.adcpeak() == 10);
+            totaladc += tp.adcsum();
+        }
+        assert(totaladc == tps.totaladc());
+        nrecv += tps.tps_size();
+    }
+    zsys_info("stride %ld, %d shards: sent %d TPs, received %d TPs in %d windows",
+              tstride, nshards, nsent, nrecv, nwindows);
+
+    // each TP is in nslices windows and about the last tbuf worth is
+    // still held
+    assert(nwindows > 0);
+    assert(nrecv <= nslices*nsent);
+    assert(nslices*nsent - nrecv < nslices*nsent/4);
+}
+
+int main()
+{
+    zsys_init();
+    run(1000, 1);               // tumbling
+    run(250, 1);                // sliding
+    run(250, 4);                // sliding, multi-threaded
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Check that watermarks, marked TPSets with no TPs, let a zipper and
+// a window send output without waiting on a quiet input, and that
+// unmarked empty TPSets are not taken for watermarks.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+
+static ptmp::data::TPSet make_data(uint32_t detid, int count, ptmp::data::data_time_t tstart)
+{
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(detid);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(tstart);
+    tps.set_tspan(100);
+    auto* tp = tps.add_tps();
+    tp->set_channel(detid);
+    tp->set_tstart(tstart);
+    tp->set_tspan(10);
+    tp->set_adcsum(100);
+    tp->set_adcpeak(10);
+    return tps;
+}
+
+// One input sends data, the other only a watermark past it.  The
+// data must come out long before the sync time.
+static void test_zipper()
+{
+    const int sync_ms = 2000;
+    json zcfg;
+    zcfg["input"] = socket("PULL", "connect", "inproc://test-watermark-zin1");
+    zcfg["input"]["socket"]["connect"].push_back("inproc://test-watermark-zin2");
+    zcfg["output"] = socket("PUSH", "bind", "inproc://test-watermark-zout");
+    zcfg["sync_time"] = sync_ms;
+
+    ptmp::TPSender busy(socket("PUSH", "bind", "inproc://test-watermark-zin1").dump());
+    ptmp::TPSender quiet(socket("PUSH", "bind", "inproc://test-watermark-zin2").dump());
+    ptmp::TPZipper zipper(zcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", "inproc://test-watermark-zout").dump());
+
+    zclock_sleep(100);
+
+    const auto t0 = ptmp::data::now();
+    auto tps = make_data(1, 1, 1000);
+    busy(tps);
+    ptmp::data::TPSet wm;
+    ptmp::internals::make_watermark(wm, 2, 2000);
+    quiet(wm);
+
+    ptmp::data::TPSet got;
+    bool ok = receiver(got, sync_ms/2);
+    const auto dt = ptmp::data::now() - t0;
+    assert(ok);
+    assert(got.detid() == 1);
+    assert(got.tps_size() == 1);
+    zsys_info("zipper: output after %.1f ms with sync time %d ms", 1e-3*dt, sync_ms);
+    assert(dt < 1000*sync_ms/2);
+
+    // the watermark itself is not forwarded
+    ok = receiver(got, 200);
+    assert(!ok);
+}
+
+// Empty TPSets which are not watermarks are data and must all come
+// out of the zipper, in order.
+static void test_zipper_empty()
+{
+    const int sync_ms = 100;
+    const int nsend = 10;
+    json zcfg;
+    zcfg["input"] = socket("PULL", "connect", "inproc://test-watermark-ein1");
+    zcfg["input"]["socket"]["connect"].push_back("inproc://test-watermark-ein2");
+    zcfg["output"] = socket("PUSH", "bind", "inproc://test-watermark-eout");
+    zcfg["sync_time"] = sync_ms;
+
+    ptmp::TPSender one(socket("PUSH", "bind", "inproc://test-watermark-ein1").dump());
+    ptmp::TPSender two(socket("PUSH", "bind", "inproc://test-watermark-ein2").dump());
+    ptmp::TPZipper zipper(zcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", "inproc://test-watermark-eout").dump());
+
+    zclock_sleep(100);
+
+    for (int count=0; count<nsend; ++count) {
+        ptmp::data::TPSet tps = make_data(1, count+1, 1000 + 100*count);
+        tps.clear_tps();
+        one(tps);
+        tps = make_data(2, count+1, 1050 + 100*count);
+        two(tps);
+    }
+
+    ptmp::data::data_time_t last = 0;
+    for (int ind=0; ind<2*nsend; ++ind) {
+        ptmp::data::TPSet got;
+        bool ok = receiver(got, 10*sync_ms);
+        assert(ok);
+        assert(!ptmp::internals::is_watermark(got));
+        assert(got.tstart() > last);
+        last = got.tstart();
+    }
+    zsys_info("zipper: passed %d empty TPSets", nsend);
+}
+
+// With a large tbuf a window would wait for much more data.  A
+// watermark past the end of the window lets it out.
+static void test_window()
+{
+    const ptmp::data::data_time_t tspan = 1000;
+    json wcfg;
+    wcfg["input"] = socket("PULL", "connect", "inproc://test-watermark-win");
+    wcfg["output"] = socket("PUSH", "bind", "inproc://test-watermark-wout");
+    wcfg["tspan"] = tspan;
+    wcfg["tbuf"] = 1000*tspan;
+
+    ptmp::TPSender sender(socket("PUSH", "bind", "inproc://test-watermark-win").dump());
+    ptmp::TPWindow window(wcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", "inproc://test-watermark-wout").dump());
+
+    zclock_sleep(100);
+
+    for (int count=0; count<3; ++count) {
+        auto tps = make_data(1, count+1, 10*tspan + count*tspan);
+        sender(tps);
+    }
+
+    ptmp::data::TPSet got;
+    bool ok = receiver(got, 200);
+    assert(!ok);                // held for tbuf
+
+    ptmp::data::TPSet wm;
+    ptmp::internals::make_watermark(wm, 1, 12*tspan);
+    sender(wm);
+
+    // windows at 10 and 11 are complete, the one at 12 is not
+    for (int ind=0; ind<2; ++ind) {
+        ok = receiver(got, 1000);
+        assert(ok);
+        assert(got.tstart() == (10+ind)*tspan);
+        assert(got.tps_size() == 1);
+    }
+    ok = receiver(got, 200);
+    assert(!ok);
+    zsys_info("window: watermark released 2 windows");
+}
+
+int main()
+{
+    zsys_init();
+    test_zipper();
+    test_zipper_empty();
+    test_window();
+    return 0;
+}
@@ -0,0 +1,113 @@
+// Zip a chatty input with two quiet ones using per-endpoint input
+// sockets and a small credit so the chatty input is held back, as
+// seen in the per-input metrics.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <memory>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+
+int main()
+{
+    zsys_init();
+
+    const int ninputs = 3, sync_ms = 2000;
+    const int nsets[ninputs] = {200, 20, 20};
+    const ptmp::data::data_time_t period[ninputs] = {10, 100, 100};
+    const std::string prefix = "inproc://test-zipper-inputs-";
+
+    std::vector<std::unique_ptr<ptmp::TPSender> > senders;
+    json zcfg;
+    zcfg["input"]["socket"]["type"] = "PULL";
+    for (int ind=0; ind<ninputs; ++ind) {
+        const std::string addr = prefix + std::to_string(ind);
+        senders.emplace_back(new ptmp::TPSender(socket("PUSH", "bind", addr).dump()));
+        zcfg["input"]["socket"]["connect"].push_back(addr);
+    }
+    zcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    zcfg["sync_time"] = sync_ms;
+    zcfg["perendpoint"] = true;
+    const int credits = 5;
+    zcfg["credits"] = credits;
+    zcfg["metrics"]["proto"] = "JSON";
+    zcfg["metrics"]["prefix"] = "test";
+    zcfg["metrics"]["period"] = 50;
+    zcfg["metrics"]["socket"] = socket("PUB", "bind", prefix + "met")["socket"];
+    zsock_t* msub = zsock_new_sub((">" + prefix + "met").c_str(), "");
+
+    ptmp::TPZipper zipper(zcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", prefix + "out").dump());
+    zclock_sleep(100);
+
+    // Each input first sends one message so the zipper waits for all
+    // of them.  The chatty input then sends all the rest, which must
+    // be held until the quiet inputs catch up.
+    auto send_one = [&](int ind, int count) {
+        ptmp::data::TPSet tps;
+        tps.set_count(count+1);
+        tps.set_detid(ind+1);
+        tps.set_created(ptmp::data::now());
+        tps.set_tstart(1000 + count*period[ind] + ind);
+        auto* tp = tps.add_tps();
+        tp->set_channel(ind);
+        tp->set_tstart(tps.tstart());
+        (*senders[ind])(tps);
+    };
+    int nsent = 0;
+    for (int ind=0; ind<ninputs; ++ind) {
+        send_one(ind, 0);
+        ++nsent;
+    }
+    zclock_sleep(100);
+    for (int ind=0; ind<ninputs; ++ind) {
+        for (int count=1; count<nsets[ind]; ++count) {
+            send_one(ind, count);
+            ++nsent;
+        }
+        ptmp::data::TPSet wm;
+        ptmp::internals::make_watermark(wm, ind+1, 1000000);
+        (*senders[ind])(wm);
+        zclock_sleep(100);
+    }
+
+    int nrecv = 0;
+    ptmp::data::data_time_t last = 0;
+    while (true) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, sync_ms/2)) {
+            break;
+        }
+        assert(got.tstart() >= last);
+        last = got.tstart();
+        ++nrecv;
+    }
+    zsys_info("received %d of %d", nrecv, nsent);
+    assert(nrecv == nsent);
+
+    // Reports keep coming so read those made so far.
+    std::vector<uint64_t> stalled(ninputs, 0);
+    zsock_set_rcvtimeo(msub, 200);
+    const int64_t tend = zclock_mono() + 200;
+    int mtype = 0;
+    char* sdat = nullptr;
+    while (zclock_mono() < tend and zsock_recv(msub, "is", &mtype, &sdat) == 0) {
+        auto jm = json::parse(sdat)["ptmp"]["test"];
+        zstr_free(&sdat);
+        int ind = 0;
+        for (auto& jin : jm["inputs"]) {
+            assert(jin["backlog"].get<int>() <= credits);
+            stalled[ind++] += jin["stalled"].get<uint64_t>();
+        }
+    }
+    zsock_destroy(&msub);
+    zsys_info("stalled: %ld %ld %ld", stalled[0], stalled[1], stalled[2]);
+    assert(stalled[0] > 0);
+    return 0;
+}
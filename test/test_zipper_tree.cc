@@ -0,0 +1,146 @@
+// Zip many inputs through a small-fanout zipper tree and check the
+// output is complete and ordered and that watermarks, including from
+// a quiet input, reach the root.  Also check that the leaf stages
+// keep the input socket configuration, here SUB subscriptions.
+
+#include "ptmp/api.h"
+#include "ptmp/internals.h"
+#include "ptmp/testing.h"
+#include "json.hpp"
+
+#include <czmq.h>
+#include <cassert>
+#include <memory>
+
+using json = nlohmann::json;
+using ptmp::testing::socket;
+
+static void send_data(ptmp::TPSender& sender, uint32_t detid, int count,
+                      ptmp::data::data_time_t tstart)
+{
+    ptmp::data::TPSet tps;
+    tps.set_count(count);
+    tps.set_detid(detid);
+    tps.set_created(ptmp::data::now());
+    tps.set_tstart(tstart);
+    tps.set_tspan(100);
+    auto* tp = tps.add_tps();
+    tp->set_channel(detid);
+    tp->set_tstart(tstart);
+    tp->set_tspan(10);
+    tp->set_adcsum(100);
+    sender(tps);
+}
+
+static void test_pull()
+{
+    const int ninputs = 7, nsets = 50, sync_ms = 2000;
+    const std::string prefix = "inproc://test-zipper-tree-";
+
+    // The last input is quiet and only sends a watermark.
+    std::vector<std::unique_ptr<ptmp::TPSender> > senders;
+    json zcfg;
+    zcfg["input"]["socket"]["type"] = "PULL";
+    for (int ind=0; ind<ninputs; ++ind) {
+        const std::string addr = prefix + std::to_string(ind);
+        senders.emplace_back(new ptmp::TPSender(socket("PUSH", "bind", addr).dump()));
+        zcfg["input"]["socket"]["connect"].push_back(addr);
+    }
+    zcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    zcfg["sync_time"] = sync_ms;
+    zcfg["fanout"] = 2;         // three levels of stages
+
+    ptmp::TPZipperTree tree(zcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", prefix + "out").dump());
+    zclock_sleep(100);
+
+    const auto t0 = ptmp::data::now();
+    for (int count=0; count<nsets; ++count) {
+        for (int ind=0; ind<ninputs-1; ++ind) {
+            send_data(*senders[ind], ind+1, count+1, 1000*count + ind);
+        }
+    }
+    // All inputs mark the end of their data.
+    for (int ind=0; ind<ninputs; ++ind) {
+        ptmp::data::TPSet wm;
+        ptmp::internals::make_watermark(wm, ind+1, 1000*nsets);
+        (*senders[ind])(wm);
+    }
+
+    // Without watermarks nothing could leave before the sync time
+    // and the last message of each input would wait on the others.
+    int nrecv = 0;
+    ptmp::data::data_time_t last = 0;
+    while (true) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, sync_ms/2)) {
+            break;
+        }
+        assert(got.tps_size() == 1);
+        assert(got.tstart() >= last);
+        last = got.tstart();
+        ++nrecv;
+        if (nrecv == 1) {
+            const auto dt = ptmp::data::now() - t0;
+            zsys_info("first output after %.1f ms with sync time %d ms", 1e-3*dt, sync_ms);
+            assert(dt < 1000*sync_ms/2);
+        }
+    }
+    zsys_info("received %d of %d", nrecv, nsets*(ninputs-1));
+    assert(nrecv == nsets*(ninputs-1));
+}
+
+// Inputs are PUBs with topics and the tree subscribes to only the odd
+// detids.
+static void test_sub()
+{
+    const int ninputs = 6, nsets = 20, sync_ms = 100;
+    const std::string prefix = "inproc://test-zipper-tree-sub-";
+
+    std::vector<std::unique_ptr<ptmp::TPSender> > senders;
+    json zcfg;
+    zcfg["input"]["socket"]["type"] = "SUB";
+    for (int ind=0; ind<ninputs; ++ind) {
+        const std::string addr = prefix + std::to_string(ind);
+        json scfg = socket("PUB", "bind", addr);
+        scfg["socket"]["topic"] = true;
+        senders.emplace_back(new ptmp::TPSender(scfg.dump()));
+        zcfg["input"]["socket"]["connect"].push_back(addr);
+        if ((ind+1) % 2) {
+            zcfg["input"]["socket"]["subscriptions"].push_back(ind+1);
+        }
+    }
+    zcfg["output"] = socket("PUSH", "bind", prefix + "out");
+    zcfg["sync_time"] = sync_ms;
+    zcfg["fanout"] = 2;
+
+    ptmp::TPZipperTree tree(zcfg.dump());
+    ptmp::TPReceiver receiver(socket("PULL", "connect", prefix + "out").dump());
+    zclock_sleep(200);          // let the SUBs join
+
+    for (int count=0; count<nsets; ++count) {
+        for (int ind=0; ind<ninputs; ++ind) {
+            send_data(*senders[ind], ind+1, count+1, 1000*count + ind);
+        }
+    }
+
+    int nrecv = 0;
+    while (true) {
+        ptmp::data::TPSet got;
+        if (!receiver(got, 10*sync_ms)) {
+            break;
+        }
+        assert(got.detid() % 2);
+        ++nrecv;
+    }
+    zsys_info("received %d of %d subscribed", nrecv, nsets*ninputs/2);
+    assert(nrecv == nsets*ninputs/2);
+}
+
+int main()
+{
+    zsys_init();
+    test_pull();
+    test_sub();
+    return 0;
+}